@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirFdCache"
+
+#include "libfuse_jni/DirFdCache.h"
+
+#include <android-base/logging.h>
+#include <errno.h>
+#include <fcntl.h>
+
+namespace mediaprovider {
+namespace fuse {
+
+DirFdCache::DirFdCache(size_t max_fds) : max_fds_(max_fds), hits_(0), misses_(0), evictions_(0) {}
+
+std::shared_ptr<DirFd> DirFdCache::Get(uint64_t key, const std::string& path) {
+    if (!max_fds_) {
+        errno = ENOTSUP;
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return it->second.dir;
+        }
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    const int fd = open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == EMFILE || errno == ENFILE) {
+            // Give the fds of the least recently used half back
+            const int error = errno;
+            LOG(WARNING) << "Out of fds, closing directory fds";
+            std::lock_guard<std::mutex> guard(lock_);
+            EvictLocked(entries_.size() / 2);
+            errno = error;
+        }
+        return nullptr;
+    }
+    auto dir = std::make_shared<DirFd>(fd);
+
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        // Opened concurrently, ours is closed on return
+        return it->second.dir;
+    }
+    lru_.push_front(key);
+    entries_.emplace(key, Entry{dir, lru_.begin()});
+    EvictLocked(max_fds_);
+    return dir;
+}
+
+void DirFdCache::Remove(uint64_t key) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        lru_.erase(it->second.lru_pos);
+        entries_.erase(it);
+    }
+}
+
+void DirFdCache::Clear() {
+    std::lock_guard<std::mutex> guard(lock_);
+    entries_.clear();
+    lru_.clear();
+}
+
+void DirFdCache::EvictLocked(size_t size) {
+    while (entries_.size() > size) {
+        entries_.erase(lru_.back());
+        lru_.pop_back();
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+DirFdCache::Stats DirFdCache::GetStats() const {
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stats.open = entries_.size();
+    }
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirFdCacheTest"
+
+#include <android-base/file.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "libfuse_jni/DirFdCache.h"
+
+using namespace mediaprovider::fuse;
+
+class DirFdCacheTest : public ::testing::Test {
+  protected:
+    DirFdCacheTest() : cache(2) {}
+
+    ~DirFdCacheTest() {
+        for (const char* name : {"a", "b", "c"}) {
+            rmdir(Path(name).c_str());
+        }
+    }
+
+    std::string Path(const std::string& name) { return std::string(dir.path) + "/" + name; }
+
+    void CreateDir(const std::string& name) { ASSERT_EQ(0, mkdir(Path(name).c_str(), 0700)); }
+
+    TemporaryDir dir;
+    DirFdCache cache;
+};
+
+TEST_F(DirFdCacheTest, testResolvesEntriesRelativeToDir) {
+    CreateDir("a");
+    std::shared_ptr<DirFd> fd = cache.Get(1, dir.path);
+    ASSERT_NE(nullptr, fd);
+
+    struct stat st;
+    ASSERT_EQ(0, fstatat(fd->fd, "a", &st, AT_SYMLINK_NOFOLLOW));
+    EXPECT_TRUE(S_ISDIR(st.st_mode));
+}
+
+TEST_F(DirFdCacheTest, testReusesCachedFds) {
+    std::shared_ptr<DirFd> fd = cache.Get(1, dir.path);
+    ASSERT_NE(nullptr, fd);
+    EXPECT_EQ(fd, cache.Get(1, dir.path));
+
+    DirFdCache::Stats stats = cache.GetStats();
+    EXPECT_EQ(1, stats.open);
+    EXPECT_EQ(1, stats.hits);
+    EXPECT_EQ(1, stats.misses);
+}
+
+TEST_F(DirFdCacheTest, testEvictsLeastRecentlyUsed) {
+    CreateDir("a");
+    CreateDir("b");
+    CreateDir("c");
+    std::shared_ptr<DirFd> a = cache.Get(1, Path("a"));
+    std::shared_ptr<DirFd> b = cache.Get(2, Path("b"));
+    ASSERT_EQ(a, cache.Get(1, Path("a")));
+    ASSERT_NE(nullptr, cache.Get(3, Path("c")));
+
+    DirFdCache::Stats stats = cache.GetStats();
+    EXPECT_EQ(2, stats.open);
+    EXPECT_EQ(1, stats.evictions);
+    EXPECT_EQ(a, cache.Get(1, Path("a")));
+    EXPECT_NE(b, cache.Get(2, Path("b")));
+
+    // Evicted fds stay usable by those still holding them
+    struct stat st;
+    EXPECT_EQ(0, fstat(b->fd, &st));
+}
+
+TEST_F(DirFdCacheTest, testReopensRemovedFds) {
+    CreateDir("a");
+    std::shared_ptr<DirFd> fd = cache.Get(1, Path("a"));
+    ASSERT_NE(nullptr, fd);
+    ASSERT_EQ(0, rename(Path("a").c_str(), Path("b").c_str()));
+    CreateDir("a");
+
+    cache.Remove(1);
+    EXPECT_EQ(0, cache.GetStats().open);
+    std::shared_ptr<DirFd> reopened = cache.Get(1, Path("a"));
+    ASSERT_NE(nullptr, reopened);
+
+    struct stat renamed_st, st;
+    ASSERT_EQ(0, fstat(fd->fd, &renamed_st));
+    ASSERT_EQ(0, fstat(reopened->fd, &st));
+    EXPECT_NE(renamed_st.st_ino, st.st_ino);
+}
+
+TEST_F(DirFdCacheTest, testFailsForMissingDirs) {
+    EXPECT_EQ(nullptr, cache.Get(1, Path("a")));
+    EXPECT_EQ(ENOENT, errno);
+    EXPECT_EQ(0, cache.GetStats().open);
+}
+
+TEST_F(DirFdCacheTest, testDisabled) {
+    DirFdCache disabled(0);
+    EXPECT_FALSE(disabled.IsEnabled());
+    EXPECT_EQ(nullptr, disabled.Get(1, dir.path));
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirWalker"
+
+#include "libfuse_jni/DirWalker.h"
+
+#include <android-base/logging.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+// Large enough for most directories to be read by a single getdents64.
+constexpr size_t kDentsBufSize = 64 * 1024;
+
+void AppendRecord(std::vector<uint8_t>* data, int64_t size, int64_t mtime_ms, uint8_t type,
+                  const char* name, uint16_t name_len) {
+    const size_t pos = data->size();
+    data->resize(pos + DirWalker::kRecordHeaderSize + name_len);
+    uint8_t* record = data->data() + pos;
+    memcpy(record, &size, sizeof(size));
+    memcpy(record + 8, &mtime_ms, sizeof(mtime_ms));
+    memcpy(record + 16, &name_len, sizeof(name_len));
+    record[18] = type;
+    record[19] = 0;
+    memcpy(record + DirWalker::kRecordHeaderSize, name, name_len);
+}
+
+}  // namespace
+
+DirWalker::DirWalker(size_t threads, size_t max_buffered_bytes, const std::string& skip_pattern)
+    : max_buffered_bytes_(max_buffered_bytes),
+      skip_pattern_(skip_pattern, std::regex_constants::icase),
+      queues_(threads),
+      buffered_bytes_(0),
+      next_queue_(0),
+      stopping_(false),
+      listed_(0),
+      prefetched_(0),
+      entries_(0) {
+    for (size_t i = 0; i < threads; i++) {
+        threads_.emplace_back(&DirWalker::Loop, this, i);
+    }
+}
+
+DirWalker::~DirWalker() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+bool DirWalker::List(const std::string& dir, std::vector<uint8_t>* listing) {
+    std::unique_lock<std::mutex> lock(lock_);
+    auto it = listings_.end();
+    listed_cv_.wait(lock, [&] {
+        it = listings_.find(dir);
+        return it == listings_.end() || it->second.state != State::kListing;
+    });
+
+    if (it != listings_.end() && it->second.state == State::kListed) {
+        const int error = it->second.error;
+        *listing = std::move(it->second.data);
+        buffered_bytes_ -= listing->size();
+        listings_.erase(it);
+        lock.unlock();
+        work_cv_.notify_all();
+        if (error) {
+            errno = error;
+            return false;
+        }
+        return true;
+    }
+
+    // Not listed ahead yet, list it now rather than wait. Workers skip it meanwhile.
+    if (it == listings_.end()) {
+        listings_.emplace(dir, Listing{State::kListing, {}, 0});
+    } else {
+        it->second.state = State::kListing;
+    }
+    lock.unlock();
+
+    listing->clear();
+    std::vector<std::string> subdirs;
+    const int error = ListDir(dir, listing, &subdirs);
+
+    lock.lock();
+    listings_.erase(dir);
+    if (!queues_.empty()) {
+        QueueLocked(next_queue_++ % queues_.size(), &subdirs);
+    }
+    if (error) {
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+void DirWalker::Prune(const std::string& dir) {
+    const std::string prefix = dir + "/";
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto it = listings_.begin(); it != listings_.end();) {
+        if (it->first == dir || it->first.compare(0, prefix.size(), prefix) == 0) {
+            buffered_bytes_ -= it->second.data.size();
+            it = listings_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // Queued paths are skipped once gone from |listings_|
+    work_cv_.notify_all();
+}
+
+DirWalker::Stats DirWalker::GetStats() const {
+    Stats stats;
+    stats.listed = listed_.load(std::memory_order_relaxed);
+    stats.prefetched = prefetched_.load(std::memory_order_relaxed);
+    stats.entries = entries_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+int DirWalker::ListDir(const std::string& dir, std::vector<uint8_t>* data,
+                       std::vector<std::string>* subdirs) {
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+
+    thread_local std::vector<char> buf(kDentsBufSize);
+    int error = 0;
+    while (true) {
+        const long len = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+        if (len < 0) {
+            error = errno;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        for (long pos = 0; pos < len;) {
+            const struct dirent64* d = reinterpret_cast<const struct dirent64*>(&buf[pos]);
+            pos += d->d_reclen;
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+                continue;
+            }
+
+            // Only what the scanner compares against the database
+            struct statx st;
+            if (statx(fd, d->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                      STATX_TYPE | STATX_SIZE | STATX_MTIME, &st) < 0) {
+                // The scanner then treats the entry as gone, like those removed meanwhile
+                if (errno != ENOENT) {
+                    PLOG(WARNING) << "Failed to stat entry of " << dir;
+                }
+                continue;
+            }
+            const int64_t mtime_ms = st.stx_mtime.tv_sec * 1000LL + st.stx_mtime.tv_nsec / 1000000;
+            AppendRecord(data, st.stx_size, mtime_ms, IFTODT(st.stx_mode), d->d_name,
+                         strlen(d->d_name));
+            entries_.fetch_add(1, std::memory_order_relaxed);
+            if (S_ISDIR(st.stx_mode)) {
+                std::string subdir = dir + "/" + d->d_name;
+                if (!std::regex_match(subdir, skip_pattern_)) {
+                    subdirs->push_back(std::move(subdir));
+                }
+            }
+        }
+    }
+    close(fd);
+    listed_.fetch_add(1, std::memory_order_relaxed);
+    return error;
+}
+
+void DirWalker::QueueLocked(size_t worker, std::vector<std::string>* subdirs) {
+    // Pushed last first, so that the worker pops them in the order the walk visits them
+    std::deque<std::string>& queue = queues_[worker];
+    bool queued = false;
+    for (auto it = subdirs->rbegin(); it != subdirs->rend(); ++it) {
+        if (listings_.emplace(*it, Listing{State::kQueued, {}, 0}).second) {
+            queue.push_back(std::move(*it));
+            queued = true;
+        }
+    }
+    if (queued) {
+        work_cv_.notify_all();
+    }
+}
+
+bool DirWalker::NextLocked(size_t worker, std::unique_lock<std::mutex>* lock, std::string* dir) {
+    auto take = [this, dir](std::string path) {
+        auto it = listings_.find(path);
+        if (it == listings_.end() || it->second.state != State::kQueued) {
+            // Pruned, or listed on demand
+            return false;
+        }
+        it->second.state = State::kListing;
+        *dir = std::move(path);
+        return true;
+    };
+
+    while (!stopping_) {
+        if (buffered_bytes_ < max_buffered_bytes_) {
+            std::deque<std::string>& own = queues_[worker];
+            while (!own.empty()) {
+                std::string path = std::move(own.back());
+                own.pop_back();
+                if (take(std::move(path))) {
+                    return true;
+                }
+            }
+            for (size_t i = 1; i < queues_.size(); i++) {
+                std::deque<std::string>& other = queues_[(worker + i) % queues_.size()];
+                while (!other.empty()) {
+                    std::string path = std::move(other.front());
+                    other.pop_front();
+                    if (take(std::move(path))) {
+                        return true;
+                    }
+                }
+            }
+        }
+        work_cv_.wait(*lock);
+    }
+    return false;
+}
+
+void DirWalker::Loop(size_t worker) {
+    std::unique_lock<std::mutex> lock(lock_);
+    std::string dir;
+    while (NextLocked(worker, &lock, &dir)) {
+        lock.unlock();
+        std::vector<uint8_t> data;
+        std::vector<std::string> subdirs;
+        const int error = ListDir(dir, &data, &subdirs);
+        lock.lock();
+
+        auto it = listings_.find(dir);
+        if (it == listings_.end()) {
+            // Pruned while being listed
+            continue;
+        }
+        prefetched_.fetch_add(1, std::memory_order_relaxed);
+        buffered_bytes_ += data.size();
+        it->second.state = State::kListed;
+        it->second.data = std::move(data);
+        it->second.error = error;
+        QueueLocked(worker, &subdirs);
+        listed_cv_.notify_all();
+    }
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
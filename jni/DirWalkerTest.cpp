@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirWalkerTest"
+
+#include <android-base/file.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "libfuse_jni/DirWalker.h"
+
+using namespace mediaprovider::fuse;
+
+class DirWalkerTest : public ::testing::Test {
+  protected:
+    struct Entry {
+        int64_t size;
+        uint8_t type;
+    };
+
+    ~DirWalkerTest() {
+        for (auto it = created_.rbegin(); it != created_.rend(); ++it) {
+            remove(it->c_str());
+        }
+    }
+
+    std::string Path(const std::string& name) { return std::string(dir.path) + "/" + name; }
+
+    void CreateFile(const std::string& name, const std::string& content) {
+        ASSERT_TRUE(android::base::WriteStringToFile(content, Path(name)));
+        created_.push_back(Path(name));
+    }
+
+    void CreateDir(const std::string& name) {
+        ASSERT_EQ(0, mkdir(Path(name).c_str(), 0700));
+        created_.push_back(Path(name));
+    }
+
+    // Creates |count| directories with a file each, below a directory each.
+    void CreateTree(int count) {
+        for (int i = 0; i < count; i++) {
+            const std::string parent = "d" + std::to_string(i);
+            CreateDir(parent);
+            CreateDir(parent + "/sub");
+            CreateFile(parent + "/sub/f", "x");
+        }
+    }
+
+    static std::map<std::string, Entry> Parse(const std::vector<uint8_t>& listing) {
+        std::map<std::string, Entry> entries;
+        for (size_t pos = 0; pos < listing.size();) {
+            Entry entry;
+            uint16_t name_len;
+            memcpy(&entry.size, &listing[pos], sizeof(entry.size));
+            memcpy(&name_len, &listing[pos + 16], sizeof(name_len));
+            entry.type = listing[pos + 18];
+            const char* name =
+                    reinterpret_cast<const char*>(&listing[pos + DirWalker::kRecordHeaderSize]);
+            entries[std::string(name, name_len)] = entry;
+            pos += DirWalker::kRecordHeaderSize + name_len;
+        }
+        return entries;
+    }
+
+    // Walks the tree depth first like the media scanner, returns the number of files found.
+    static int Walk(DirWalker* walker, const std::string& dir) {
+        std::vector<uint8_t> listing;
+        if (!walker->List(dir, &listing)) {
+            return 0;
+        }
+        int files = 0;
+        for (const auto& entry : Parse(listing)) {
+            if (entry.second.type == DT_DIR) {
+                files += Walk(walker, dir + "/" + entry.first);
+            } else {
+                files++;
+            }
+        }
+        return files;
+    }
+
+    std::vector<std::string> created_;
+    TemporaryDir dir;
+};
+
+TEST_F(DirWalkerTest, testListsEntries) {
+    CreateFile("a", "abc");
+    CreateDir("b");
+    DirWalker walker(0, 0);
+
+    std::vector<uint8_t> listing;
+    ASSERT_TRUE(walker.List(dir.path, &listing));
+    std::map<std::string, Entry> entries = Parse(listing);
+    ASSERT_EQ(2, entries.size());
+    EXPECT_EQ(3, entries["a"].size);
+    EXPECT_EQ(DT_REG, entries["a"].type);
+    EXPECT_EQ(DT_DIR, entries["b"].type);
+}
+
+TEST_F(DirWalkerTest, testListsMtime) {
+    CreateFile("a", "");
+    struct timespec times[2] = {{0, UTIME_OMIT}, {1234, 567000000}};
+    ASSERT_EQ(0, utimensat(AT_FDCWD, Path("a").c_str(), times, 0));
+    DirWalker walker(0, 0);
+
+    std::vector<uint8_t> listing;
+    ASSERT_TRUE(walker.List(dir.path, &listing));
+    int64_t mtime_ms;
+    memcpy(&mtime_ms, &listing[8], sizeof(mtime_ms));
+    EXPECT_EQ(1234567, mtime_ms);
+}
+
+TEST_F(DirWalkerTest, testListsAhead) {
+    CreateTree(20);
+    DirWalker walker(4, 1 << 20);
+
+    EXPECT_EQ(20, Walk(&walker, dir.path));
+    DirWalker::Stats stats = walker.GetStats();
+    EXPECT_EQ(41, stats.listed);
+    EXPECT_EQ(60, stats.entries);
+}
+
+TEST_F(DirWalkerTest, testWalksWithoutRoomToListAhead) {
+    CreateTree(5);
+    DirWalker walker(2, 0);
+
+    EXPECT_EQ(5, Walk(&walker, dir.path));
+    EXPECT_EQ(0, walker.GetStats().prefetched);
+}
+
+TEST_F(DirWalkerTest, testPrunesSkippedDirs) {
+    CreateTree(3);
+    DirWalker walker(2, 1 << 20);
+
+    std::vector<uint8_t> listing;
+    ASSERT_TRUE(walker.List(dir.path, &listing));
+    walker.Prune(Path("d1"));
+    EXPECT_EQ(1, Walk(&walker, Path("d0")));
+    EXPECT_EQ(1, Walk(&walker, Path("d2")));
+}
+
+TEST_F(DirWalkerTest, testFailsForMissingDirs) {
+    DirWalker walker(2, 1 << 20);
+    std::vector<uint8_t> listing;
+    EXPECT_FALSE(walker.List(Path("missing"), &listing));
+    EXPECT_EQ(ENOENT, errno);
+}
+
+TEST_F(DirWalkerTest, testSkippedDirsAreNotListedAhead) {
+    CreateTree(3);
+    CreateDir("d1/sub/deeper");
+    DirWalker walker(2, 1 << 20, ".*/D1(/.*)?$");
+
+    // Like the scanner, the walk doesn't descend into d1
+    std::vector<uint8_t> listing;
+    ASSERT_TRUE(walker.List(dir.path, &listing));
+    EXPECT_EQ(1, Walk(&walker, Path("d0")));
+    EXPECT_EQ(1, Walk(&walker, Path("d2")));
+    EXPECT_EQ(5, walker.GetStats().listed);
+
+    // But can still list it on demand
+    EXPECT_EQ(1, Walk(&walker, Path("d1")));
+}
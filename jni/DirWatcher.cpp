@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirWatcher"
+
+#include "libfuse_jni/DirWatcher.h"
+
+#include <android-base/logging.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+DirWatcher::DirWatcher(size_t max_watches, Callback callback, FileCallback file_callback)
+    : max_watches_(max_watches),
+      callback_(std::move(callback)),
+      file_callback_(std::move(file_callback)),
+      inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+      stop_fd_(eventfd(0, EFD_CLOEXEC)),
+      changes_(0),
+      overflows_(0) {
+    if (inotify_fd_ < 0 || stop_fd_ < 0) {
+        PLOG(ERROR) << "Failed to set up the directory watcher";
+        return;
+    }
+    thread_ = std::thread(&DirWatcher::Loop, this);
+}
+
+DirWatcher::~DirWatcher() {
+    if (thread_.joinable()) {
+        const uint64_t stop = 1;
+        if (write(stop_fd_, &stop, sizeof(stop)) != sizeof(stop)) {
+            PLOG(FATAL) << "Failed to stop the directory watcher";
+        }
+        thread_.join();
+    }
+    if (inotify_fd_ >= 0) {
+        close(inotify_fd_);
+    }
+    if (stop_fd_ >= 0) {
+        close(stop_fd_);
+    }
+}
+
+bool DirWatcher::IsStarted() const {
+    return thread_.joinable();
+}
+
+bool DirWatcher::Watch(const std::string& dir) {
+    return AddWatch(dir, false /* file */);
+}
+
+bool DirWatcher::WatchFile(const std::string& path) {
+    return AddWatch(path, true /* file */);
+}
+
+bool DirWatcher::AddWatch(const std::string& path, bool file) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (watches_.find(path) != watches_.end()) {
+        return true;
+    }
+    if (!thread_.joinable() || watches_.size() >= max_watches_) {
+        return false;
+    }
+
+    const int wd = inotify_add_watch(inotify_fd_, path.c_str(), file ? kFileMask : kMask);
+    if (wd < 0) {
+        PLOG(DEBUG) << "Failed to watch " << path;
+        return false;
+    }
+    watches_.emplace(path, wd);
+    watched_.emplace(wd, Watched{path, file});
+    return true;
+}
+
+bool DirWatcher::IsWatched(const std::string& path) const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return watches_.find(path) != watches_.end();
+}
+
+void DirWatcher::Unwatch(const std::string& path) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = watches_.find(path);
+    if (it == watches_.end()) {
+        return;
+    }
+    const int wd = it->second;
+    inotify_rm_watch(inotify_fd_, wd);
+    ForgetLocked(wd);
+}
+
+DirWatcher::Stats DirWatcher::GetStats() const {
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stats.watches = watches_.size();
+    }
+    stats.changes = changes_.load(std::memory_order_relaxed);
+    stats.overflows = overflows_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void DirWatcher::ForgetLocked(int wd) {
+    if (watched_.erase(wd) == 0) {
+        return;
+    }
+    for (auto it = watches_.begin(); it != watches_.end();) {
+        if (it->second == wd) {
+            it = watches_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void DirWatcher::HandleEvent(const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Entries may now stay stale until their timeout, but files can be reported as written
+        overflows_.fetch_add(1, std::memory_order_relaxed);
+        LOG(WARNING) << "Directory watch events were dropped";
+        std::vector<std::string> files;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            for (const auto& watched : watched_) {
+                if (watched.second.file) {
+                    files.push_back(watched.second.path);
+                }
+            }
+        }
+        for (const std::string& file : files) {
+            file_callback_(file, false /* closed */);
+        }
+        return;
+    }
+
+    Watched watched;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (event->mask & IN_IGNORED) {
+            // The directory or file was removed, or its watch was
+            ForgetLocked(event->wd);
+            return;
+        }
+        auto it = watched_.find(event->wd);
+        if (it == watched_.end()) {
+            // Already forgotten
+            return;
+        }
+        watched = it->second;
+        if (event->mask & IN_MOVE_SELF) {
+            // The name we watch it under is stale. Directories are watched again under the new
+            // one when looked up, and the entry of the old one is reported by the parent if
+            // watched.
+            inotify_rm_watch(inotify_fd_, event->wd);
+            ForgetLocked(event->wd);
+            if (!watched.file) {
+                return;
+            }
+        }
+    }
+
+    if (watched.file) {
+        changes_.fetch_add(1, std::memory_order_relaxed);
+        file_callback_(watched.path, event->mask & IN_CLOSE_WRITE);
+        return;
+    }
+    if (event->len == 0) {
+        // A change to the directory itself rather than an entry
+        return;
+    }
+
+    const std::string& dir = watched.path;
+    const bool replaced = event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    changes_.fetch_add(1, std::memory_order_relaxed);
+    callback_(dir, event->name, replaced);
+}
+
+void DirWatcher::Loop() {
+    alignas(struct inotify_event) char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOG(ERROR) << "Failed to wait for directory watch events";
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+
+        ssize_t len;
+        while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+            for (char* ptr = buf; ptr < buf + len;) {
+                const struct inotify_event* event = reinterpret_cast<struct inotify_event*>(ptr);
+                HandleEvent(event);
+                ptr += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (len < 0 && errno != EAGAIN && errno != EINTR) {
+            PLOG(ERROR) << "Failed to read directory watch events";
+            return;
+        }
+    }
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
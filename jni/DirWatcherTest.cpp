@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirWatcherTest"
+
+#include <android-base/file.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "libfuse_jni/DirWatcher.h"
+
+using namespace mediaprovider::fuse;
+
+class DirWatcherTest : public ::testing::Test {
+  protected:
+    struct Change {
+        std::string path;
+        // Whether the entry was replaced, or for files whether the file was closed
+        bool flag;
+    };
+
+    DirWatcherTest()
+        : watcher(
+                  2,
+                  [this](const std::string& dir, const std::string& name, bool replaced) {
+                      Report(dir + "/" + name, replaced);
+                  },
+                  [this](const std::string& path, bool closed) { Report(path, closed); }) {}
+
+    ~DirWatcherTest() {
+        for (auto it = created_.rbegin(); it != created_.rend(); ++it) {
+            remove(it->c_str());
+        }
+    }
+
+    std::string Path(const std::string& name) { return std::string(dir.path) + "/" + name; }
+
+    void CreateFile(const std::string& name) {
+        const std::string path = Path(name);
+        const int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(0, close(fd));
+        created_.push_back(path);
+    }
+
+    void CreateDir(const std::string& name) {
+        const std::string path = Path(name);
+        ASSERT_EQ(0, mkdir(path.c_str(), 0700));
+        created_.push_back(path);
+    }
+
+    // Waits for the next change reported, returns false if there's none.
+    bool NextChange(Change* change) {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!cv_.wait_for(lock, std::chrono::seconds(5), [this] { return !changes_.empty(); })) {
+            return false;
+        }
+        *change = changes_.front();
+        changes_.erase(changes_.begin());
+        return true;
+    }
+
+    void Report(const std::string& path, bool flag) {
+        std::lock_guard<std::mutex> guard(lock_);
+        changes_.push_back({path, flag});
+        cv_.notify_all();
+    }
+
+    bool HasChanges() {
+        std::lock_guard<std::mutex> guard(lock_);
+        return !changes_.empty();
+    }
+
+    std::vector<std::string> created_;
+    // Declared before the watcher, which reports changes until it's destroyed.
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::vector<Change> changes_;
+
+    TemporaryDir dir;
+    DirWatcher watcher;
+};
+
+TEST_F(DirWatcherTest, testReportsRemovedEntries) {
+    CreateFile("a");
+    ASSERT_TRUE(watcher.Watch(dir.path));
+
+    ASSERT_EQ(0, unlink(Path("a").c_str()));
+    Change change;
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("a"), change.path);
+    EXPECT_TRUE(change.flag);
+}
+
+TEST_F(DirWatcherTest, testReportsRenamedEntries) {
+    CreateFile("a");
+    ASSERT_TRUE(watcher.Watch(dir.path));
+
+    ASSERT_EQ(0, rename(Path("a").c_str(), Path("b").c_str()));
+    Change change;
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("a"), change.path);
+    EXPECT_TRUE(change.flag);
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("b"), change.path);
+    EXPECT_TRUE(change.flag);
+    ASSERT_EQ(0, unlink(Path("b").c_str()));
+}
+
+TEST_F(DirWatcherTest, testReportsAttributeChanges) {
+    CreateFile("a");
+    ASSERT_TRUE(watcher.Watch(dir.path));
+
+    ASSERT_EQ(0, chmod(Path("a").c_str(), 0644));
+    Change change;
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("a"), change.path);
+    EXPECT_FALSE(change.flag);
+}
+
+TEST_F(DirWatcherTest, testIgnoresCreatedEntries) {
+    ASSERT_TRUE(watcher.Watch(dir.path));
+
+    // Nothing can be cached for a name that didn't exist
+    CreateDir("a");
+    ASSERT_EQ(0, rmdir(Path("a").c_str()));
+    Change change;
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("a"), change.path);
+    EXPECT_TRUE(change.flag);
+    EXPECT_FALSE(HasChanges());
+}
+
+TEST_F(DirWatcherTest, testLimitsWatches) {
+    CreateDir("a");
+    CreateDir("b");
+    ASSERT_TRUE(watcher.Watch(Path("a")));
+    ASSERT_TRUE(watcher.Watch(Path("a")));
+    ASSERT_TRUE(watcher.Watch(Path("b")));
+    EXPECT_FALSE(watcher.Watch(dir.path));
+    EXPECT_EQ(2, watcher.GetStats().watches);
+}
+
+TEST_F(DirWatcherTest, testForgetsRemovedDirs) {
+    CreateDir("a");
+    ASSERT_TRUE(watcher.Watch(Path("a")));
+    ASSERT_EQ(1, watcher.GetStats().watches);
+
+    ASSERT_EQ(0, rmdir(Path("a").c_str()));
+    for (int i = 0; i < 500 && watcher.GetStats().watches; i++) {
+        usleep(10000);
+    }
+    EXPECT_EQ(0, watcher.GetStats().watches);
+    EXPECT_FALSE(watcher.Watch(Path("a")));
+}
+
+TEST_F(DirWatcherTest, testForgetsRenamedDirs) {
+    CreateDir("a");
+    ASSERT_TRUE(watcher.Watch(Path("a")));
+
+    ASSERT_EQ(0, rename(Path("a").c_str(), Path("b").c_str()));
+    for (int i = 0; i < 500 && watcher.GetStats().watches; i++) {
+        usleep(10000);
+    }
+    EXPECT_EQ(0, watcher.GetStats().watches);
+    ASSERT_EQ(0, rmdir(Path("b").c_str()));
+}
+
+TEST_F(DirWatcherTest, testDoesNotWatchFiles) {
+    CreateFile("a");
+    EXPECT_FALSE(watcher.Watch(Path("a")));
+    EXPECT_EQ(0, watcher.GetStats().watches);
+}
+
+TEST_F(DirWatcherTest, testReportsFileWrites) {
+    CreateFile("a");
+    const int fd = open(Path("a").c_str(), O_WRONLY | O_CLOEXEC);
+    ASSERT_GE(fd, 0);
+    ASSERT_TRUE(watcher.WatchFile(Path("a")));
+    EXPECT_TRUE(watcher.IsWatched(Path("a")));
+
+    ASSERT_EQ(1, write(fd, "x", 1));
+    Change change;
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("a"), change.path);
+    EXPECT_FALSE(change.flag);
+
+    ASSERT_EQ(0, close(fd));
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("a"), change.path);
+    EXPECT_TRUE(change.flag);
+}
+
+TEST_F(DirWatcherTest, testIgnoresUnwatchedFiles) {
+    CreateFile("a");
+    ASSERT_TRUE(watcher.WatchFile(Path("a")));
+    watcher.Unwatch(Path("a"));
+    EXPECT_FALSE(watcher.IsWatched(Path("a")));
+    EXPECT_EQ(0, watcher.GetStats().watches);
+
+    const int fd = open(Path("a").c_str(), O_WRONLY | O_CLOEXEC);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(1, write(fd, "x", 1));
+    ASSERT_EQ(0, close(fd));
+    usleep(100000);
+    EXPECT_FALSE(HasChanges());
+}
+
+TEST_F(DirWatcherTest, testForgetsRenamedFiles) {
+    CreateFile("a");
+    ASSERT_TRUE(watcher.WatchFile(Path("a")));
+
+    ASSERT_EQ(0, rename(Path("a").c_str(), Path("b").c_str()));
+    Change change;
+    ASSERT_TRUE(NextChange(&change));
+    EXPECT_EQ(Path("a"), change.path);
+    EXPECT_FALSE(change.flag);
+    EXPECT_FALSE(watcher.IsWatched(Path("a")));
+    ASSERT_EQ(0, unlink(Path("b").c_str()));
+}
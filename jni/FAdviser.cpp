@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FAdviser"
+
+#include "libfuse_jni/FAdviser.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+constexpr size_t kMiB = 1024 * 1024;
+
+// Thresholds used if they're neither set nor can be derived from the memory available.
+constexpr size_t kDefaultThreshold = 64 * kMiB;
+constexpr size_t kDefaultTarget = 32 * kMiB;
+
+// Derived thresholds: a fraction of the memory available, within bounds, and lowered under
+// memory pressure. The target is half of the threshold.
+constexpr size_t kMemAvailableDivisor = 32;
+constexpr size_t kMinThreshold = 8 * kMiB;
+constexpr size_t kMaxThreshold = 256 * kMiB;
+constexpr size_t kPressureDivisor = 4;
+
+// Share of the last 10s during which some task stalled on memory, in percent, above which memory
+// is considered under pressure.
+constexpr double kPressureAvg10 = 10.0;
+
+// How often memory pressure and the memory available are read.
+constexpr uint64_t kMemoryPollDrains = 10;
+
+// A record continues a sequential stream if it starts this close to where the previous one
+// ended. Records of a stream read by several threads arrive slightly out of order.
+constexpr off_t kSequentialSlack = 4 * kMiB;
+// Records in a row that make a stream sequential.
+constexpr int kSequentialRuns = 2;
+// Drop-behind leaves that many bytes cached behind the stream, for readers slightly behind, and
+// fadvises at least that many bytes at once.
+constexpr off_t kDropBehindLag = 8 * kMiB;
+constexpr off_t kDropBehindChunk = 4 * kMiB;
+
+// How often the advisor thread drains the rings when no fd gets closed.
+constexpr std::chrono::milliseconds kDrainInterval(100);
+
+std::atomic_uint64_t next_adviser_id(1);
+
+// Reads the "some avg10" value of a PSI file.
+bool ReadPressureAvg10(const std::string& path, double* avg10) {
+    std::string content;
+    if (!android::base::ReadFileToString(path, &content)) return false;
+
+    for (const std::string& line : android::base::Split(content, "\n")) {
+        if (android::base::StartsWith(line, "some ")) {
+            return sscanf(line.c_str(), "some avg10=%lf", avg10) == 1;
+        }
+    }
+    return false;
+}
+
+bool ReadMemAvailable(const std::string& path, uint64_t* bytes) {
+    std::string content;
+    if (!android::base::ReadFileToString(path, &content)) return false;
+
+    for (const std::string& line : android::base::Split(content, "\n")) {
+        unsigned long long kb;
+        if (sscanf(line.c_str(), "MemAvailable: %llu kB", &kb) == 1) {
+            *bytes = kb * 1024;
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+bool FAdviser::Ring::Push(const Message& message, bool* half_full) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    const size_t used = head - tail_.load(std::memory_order_acquire);
+    *half_full = used + 1 >= kCapacity / 2;
+    if (used == kCapacity) {
+        lost.store(lost.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    messages_[head % kCapacity] = message;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void FAdviser::Ring::Drain(std::vector<Message>* out) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+        out->push_back(messages_[tail % kCapacity]);
+    }
+    tail_.store(tail, std::memory_order_release);
+}
+
+FAdviser::ThreadState::~ThreadState() {
+    Release();
+}
+
+void FAdviser::ThreadState::Release() {
+    if (!ring) return;
+
+    ring->orphaned.store(true, std::memory_order_release);
+    ring.reset();
+}
+
+FAdviser::FAdviser() : FAdviser(Options()) {}
+
+FAdviser::FAdviser(const Options& options)
+    : id_(next_adviser_id.fetch_add(1, std::memory_order_relaxed)),
+      options_(options),
+      quit_(false),
+      drain_requested_(false),
+      total_size_(0),
+      threshold_(kDefaultThreshold),
+      target_(kDefaultTarget),
+      memory_pressure_(false),
+      drain_count_(0),
+      dropped_bytes_(),
+      thread_(&FAdviser::MessageLoop, this) {}
+
+FAdviser::~FAdviser() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        quit_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+FAdviser::ThreadState& FAdviser::GetThreadState(FAdviser* adviser) {
+    static thread_local ThreadState state;
+
+    if (state.adviser_id != adviser->id_) {
+        // Hand the ring of the previous FAdviser back, it might still be alive
+        state.Release();
+        state.adviser_id = adviser->id_;
+        state.ring = adviser->AcquireRing();
+    }
+    return state;
+}
+
+std::shared_ptr<FAdviser::Ring> FAdviser::AcquireRing() {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    // Take over the ring of a thread that exited, if any; records it didn't drain yet stay in it
+    for (auto& ring : rings_) {
+        bool orphaned = true;
+        if (ring->orphaned.compare_exchange_strong(orphaned, false, std::memory_order_acquire)) {
+            return ring;
+        }
+    }
+    rings_.push_back(std::make_shared<Ring>());
+    return rings_.back();
+}
+
+void FAdviser::Record(int fd, off_t offset, size_t size) {
+    ThreadState& state = GetThreadState(this);
+
+    bool half_full;
+    state.ring->Push({fd, offset, static_cast<off_t>(offset + size), size}, &half_full);
+    if (half_full && !drain_requested_.exchange(true, std::memory_order_relaxed)) {
+        // Notifying doesn't need the lock. A wakeup missed here only delays the drain until the
+        // next interval.
+        cv_.notify_one();
+    }
+}
+
+void FAdviser::Close(int fd) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        closes_.push_back(fd);
+    }
+    cv_.notify_one();
+}
+
+FAdviser::Stats FAdviser::GetStats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
+
+const char* FAdviser::ReasonToString(Reason reason) {
+    switch (reason) {
+        case kReasonSize:
+            return "size";
+        case kReasonLru:
+            return "lru";
+        case kReasonDropBehind:
+            return "drop_behind";
+        default:
+            return "unknown";
+    }
+}
+
+void FAdviser::RecordImpl(const Message& message) {
+    File& file = files_[message.fd];
+    file.size += message.size;
+    file.last_used = drain_count_;
+    total_size_ += message.size;
+
+    if (file.next_offset >= 0 && message.start >= file.next_offset - kSequentialSlack &&
+        message.start <= file.next_offset + kSequentialSlack) {
+        file.sequential_run++;
+        file.next_offset = std::max(file.next_offset, message.end);
+    } else {
+        // Possibly the start of a new stream, nothing before it belongs to it
+        file.sequential_run = 0;
+        file.next_offset = message.end;
+        file.dropped_until = message.start;
+    }
+
+    if (options_.drop_behind && file.sequential_run >= kSequentialRuns) {
+        DropBehind(message.fd, &file);
+    }
+}
+
+void FAdviser::DropBehind(int fd, File* file) {
+    const off_t drop_end = file->next_offset - kDropBehindLag;
+    if (drop_end - file->dropped_until < kDropBehindChunk) return;
+
+    const size_t dropped = drop_end - file->dropped_until;
+    posix_fadvise(fd, file->dropped_until, dropped, POSIX_FADV_DONTNEED);
+    file->dropped_until = drop_end;
+    dropped_bytes_[kReasonDropBehind] += dropped;
+
+    // These bytes no longer take space in the page cache
+    const size_t untracked = std::min(dropped, file->size);
+    file->size -= untracked;
+    total_size_ -= untracked;
+}
+
+void FAdviser::Evict() {
+    if (total_size_ < threshold_) return;
+
+    Reason reason;
+    switch (options_.policy) {
+        case Policy::kSize:
+            reason = kReasonSize;
+            break;
+        case Policy::kLru:
+            reason = kReasonLru;
+            break;
+        default:
+            reason = memory_pressure_ ? kReasonSize : kReasonLru;
+            break;
+    }
+
+    LOG(INFO) << "Threshold exceeded - fadvising " << total_size_ << " by "
+              << ReasonToString(reason);
+    while (!files_.empty() && total_size_ > target_) {
+        auto victim = files_.begin();
+        for (auto file = files_.begin(); file != files_.end(); ++file) {
+            if (reason == kReasonSize ? file->second.size > victim->second.size
+                                      : file->second.last_used < victim->second.last_used) {
+                victim = file;
+            }
+        }
+        Drop(victim, reason);
+    }
+    LOG(INFO) << "Threshold now " << total_size_;
+}
+
+void FAdviser::Drop(std::map<int, File>::iterator file, Reason reason) {
+    posix_fadvise(file->first, 0, 0, POSIX_FADV_DONTNEED);
+    total_size_ -= file->second.size;
+    dropped_bytes_[reason] += file->second.size;
+    files_.erase(file);
+}
+
+void FAdviser::CloseImpl(int fd) {
+    auto file = files_.find(fd);
+    if (file == files_.end()) return;
+
+    total_size_ -= file->second.size;
+    files_.erase(file);
+}
+
+void FAdviser::UpdateMemoryState() {
+    double avg10;
+    memory_pressure_ = ReadPressureAvg10(options_.psi_path, &avg10) && avg10 >= kPressureAvg10;
+
+    if (options_.threshold) {
+        threshold_ = options_.threshold;
+        target_ = options_.target;
+        return;
+    }
+
+    uint64_t mem_available;
+    if (!ReadMemAvailable(options_.meminfo_path, &mem_available)) {
+        threshold_ = kDefaultThreshold;
+        target_ = kDefaultTarget;
+        return;
+    }
+
+    size_t threshold = mem_available / kMemAvailableDivisor;
+    if (memory_pressure_) {
+        threshold /= kPressureDivisor;
+    }
+    threshold_ = std::clamp(threshold, kMinThreshold, kMaxThreshold);
+    target_ = threshold_ / 2;
+}
+
+void FAdviser::MessageLoop() {
+    std::vector<Message> messages;
+    std::vector<int> closes;
+
+    while (true) {
+        bool quit;
+        uint64_t lost = 0;
+
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cv_.wait_for(lock, kDrainInterval, [this] {
+                return quit_ || !closes_.empty() ||
+                       drain_requested_.load(std::memory_order_relaxed);
+            });
+            drain_requested_.store(false, std::memory_order_relaxed);
+
+            quit = quit_;
+            closes.swap(closes_);
+            // Records are drained along with the closes, so that the records a thread pushed
+            // before an fd got closed are never applied after the close
+            for (auto& ring : rings_) {
+                ring->Drain(&messages);
+                lost += ring->lost.load(std::memory_order_relaxed);
+            }
+        }
+
+        if (drain_count_++ % kMemoryPollDrains == 0) {
+            UpdateMemoryState();
+        }
+        for (const Message& message : messages) {
+            RecordImpl(message);
+        }
+        Evict();
+        for (int fd : closes) {
+            CloseImpl(fd);
+        }
+        messages.clear();
+        closes.clear();
+
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stats_.tracked_bytes = total_size_;
+            stats_.threshold = threshold_;
+            stats_.target = target_;
+            stats_.memory_pressure = memory_pressure_;
+            std::copy(dropped_bytes_, dropped_bytes_ + kReasonCount, stats_.dropped_bytes);
+            stats_.lost_records = lost;
+        }
+
+        if (quit) return;
+    }
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
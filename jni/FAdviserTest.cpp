@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FAdviserTest"
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libfuse_jni/FAdviser.h"
+
+using namespace mediaprovider::fuse;
+using namespace std::chrono_literals;
+
+constexpr size_t kMiB = 1024 * 1024;
+
+class FAdviserTest : public ::testing::Test {
+  protected:
+    // Options with fixed thresholds and drop-behind disabled, so that each test only exercises
+    // what it enables.
+    FAdviser::Options GetOptions(size_t threshold = 64 * kMiB, size_t target = 32 * kMiB) {
+        FAdviser::Options options;
+        options.policy = FAdviser::Policy::kSize;
+        options.threshold = threshold;
+        options.target = target;
+        options.drop_behind = false;
+        options.psi_path = psi_file.path;
+        options.meminfo_path = meminfo_file.path;
+        return options;
+    }
+
+    void SetMemoryState(double avg10, uint64_t mem_available_kb) {
+        ASSERT_TRUE(android::base::WriteStringToFile(
+                "some avg10=" + std::to_string(avg10) + " avg60=0.00 avg300=0.00 total=0\n"
+                "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n",
+                psi_file.path));
+        ASSERT_TRUE(android::base::WriteStringToFile(
+                "MemTotal:        4000000 kB\n"
+                "MemFree:          100000 kB\n"
+                "MemAvailable:    " + std::to_string(mem_available_kb) + " kB\n",
+                meminfo_file.path));
+    }
+
+    // Waits until the advisor thread published stats matching |predicate|.
+    static bool WaitForStats(const FAdviser& adviser,
+                             const std::function<bool(const FAdviser::Stats&)>& predicate) {
+        for (int i = 0; i < 100; i++) {
+            if (predicate(adviser.GetStats())) return true;
+            std::this_thread::sleep_for(20ms);
+        }
+        return false;
+    }
+
+    TemporaryFile psi_file;
+    TemporaryFile meminfo_file;
+};
+
+TEST_F(FAdviserTest, testRecordsOfIdleThreadsAreTracked) {
+    FAdviser adviser(GetOptions());
+
+    // A thread that goes idle after a few small records doesn't hold them back
+    std::thread([&adviser] {
+        for (int i = 0; i < 4; i++) {
+            adviser.Record(100, i * 4096, 4096);
+        }
+        EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+            return stats.tracked_bytes == 4 * 4096;
+        }));
+    }).join();
+}
+
+TEST_F(FAdviserTest, testFullRingIsDrainedEarly) {
+    FAdviser adviser(GetOptions(1024 * kMiB, 512 * kMiB));
+
+    // More records than a ring holds, faster than the drain interval
+    for (int i = 0; i < 1024; i++) {
+        adviser.Record(100, i * 4096, 4096);
+        if (i % 64 == 63) {
+            std::this_thread::sleep_for(1ms);
+        }
+    }
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 1024 * 4096;
+    }));
+    EXPECT_EQ(0, adviser.GetStats().lost_records);
+}
+
+TEST_F(FAdviserTest, testRecordsFromManyThreads) {
+    FAdviser adviser(GetOptions());
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&adviser, t] {
+            for (int i = 0; i < 16; i++) {
+                adviser.Record(100 + t, i * 128 * 1024, 128 * 1024);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 8 * 16 * 128 * 1024;
+    }));
+    EXPECT_EQ(0, adviser.GetStats().lost_records);
+}
+
+TEST_F(FAdviserTest, testCloseStopsTracking) {
+    FAdviser adviser(GetOptions());
+
+    adviser.Record(100, 0, 2 * kMiB);
+    adviser.Record(101, 0, 2 * kMiB);
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 4 * kMiB;
+    }));
+
+    adviser.Close(100);
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 2 * kMiB;
+    }));
+}
+
+TEST_F(FAdviserTest, testSizePolicyDropsLargestFiles) {
+    FAdviser adviser(GetOptions(8 * kMiB, 4 * kMiB));
+
+    adviser.Record(100, 0, 1 * kMiB);
+    adviser.Record(101, 0, 3 * kMiB);
+    adviser.Record(102, 0, 5 * kMiB);
+    // Only the largest file needs to be dropped to get back to the target
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.dropped_bytes[FAdviser::kReasonSize] == 5 * kMiB &&
+               stats.tracked_bytes == 4 * kMiB;
+    }));
+}
+
+TEST_F(FAdviserTest, testLruPolicyDropsLeastRecentlyUsedFiles) {
+    FAdviser::Options options = GetOptions(8 * kMiB, 5 * kMiB);
+    options.policy = FAdviser::Policy::kLru;
+    FAdviser adviser(options);
+
+    adviser.Record(100, 0, 3 * kMiB);
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 3 * kMiB;
+    }));
+    adviser.Record(101, 0, 5 * kMiB);
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.dropped_bytes[FAdviser::kReasonLru] == 3 * kMiB &&
+               stats.tracked_bytes == 5 * kMiB;
+    }));
+}
+
+TEST_F(FAdviserTest, testAdaptivePolicyDropsLargestFilesUnderPressure) {
+    SetMemoryState(50.0, 4000000);
+    FAdviser::Options options = GetOptions(8 * kMiB, 5 * kMiB);
+    options.policy = FAdviser::Policy::kAdaptive;
+    FAdviser adviser(options);
+
+    adviser.Record(100, 0, 3 * kMiB);
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 3 * kMiB;
+    }));
+    adviser.Record(101, 0, 5 * kMiB);
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.memory_pressure && stats.dropped_bytes[FAdviser::kReasonSize] == 5 * kMiB &&
+               stats.tracked_bytes == 3 * kMiB;
+    }));
+}
+
+TEST_F(FAdviserTest, testThresholdsFollowMemoryAvailable) {
+    FAdviser::Options options = GetOptions(0, 0);
+
+    SetMemoryState(0.0, 2 * 1024 * 1024);
+    {
+        FAdviser adviser(options);
+        EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+            return stats.threshold == 64 * kMiB && stats.target == 32 * kMiB;
+        }));
+    }
+
+    // Thresholds are lowered under memory pressure
+    SetMemoryState(25.0, 2 * 1024 * 1024);
+    {
+        FAdviser adviser(options);
+        EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+            return stats.memory_pressure && stats.threshold == 16 * kMiB &&
+                   stats.target == 8 * kMiB;
+        }));
+    }
+}
+
+TEST_F(FAdviserTest, testDropBehindSequentialStream) {
+    FAdviser::Options options = GetOptions();
+    options.drop_behind = true;
+    FAdviser adviser(options);
+
+    for (int i = 0; i < 32; i++) {
+        adviser.Record(100, i * kMiB, kMiB);
+    }
+    // Everything but the last 8MiB is dropped, in chunks of 4MiB
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.dropped_bytes[FAdviser::kReasonDropBehind] == 24 * kMiB &&
+               stats.tracked_bytes == 8 * kMiB;
+    }));
+}
+
+TEST_F(FAdviserTest, testNoDropBehindForRandomAccess) {
+    FAdviser::Options options = GetOptions();
+    options.drop_behind = true;
+    FAdviser adviser(options);
+
+    for (int i = 0; i < 32; i++) {
+        adviser.Record(100, ((i * 7) % 32) * 16 * kMiB, kMiB);
+    }
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 32 * kMiB;
+    }));
+    EXPECT_EQ(0, adviser.GetStats().dropped_bytes[FAdviser::kReasonDropBehind]);
+}
+
+TEST_F(FAdviserTest, testRingIsReusedAcrossThreads) {
+    FAdviser adviser(GetOptions());
+
+    for (int t = 0; t < 4; t++) {
+        std::thread([&adviser] { adviser.Record(100, 0, 2 * kMiB); }).join();
+    }
+    EXPECT_TRUE(WaitForStats(adviser, [](const FAdviser::Stats& stats) {
+        return stats.tracked_bytes == 8 * kMiB;
+    }));
+}
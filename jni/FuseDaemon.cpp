@@ -18,8 +18,11 @@
 
 #include "FuseDaemon.h"
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
+#include <android-base/strings.h>
 #include <android/log.h>
 #include <android/trace.h>
 #include <ctype.h>
@@ -47,30 +50,55 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <future>
 #include <iostream>
 #include <list>
 #include <map>
 #include <mutex>
 #include <queue>
 #include <regex>
+#include <sstream>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "MediaProviderWrapper.h"
+#include "libfuse_jni/DirFdCache.h"
+#include "libfuse_jni/DirWatcher.h"
+#include "libfuse_jni/FAdviser.h"
 #include "libfuse_jni/FuseUtils.h"
 #include "libfuse_jni/ReaddirHelper.h"
+#include "libfuse_jni/RedactionCache.h"
 #include "libfuse_jni/RedactionInfo.h"
+#include "libfuse_jni/RedactionParser.h"
+#include "libfuse_jni/SyncBatcher.h"
+#include "libfuse_jni/UidScheduler.h"
+#include "libfuse_jni/WorkerPool.h"
 #include "node-inl.h"
 
 using mediaprovider::fuse::DirectoryEntry;
+using mediaprovider::fuse::DirFd;
+using mediaprovider::fuse::DirFdCache;
+using mediaprovider::fuse::DirWatcher;
 using mediaprovider::fuse::dirhandle;
+using mediaprovider::fuse::FAdviser;
 using mediaprovider::fuse::handle;
+using mediaprovider::fuse::LowerFile;
 using mediaprovider::fuse::node;
+using mediaprovider::fuse::ParseRedactionRanges;
+using mediaprovider::fuse::RedactionCache;
 using mediaprovider::fuse::RedactionInfo;
+using mediaprovider::fuse::SyncBatcher;
+using mediaprovider::fuse::UidScheduler;
+using mediaprovider::fuse::WorkerPool;
 using std::list;
 using std::string;
 using std::vector;
@@ -101,147 +129,179 @@ const bool IS_OS_DEBUGABLE = android::base::GetIntProperty("ro.debuggable", 0);
 // Stolen from: android_filesystem_config.h
 #define AID_APP_START 10000
 
-constexpr size_t MAX_READ_SIZE = 128 * 1024;
+// Read and write requests are at most this large by default. Up to 256 pages may be negotiated,
+// the most both libfuse and the kernel support.
+constexpr size_t DEFAULT_MAX_REQUEST_SIZE = 128 * 1024;
+constexpr size_t MAX_REQUEST_PAGES = 256;
 // Stolen from: UserHandle#getUserId
 constexpr int PER_USER_RANGE = 100000;
 
+constexpr const char* kPropIoUringEnabled = "persist.sys.fuse.io_uring";
+constexpr const char* kPropWorkerPoolEnabled = "persist.sys.fuse.worker_pool";
+constexpr const char* kPropJniThreadsMin = "persist.sys.fuse.worker_pool.jni_min";
+constexpr const char* kPropJniThreadsMax = "persist.sys.fuse.worker_pool.jni_max";
+constexpr const char* kPropJniGrowQueueDepth = "persist.sys.fuse.worker_pool.jni_grow_depth";
+constexpr const char* kPropIoThreadsMin = "persist.sys.fuse.worker_pool.io_min";
+constexpr const char* kPropIoThreadsMax = "persist.sys.fuse.worker_pool.io_max";
+constexpr const char* kPropWorkerCpus = "persist.sys.fuse.worker_pool.cpus";
+constexpr const char* kPropUidSchedulerEnabled = "persist.sys.fuse.worker_pool.uid_sched";
+constexpr const char* kPropForegroundWeight = "persist.sys.fuse.worker_pool.fg_weight";
+constexpr const char* kPropAsyncUpcallsEnabled = "persist.sys.fuse.async_upcalls";
+constexpr const char* kPropAsyncUpcallsMax = "persist.sys.fuse.async_upcalls.max";
+constexpr const char* kPropSpeculativeOpenEnabled = "persist.sys.fuse.speculative_open";
+constexpr const char* kPropFAdvisePolicy = "persist.sys.fuse.fadvise.policy";
+constexpr const char* kPropFAdviseDropBehind = "persist.sys.fuse.fadvise.drop_behind";
+constexpr const char* kPropReadaheadEnabled = "persist.sys.fuse.readahead";
+constexpr const char* kPropMaxRequestSize = "persist.sys.fuse.max_request_size";
+constexpr const char* kPropLazyOpenEnabled = "persist.sys.fuse.lazy_open";
+constexpr const char* kPropNativeRedactionEnabled = "persist.sys.fuse.native_redaction";
+constexpr const char* kPropRedactionCacheDir = "persist.sys.fuse.redaction_cache.dir";
+constexpr const char* kPropFsyncBatchingEnabled = "persist.sys.fuse.fsync_batching";
+constexpr const char* kPropFewerRoundTripsEnabled = "persist.sys.fuse.fewer_round_trips";
+constexpr const char* kPropLowerFsWatchesEnabled = "persist.sys.fuse.lower_fs_watches";
+constexpr const char* kPropLowerFsWatchesMax = "persist.sys.fuse.lower_fs_watches.max";
+constexpr const char* kPropLowerWriterWatchesEnabled = "persist.sys.fuse.lower_writer_watches";
+constexpr const char* kPropAttrCacheMs = "persist.sys.fuse.attr_cache_ms";
+constexpr const char* kPropDirFdsMax = "persist.sys.fuse.dir_fds.max";
+
+// Requests are counted for the opcodes below this, which covers every opcode handled here.
+constexpr uint32_t kCountedOpcodes = 64;
+
+// Requests handed to a UidScheduler cost one unit, plus one per page of data they transfer.
+constexpr uint32_t kSchedulerCostUnitBytes = 4096;
+
+// Entry timeout of the paths under Android/ whose directory is watched, see get_timeout. Changes
+// are reported by the watches, this only bounds how long an entry stays stale if events are lost.
+constexpr double kWatchedEntryTimeoutSecs = 60;
+
 // Regex copied from FileUtils.java in MediaProvider, but without media directory.
 const std::regex PATTERN_OWNED_PATH(
     "^/storage/[^/]+/(?:[0-9]+/)?Android/(?:data|obb|sandbox)/([^/]+)(/?.*)?",
     std::regex_constants::icase);
 
+/* Single FUSE mount */
 /*
- * In order to avoid double caching with fuse, call fadvise on the file handles
- * in the underlying file system. However, if this is done on every read/write,
- * the fadvises cause a very significant slowdown in tests (specifically fio
- * seq_write). So call fadvise on the file handles with the most reads/writes
- * only after a threshold is passed.
+ * Latency histogram with power of two buckets, in microseconds.
  */
-class FAdviser {
+class LatencyHistogram {
   public:
-    FAdviser() : thread_(MessageLoop, this), total_size_(0) {}
-
-    ~FAdviser() {
-        SendMessage(Message::quit);
-        thread_.join();
-    }
-
-    void Record(int fd, size_t size) { SendMessage(Message::record, fd, size); }
-
-    void Close(int fd) { SendMessage(Message::close, fd); }
-
-  private:
-    struct Message {
-        enum Type { record, close, quit };
-        Type type;
-        int fd;
-        size_t size;
-    };
-
-    void RecordImpl(int fd, size_t size) {
-        total_size_ += size;
-
-        // Find or create record in files_
-        // Remove record from sizes_ if it exists, adjusting size appropriately
-        auto file = files_.find(fd);
-        if (file != files_.end()) {
-            auto old_size = file->second;
-            size += old_size->first;
-            sizes_.erase(old_size);
-        } else {
-            file = files_.insert(Files::value_type(fd, sizes_.end())).first;
+    LatencyHistogram() {
+        for (auto& bucket : buckets_) {
+            bucket.store(0, std::memory_order_relaxed);
         }
-
-        // Now (re) insert record in sizes_
-        auto new_size = sizes_.insert(Sizes::value_type(size, fd));
-        file->second = new_size;
-
-        if (total_size_ < threshold_) return;
-
-        LOG(INFO) << "Threshold exceeded - fadvising " << total_size_;
-        while (!sizes_.empty() && total_size_ > target_) {
-            auto size = --sizes_.end();
-            total_size_ -= size->first;
-            posix_fadvise(size->second, 0, 0, POSIX_FADV_DONTNEED);
-            files_.erase(size->second);
-            sizes_.erase(size);
-        }
-        LOG(INFO) << "Threshold now " << total_size_;
     }
 
-    void CloseImpl(int fd) {
-        auto file = files_.find(fd);
-        if (file == files_.end()) return;
-
-        total_size_ -= file->second->first;
-        sizes_.erase(file->second);
-        files_.erase(file);
+    void Record(std::chrono::steady_clock::duration latency) {
+        const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        const size_t bucket = us ? std::min<size_t>(64 - __builtin_clzll(us), kBuckets - 1) : 0;
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
     }
 
-    void MessageLoopImpl() {
-        while (1) {
-            Message message;
-
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
-                cv_.wait(lock, [this] { return !queue_.empty(); });
-                message = queue_.front();
-                queue_.pop();
-            }
-
-            switch (message.type) {
-                case Message::record:
-                    RecordImpl(message.fd, message.size);
-                    break;
-
-                case Message::close:
-                    CloseImpl(message.fd);
-                    break;
+    // Returns an upper bound of the latency under which |percentile|% of the samples are, in
+    // microseconds, or 0 if there are no samples.
+    uint64_t GetPercentileUs(int percentile) const {
+        uint64_t counts[kBuckets];
+        uint64_t total = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
 
-                case Message::quit:
-                    return;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += counts[i];
+            if (seen && seen * 100 >= total * percentile) {
+                return 1ULL << i;
             }
         }
-    }
-
-    static int MessageLoop(FAdviser* ptr) {
-        ptr->MessageLoopImpl();
         return 0;
     }
 
-    void SendMessage(Message::Type type, int fd = -1, size_t size = 0) {
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            Message message = {type, fd, size};
-            queue_.push(message);
-        }
-        cv_.notify_one();
-    }
-
-    std::mutex mutex_;
-    std::condition_variable cv_;
-    std::queue<Message> queue_;
-    std::thread thread_;
-
-    typedef std::multimap<size_t, int> Sizes;
-    typedef std::map<int, Sizes::iterator> Files;
+  private:
+    // Bucket i holds samples in [2^(i-1), 2^i) us, the last one everything above.
+    static constexpr size_t kBuckets = 32;
+    std::atomic_uint64_t buckets_[kBuckets];
+};
 
-    Files files_;
-    Sizes sizes_;
-    size_t total_size_;
+/*
+ * Reads the FAdviser options from system properties. The policy is one of "size", "lru" or
+ * "adaptive", the default.
+ */
+static FAdviser::Options get_fadviser_options() {
+    FAdviser::Options options;
+    const std::string policy = android::base::GetProperty(kPropFAdvisePolicy, "adaptive");
+    if (policy == "size") {
+        options.policy = FAdviser::Policy::kSize;
+    } else if (policy == "lru") {
+        options.policy = FAdviser::Policy::kLru;
+    }
+    options.drop_behind = android::base::GetBoolProperty(kPropFAdviseDropBehind, true);
+    return options;
+}
 
-    const size_t threshold_ = 64 * 1024 * 1024;
-    const size_t target_ = 32 * 1024 * 1024;
-};
+/*
+ * Returns the sidecar file the redaction cache of the mount at |path| is persisted to, in the
+ * directory set by a system property, or an empty path to keep the cache in memory.
+ */
+static std::string get_redaction_cache_path(const std::string& path) {
+    const std::string dir = android::base::GetProperty(kPropRedactionCacheDir, "");
+    if (dir.empty()) {
+        return "";
+    }
+    std::string name = path;
+    std::replace(name.begin(), name.end(), '/', '_');
+    return dir + "/redaction_cache" + name;
+}
 
-/* Single FUSE mount */
 struct fuse {
     explicit fuse(const std::string& _path)
         : path(_path),
           tracker(mediaprovider::fuse::NodeTracker(&lock)),
           root(node::CreateRoot(_path, &lock, &tracker)),
           mp(0),
-          zero_addr(0) {}
+          zero_addr(0),
+          zero_fd(-1),
+          zero_bytes_from_memfd(0),
+          max_request_size(DEFAULT_MAX_REQUEST_SIZE),
+          fadviser(get_fadviser_options()),
+          lower_files([this](int fd) { fadviser.Close(fd); }),
+          use_io_uring(false),
+          use_uid_scheduler(false),
+          jni_scheduler(android::base::GetUintProperty<uint32_t>(kPropForegroundWeight, 8)),
+          io_scheduler(android::base::GetUintProperty<uint32_t>(kPropForegroundWeight, 8)),
+          open_count(0),
+          create_count(0),
+          speculative_open_discarded(0),
+          readahead_enabled(android::base::GetBoolProperty(kPropReadaheadEnabled, true)),
+          readahead_count(0),
+          readahead_bytes(0),
+          lazy_open_enabled(android::base::GetBoolProperty(kPropLazyOpenEnabled, false)),
+          lazy_open_count(0),
+          lazy_open_unused(0),
+          native_redaction_enabled(
+                  android::base::GetBoolProperty(kPropNativeRedactionEnabled, true)),
+          native_redaction_count(0),
+          native_redaction_fallbacks(0),
+          redaction_cache(get_redaction_cache_path(_path)),
+          fsync_batching_enabled(
+                  android::base::GetBoolProperty(kPropFsyncBatchingEnabled, false)),
+          fewer_round_trips(android::base::GetBoolProperty(kPropFewerRoundTripsEnabled, true)),
+          watch_entries(android::base::GetBoolProperty(kPropLowerFsWatchesEnabled, false)),
+          watch_lower_writers(
+                  android::base::GetBoolProperty(kPropLowerWriterWatchesEnabled, false)),
+          attr_cache_max_age(android::base::GetUintProperty<uint32_t>(kPropAttrCacheMs, 0)),
+          attr_cache_hits(0),
+          attr_cache_misses(0),
+          dir_fds(android::base::GetUintProperty<uint32_t>(kPropDirFdsMax, 0)) {
+        for (auto& count : request_counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+        if (dir_fds.IsEnabled()) {
+            tracker.SetDeletedCallback([this](const node* node) {
+                dir_fds.Remove(reinterpret_cast<uintptr_t>(node));
+            });
+        }
+    }
 
     inline bool IsRoot(const node* node) const { return node == root; }
 
@@ -292,9 +352,104 @@ struct fuse {
      */
     /* const */ char* zero_addr;
 
+    /*
+     * Sealed memfd full of zeroes, used by pf_read to splice redacted ranges like file ranges,
+     * or -1 if it couldn't be created and redacted ranges are served from |zero_addr|.
+     */
+    int zero_fd;
+    // Bytes of redacted ranges served from |zero_fd| instead of |zero_addr|. libfuse only splices
+    // them with FUSE_CAP_SPLICE_WRITE, and copies them otherwise.
+    std::atomic_uint64_t zero_bytes_from_memfd;
+
+    // Largest read and write requests, in bytes. Also the size of |zero_addr| and |zero_fd|.
+    size_t max_request_size;
+
     FAdviser fadviser;
 
+    // Files open on the lower filesystem, shared by the handles of the same file. Files are
+    // untracked by |fadviser| when they get closed.
+    mediaprovider::fuse::LowerFileTable lower_files;
+
     std::atomic_bool* active;
+
+    // Whether requests are transported over per-CPU io_uring queues instead of read()/write()
+    // on /dev/fuse. Only set if both the kernel and libfuse support it.
+    bool use_io_uring;
+
+    // Whether requests queued by the worker pool loop are ordered by uid, see FuseSessionLoop.
+    // Only set if the worker pool is enabled.
+    bool use_uid_scheduler;
+    UidScheduler jni_scheduler;
+    UidScheduler io_scheduler;
+
+    // Number of open and create requests, to relate them to the upcall counts of |mp|.
+    std::atomic_uint64_t open_count;
+    std::atomic_uint64_t create_count;
+
+    // Latency of successful open requests, from the node lookup to the reply.
+    LatencyHistogram open_latency;
+
+    // Opens files on the lower filesystem while MediaProvider checks if they may be opened.
+    // Null if speculative opens are disabled.
+    std::unique_ptr<WorkerPool> open_pool;
+    // Number of speculative opens whose fd was thrown away because the open wasn't allowed.
+    std::atomic_uint64_t speculative_open_discarded;
+
+    // Runs op handlers that call into MediaProvider when async upcalls are enabled, see
+    // run_upcall. Null otherwise.
+    std::unique_ptr<WorkerPool> upcall_pool;
+
+    // Whether pf_read reads ahead of sequential streams on direct_io handles, which the kernel
+    // doesn't read ahead for, and how often and how much it did.
+    const bool readahead_enabled;
+    std::atomic_uint64_t readahead_count;
+    std::atomic_uint64_t readahead_bytes;
+
+    // Whether opens that don't need a lower fd to be replied to defer opening the lower file
+    // until the first request that needs it, see do_open. Also the number of such opens, and of
+    // those released without ever opening the lower file.
+    const bool lazy_open_enabled;
+    std::atomic_uint64_t lazy_open_count;
+    std::atomic_uint64_t lazy_open_unused;
+
+    // Whether redaction ranges are computed in the daemon rather than by MediaProvider, see
+    // get_redaction_info. Also the number of files parsed, and of those left to MediaProvider.
+    const bool native_redaction_enabled;
+    std::atomic_uint64_t native_redaction_count;
+    std::atomic_uint64_t native_redaction_fallbacks;
+
+    // Ranges computed by get_redaction_info, invalidated by writes through the daemon.
+    RedactionCache redaction_cache;
+
+    // Whether concurrent fsyncs of the same file are coalesced, see pf_fsync, and
+    // the latency of fsync requests either way.
+    const bool fsync_batching_enabled;
+    SyncBatcher sync_batcher;
+    LatencyHistogram fsync_latency;
+
+    // Whether replies spare the kernel round trips it doesn't need, see set_file_open_flags,
+    // pf_flush and pf_opendir.
+    const bool fewer_round_trips;
+    // Number of requests received by opcode, to measure the round trips each operation costs.
+    std::atomic_uint64_t request_counts[kCountedOpcodes];
+
+    // Whether entries under Android/ are cached while their directory is watched, see
+    // get_timeout, and whether files written through lower fs fds handed out to apps are watched,
+    // see ShouldOpenWithFuse. Both are cleared if the lower filesystem can't be watched.
+    bool watch_entries;
+    bool watch_lower_writers;
+    // Watches the lower filesystem for the above. Null unless either is enabled.
+    std::unique_ptr<DirWatcher> dir_watcher;
+
+    // How long the attributes of a node are served from memory, see lstat_cached, zero to always
+    // stat the lower file. Also how often they were.
+    const std::chrono::milliseconds attr_cache_max_age;
+    std::atomic_uint64_t attr_cache_hits;
+    std::atomic_uint64_t attr_cache_misses;
+
+    // O_PATH fds of the directories the most recently requested entries are in, see at_parent.
+    // At most persist.sys.fuse.dir_fds.max of them, none if zero.
+    DirFdCache dir_fds;
 };
 
 static inline string get_name(node* n) {
@@ -356,10 +511,137 @@ static bool is_file_locked(int fd, const std::string& path) {
     return locked;
 }
 
+/*
+ * Check if an F_WRLCK is set on fd with fcntl(2), i.e. if the MediaProvider has given an fd to
+ * the lower fs to an app for writing, and any reference to it is still open.
+ *
+ * Returns true if fd may have a write lock, false otherwise
+ */
+static bool is_file_write_locked(int fd) {
+    struct flock fl{};
+    fl.l_type = F_RDLCK;
+    fl.l_whence = SEEK_SET;
+
+    if (fcntl(fd, F_OFD_GETLK, &fl)) {
+        PLOG(WARNING) << "Failed to check write lock";
+        // Assume worst
+        return true;
+    }
+    return fl.l_type != F_UNLCK;
+}
+
 static struct fuse* get_fuse(fuse_req_t req) {
     return reinterpret_cast<struct fuse*>(fuse_req_userdata(req));
 }
 
+static inline void count_request(struct fuse* fuse, uint32_t opcode) {
+    if (opcode < kCountedOpcodes) {
+        fuse->request_counts[opcode].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Returns the name of an opcode counted by count_request, for the dump.
+static const char* get_opcode_name(uint32_t opcode) {
+    switch (opcode) {
+        case FUSE_LOOKUP:
+            return "lookup";
+        case FUSE_FORGET:
+            return "forget";
+        case FUSE_BATCH_FORGET:
+            return "batch_forget";
+        case FUSE_GETATTR:
+            return "getattr";
+        case FUSE_SETATTR:
+            return "setattr";
+        case FUSE_MKNOD:
+            return "mknod";
+        case FUSE_MKDIR:
+            return "mkdir";
+        case FUSE_UNLINK:
+            return "unlink";
+        case FUSE_RMDIR:
+            return "rmdir";
+        case FUSE_RENAME:
+            return "rename";
+        case FUSE_OPEN:
+            return "open";
+        case FUSE_READ:
+            return "read";
+        case FUSE_WRITE:
+            return "write";
+        case FUSE_COPY_FILE_RANGE:
+            return "copy_file_range";
+        case FUSE_FALLOCATE:
+            return "fallocate";
+        case FUSE_FLUSH:
+            return "flush";
+        case FUSE_RELEASE:
+            return "release";
+        case FUSE_FSYNC:
+            return "fsync";
+        case FUSE_FSYNCDIR:
+            return "fsyncdir";
+        case FUSE_OPENDIR:
+            return "opendir";
+        case FUSE_READDIR:
+            return "readdir";
+        case FUSE_READDIRPLUS:
+            return "readdirplus";
+        case FUSE_RELEASEDIR:
+            return "releasedir";
+        case FUSE_STATFS:
+            return "statfs";
+        case FUSE_ACCESS:
+            return "access";
+        case FUSE_CREATE:
+            return "create";
+        default:
+            return "unknown";
+    }
+}
+
+/*
+ * Sets the flags of the reply to an open or create of a file. With fewer round trips, direct_io
+ * handles get concurrent writes to the same file, since pf_write_buf writes at explicit offsets.
+ * FOPEN_NOFLUSH isn't set, the kernel ignores it with the writeback cache; see pf_flush instead.
+ */
+static void set_file_open_flags(struct fuse* fuse, struct fuse_file_info* fi, bool direct_io) {
+    fi->keep_cache = 1;
+    fi->direct_io = direct_io;
+    if (!fuse->fewer_round_trips) {
+        return;
+    }
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+    fi->parallel_direct_writes = direct_io;
+#endif
+}
+
+// Whether the current thread is dedicated to handling requests that call into MediaProvider.
+static thread_local bool is_upcall_thread = false;
+
+// Prepares a thread of a pool dedicated to requests that call into MediaProvider.
+static void init_upcall_thread() {
+    is_upcall_thread = true;
+    mediaprovider::fuse::MediaProviderWrapper::AttachCurrentThread();
+}
+
+/*
+ * Runs |handler|, the body of an op handler calling into MediaProvider, on the upcall pool if
+ * async upcalls are enabled. The FUSE thread can then go back to reading requests instead of
+ * blocking on MediaProvider, so a few FUSE threads can keep many upcalls in flight.
+ *
+ * |handler| must capture copies of any argument it needs besides |req|, which stays valid
+ * until replied to. It runs inline if async upcalls are disabled or if we're already on a
+ * thread dedicated to upcalls.
+ */
+static void run_upcall(struct fuse* fuse, std::function<void()> handler) {
+    if (fuse->upcall_pool && !is_upcall_thread) {
+        fuse->upcall_pool->Post(std::move(handler));
+    } else {
+        handler();
+    }
+}
+
 static bool is_package_owned_path(const string& path, const string& fuse_path) {
     if (path.rfind(fuse_path, 0) != 0) {
         return false;
@@ -383,6 +665,195 @@ static void fuse_inval(fuse_session* se, fuse_ino_t parent_ino, fuse_ino_t child
     }
 }
 
+/*
+ * Runs |op| on |path|, an entry of |parent|, with the fd of |parent| cached by fuse->dir_fds and
+ * the name of the entry rather than AT_FDCWD and |path|, so the lower filesystem doesn't walk
+ * |path| from the root every time. |op| is called as op(int dirfd, const char* path) and returns
+ * like the *at() syscall it wraps.
+ *
+ * The fd follows |parent| when it's renamed through the daemon like its node does, but not when
+ * it's removed or renamed behind our back:
+ * - Removed directories are detected when |op| fails with ENOENT, which is retried with |path|.
+ * - Android/{data,obb}/<package> directories, which the package may rename through its bind
+ *   mount of the lower fs, never use a cached fd.
+ * - Directories renamed by MediaProvider or reported by the directory watcher drop their fds,
+ *   see InvalidateFuseDentryCache and inval_lower_fs_change.
+ */
+template <typename Op>
+static int at_parent(struct fuse* fuse, node* parent, const string& path, Op op) {
+    const size_t slash = path.rfind('/');
+    if (!parent || !fuse->dir_fds.IsEnabled() || slash == string::npos || slash == 0) {
+        return op(AT_FDCWD, path.c_str());
+    }
+    const string parent_path = path.substr(0, slash);
+    if (is_package_owned_path(parent_path, fuse->path)) {
+        return op(AT_FDCWD, path.c_str());
+    }
+    const uint64_t key = reinterpret_cast<uintptr_t>(parent);
+    std::shared_ptr<DirFd> dir = fuse->dir_fds.Get(key, parent_path);
+    if (!dir) {
+        return op(AT_FDCWD, path.c_str());
+    }
+
+    const int res = op(dir->fd, path.c_str() + slash + 1);
+    if (res < 0 && errno == ENOENT) {
+        struct stat st;
+        if (fstat(dir->fd, &st) < 0 || st.st_nlink == 0) {
+            fuse->dir_fds.Remove(key);
+            return op(AT_FDCWD, path.c_str());
+        }
+        errno = ENOENT;
+    }
+    return res;
+}
+
+// Drops the fds cached by at_parent that may no longer be where the nodes they were cached for
+// are, once |node| may have been renamed behind our back. That's its own fd, and those of the
+// directories below it, which may be any of them if it has children.
+static void forget_dir_fds(struct fuse* fuse, const node* node) {
+    if (!fuse->dir_fds.IsEnabled()) {
+        return;
+    }
+    if (node->HasChildren()) {
+        fuse->dir_fds.Clear();
+    } else {
+        fuse->dir_fds.Remove(reinterpret_cast<uintptr_t>(node));
+    }
+}
+
+static int lstat_lower(struct fuse* fuse, node* parent, const string& path, struct stat* st) {
+    return at_parent(fuse, parent, path, [st](int dirfd, const char* path) {
+        return fstatat(dirfd, path, st, AT_SYMLINK_NOFOLLOW);
+    });
+}
+
+/*
+ * Stats |path|, the path of |node|, like lstat, unless the attributes of |node| were cached less
+ * than persist.sys.fuse.attr_cache_ms ago. They're cached by every lstat here and forgotten
+ * whenever the file is changed through the daemon, so only changes made behind our back are
+ * missed, at most for that long:
+ * - Android/{data,obb}/<package> paths, whose attributes the kernel doesn't cache: changes made
+ *   by the package itself, which may have the lower fs bind mounted, and by installd. Those
+ *   made in directories watched for get_timeout aren't missed.
+ * - Other paths, whose attributes the kernel caches without timeout anyway, so it seldom asks:
+ *   writes through lower fs fds handed out to apps, unless watched, see ShouldOpenWithFuse.
+ */
+static int lstat_cached(struct fuse* fuse, node* node, const string& path, struct stat* st) {
+    if (fuse->attr_cache_max_age.count() == 0) {
+        return lstat_lower(fuse, node->GetParent(), path, st);
+    }
+    uint64_t generation;
+    if (node->GetCachedAttr(st, fuse->attr_cache_max_age, &generation)) {
+        fuse->attr_cache_hits.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+    fuse->attr_cache_misses.fetch_add(1, std::memory_order_relaxed);
+    if (lstat_lower(fuse, node->GetParent(), path, st) < 0) {
+        return -1;
+    }
+    node->SetCachedAttr(*st, generation);
+    return 0;
+}
+
+// Forgets the attributes of |node| cached by lstat_cached, once the daemon changed the file.
+static void invalidate_attr(struct fuse* fuse, node* node) {
+    if (fuse->attr_cache_max_age.count() && node) {
+        node->InvalidateCachedAttr();
+    }
+}
+
+// Returns the inode of |dir| if the kernel may be caching its listing, see pf_opendir, or 0.
+static fuse_ino_t get_cached_listing(struct fuse* fuse, node* dir) {
+    return dir->IsListingCached() ? fuse->ToInode(dir) : 0;
+}
+
+// Drops the listing of |ino| cached by the kernel. Call this after replying to the request that
+// changed the directory, the kernel holds the directory lock until then.
+static void inval_cached_listing(fuse_session* se, fuse_ino_t ino) {
+    if (ino) {
+        fuse_lowlevel_notify_inval_inode(se, ino, 0, 0);
+    }
+}
+
+// Watches the directory of |path| for changes made behind our back, see get_timeout. Returns true
+// if the kernel may cache the entry of |path| as a result.
+static bool watch_entry(struct fuse* fuse, const string& path) {
+    if (!fuse->watch_entries) {
+        return false;
+    }
+    std::smatch match;
+    if (std::regex_match(path, match, PATTERN_OWNED_PATH) && match[2].length() == 0) {
+        // Android/{data,obb}/<package> itself, whose existence is private to the package
+        return false;
+    }
+    return fuse->dir_watcher->Watch(path.substr(0, path.rfind('/')));
+}
+
+// Drops what the kernel caches about the entry |name| of |dir|, which changed on the lower
+// filesystem. Called by the directory watcher, outside of any request.
+static void inval_lower_fs_change(struct fuse* fuse, const string& dir, const string& name,
+                                  bool replaced) {
+    const string path = dir + "/" + name;
+    string node_name;
+    fuse_ino_t parent;
+    fuse_ino_t child;
+    {
+        std::lock_guard<std::recursive_mutex> guard(fuse->lock);
+        const node* node = node::LookupAbsolutePath(fuse->root, path);
+        if (!node) {
+            // Not known to the kernel, or already dropped when removed through FUSE
+            return;
+        }
+        node_name = node->GetName();
+        child = fuse->ToInode(const_cast<class node*>(node));
+        parent = fuse->ToInode(node->GetParent());
+        invalidate_attr(fuse, const_cast<class node*>(node));
+        if (replaced) {
+            forget_dir_fds(fuse, node);
+        }
+    }
+
+    if (replaced) {
+        fuse_inval(fuse->se, parent, child, node_name, path);
+    } else {
+        // Only the attributes changed, keep the page cache
+        fuse_lowlevel_notify_inval_inode(fuse->se, child, -1, 0);
+    }
+}
+
+// Drops what the kernel caches about the file |path|, which was written through an fd to the
+// lower fs, see ShouldOpenWithFuse. Called by the directory watcher and when the fd is handed
+// out, outside of any request.
+static void inval_lower_write(struct fuse* fuse, const string& path, bool closed) {
+    fuse_ino_t ino = 0;
+    {
+        std::lock_guard<std::recursive_mutex> guard(fuse->lock);
+        const node* node = node::LookupAbsolutePath(fuse->root, path);
+        if (node) {
+            ino = fuse->ToInode(const_cast<class node*>(node));
+            invalidate_attr(fuse, const_cast<class node*>(node));
+        }
+    }
+    if (ino) {
+        fuse_lowlevel_notify_inval_inode(fuse->se, ino, 0, 0);
+    }
+
+    if (closed) {
+        // Nothing to watch anymore once the last fd given to an app is closed
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0 || !is_file_write_locked(fd)) {
+            // Gone already if the daemon is stopping
+            std::lock_guard<std::recursive_mutex> guard(fuse->lock);
+            if (fuse->dir_watcher) {
+                fuse->dir_watcher->Unwatch(path);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
 static double get_timeout(struct fuse* fuse, const string& path, bool should_inval) {
     string media_path = fuse->GetEffectiveRootPath() + "/Android/media";
     if (should_inval || path.find(media_path, 0) == 0 || is_package_owned_path(path, fuse->path)) {
@@ -394,6 +865,13 @@ static double get_timeout(struct fuse* fuse, const string& path, bool should_inv
         // 3. With app data isolation enabled, app A should not guess existence of app B from the
         // Android/{data,obb}/<package> paths, hence we prevent the kernel from caching that
         // information.
+        // When the lower filesystem is watched, 2. is taken care of by dropping the entries
+        // changed behind our back, and 3. only applies to the package dirs themselves: the
+        // attributes of what's below them aren't cached, so every request on it still checks the
+        // package.
+        if (!should_inval && watch_entry(fuse, path)) {
+            return kWatchedEntryTimeoutSecs;
+        }
         return 0;
     }
     return std::numeric_limits<double>::max();
@@ -406,7 +884,7 @@ static node* make_node_entry(fuse_req_t req, node* parent, const string& name, c
     node* node;
 
     memset(e, 0, sizeof(*e));
-    if (lstat(path.c_str(), &e->attr) < 0) {
+    if (lstat_lower(fuse, parent, path, &e->attr) < 0) {
         *error_code = errno;
         return NULL;
     }
@@ -415,6 +893,10 @@ static node* make_node_entry(fuse_req_t req, node* parent, const string& name, c
     node = parent->LookupChildByName(name, true /* acquire */);
     if (!node) {
         node = ::node::Create(parent, name, &fuse->lock, &fuse->tracker);
+        if (fuse->attr_cache_max_age.count()) {
+            // The kernel usually asks for them again right away when its attr timeout is 0
+            node->SetCachedAttr(e->attr, 0 /* generation of a new node */);
+        }
     } else if (!mediaprovider::fuse::containsMount(path, std::to_string(getuid() / PER_USER_RANGE))) {
         should_inval = true;
         // Only invalidate a path if it does not contain mount.
@@ -475,9 +957,22 @@ static void pf_init(void* userdata, struct fuse_conn_info* conn) {
                      FUSE_CAP_ASYNC_READ | FUSE_CAP_ATOMIC_O_TRUNC | FUSE_CAP_WRITEBACK_CACHE |
                      FUSE_CAP_EXPORT_SUPPORT | FUSE_CAP_FLOCK_LOCKS);
     conn->want |= conn->capable & mask;
-    conn->max_read = MAX_READ_SIZE;
 
     struct fuse* fuse = reinterpret_cast<struct fuse*>(userdata);
+    // libfuse negotiates max_pages from max_write, which bounds reads as well
+    conn->max_read = fuse->max_request_size;
+    conn->max_write = fuse->max_request_size;
+#ifdef FUSE_CAP_OVER_IO_URING
+    if (fuse->use_io_uring) {
+        if (conn->capable & FUSE_CAP_OVER_IO_URING) {
+            conn->want |= FUSE_CAP_OVER_IO_URING;
+        } else {
+            // The kernel did not offer io_uring after all, libfuse keeps serving /dev/fuse
+            LOG(WARNING) << "FUSE over io_uring not offered by kernel, using /dev/fuse";
+            fuse->use_io_uring = false;
+        }
+    }
+#endif
     fuse->active->store(true, std::memory_order_release);
 }
 
@@ -549,6 +1044,7 @@ static node* do_lookup(fuse_req_t req, fuse_ino_t parent, const char* name,
 
 static void pf_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_LOOKUP);
     struct fuse_entry_param e;
 
     int error_code = 0;
@@ -572,6 +1068,7 @@ static void do_forget(fuse_req_t req, struct fuse* fuse, fuse_ino_t ino, uint64_
 }
 
 static void pf_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    count_request(get_fuse(req), FUSE_FORGET);
     // Always allow to forget so no need to check is_app_accessible_path()
     ATRACE_CALL();
     node* node;
@@ -585,6 +1082,7 @@ static void pf_forget_multi(fuse_req_t req,
                             size_t count,
                             struct fuse_forget_data* forgets) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_BATCH_FORGET);
     struct fuse* fuse = get_fuse(req);
 
     for (int i = 0; i < count; i++) {
@@ -597,6 +1095,7 @@ static void pf_getattr(fuse_req_t req,
                        fuse_ino_t ino,
                        struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_GETATTR);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     if (!node) {
@@ -612,7 +1111,7 @@ static void pf_getattr(fuse_req_t req,
 
     struct stat s;
     memset(&s, 0, sizeof(s));
-    if (lstat(path.c_str(), &s) < 0) {
+    if (lstat_cached(fuse, node, path, &s) < 0) {
         fuse_reply_err(req, errno);
     } else {
         fuse_reply_attr(req, &s, is_package_owned_path(path, fuse->path) ?
@@ -626,6 +1125,7 @@ static void pf_setattr(fuse_req_t req,
                        int to_set,
                        struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_SETATTR);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     if (!node) {
@@ -642,7 +1142,11 @@ static void pf_setattr(fuse_req_t req,
     if (fi) {
         // If we have a file_info, setattr was called with an fd so use the fd instead of path
         handle* h = reinterpret_cast<handle*>(fi->fh);
-        fd = h->fd;
+        fd = h->GetFd();
+        if (fd < 0) {
+            fuse_reply_err(req, errno);
+            return;
+        }
     } else {
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
         int status = fuse->mp->IsOpenAllowed(path, ctx->uid, true);
@@ -699,7 +1203,9 @@ static void pf_setattr(fuse_req_t req,
         TRACE_NODE(node, req);
         int res = 0;
         if (fd == -1) {
-            res = utimensat(-1, path.c_str(), times, 0);
+            res = at_parent(fuse, node->GetParent(), path, [&times](int dirfd, const char* path) {
+                return utimensat(dirfd, path, times, 0);
+            });
         } else {
             res = futimens(fd, times);
         }
@@ -710,7 +1216,11 @@ static void pf_setattr(fuse_req_t req,
         }
     }
 
-    lstat(path.c_str(), attr);
+    invalidate_attr(fuse, node);
+    lstat_lower(fuse, node->GetParent(), path, attr);
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        fuse->redaction_cache.Invalidate(attr->st_dev, attr->st_ino);
+    }
     fuse_reply_attr(req, attr, is_package_owned_path(path, fuse->path) ?
             0 : std::numeric_limits<double>::max());
 }
@@ -735,6 +1245,7 @@ static void pf_mknod(fuse_req_t req,
                      mode_t mode,
                      dev_t rdev) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_MKNOD);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -752,19 +1263,24 @@ static void pf_mknod(fuse_req_t req,
     const string child_path = parent_path + "/" + name;
 
     mode = (mode & (~0777)) | 0664;
-    if (mknod(child_path.c_str(), mode, rdev) < 0) {
+    if (at_parent(fuse, parent_node, child_path, [mode, rdev](int dirfd, const char* path) {
+            return mknodat(dirfd, path, mode, rdev);
+        }) < 0) {
         fuse_reply_err(req, errno);
         return;
     }
 
     int error_code = 0;
     struct fuse_entry_param e;
+    const fuse_ino_t cached_listing = get_cached_listing(fuse, parent_node);
+    invalidate_attr(fuse, parent_node);
     if (make_node_entry(req, parent_node, name, child_path, &e, &error_code)) {
         fuse_reply_entry(req, &e);
     } else {
         CHECK(error_code != 0);
         fuse_reply_err(req, error_code);
     }
+    inval_cached_listing(fuse->se, cached_listing);
 }
 
 static void pf_mkdir(fuse_req_t req,
@@ -772,6 +1288,7 @@ static void pf_mkdir(fuse_req_t req,
                      const char* name,
                      mode_t mode) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_MKDIR);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -796,22 +1313,27 @@ static void pf_mkdir(fuse_req_t req,
     }
 
     mode = (mode & (~0777)) | 0775;
-    if (mkdir(child_path.c_str(), mode) < 0) {
+    if (at_parent(fuse, parent_node, child_path, [mode](int dirfd, const char* path) {
+            return mkdirat(dirfd, path, mode);
+        }) < 0) {
         fuse_reply_err(req, errno);
         return;
     }
 
     int error_code = 0;
     struct fuse_entry_param e;
+    const fuse_ino_t cached_listing = get_cached_listing(fuse, parent_node);
+    invalidate_attr(fuse, parent_node);
     if (make_node_entry(req, parent_node, name, child_path, &e, &error_code)) {
         fuse_reply_entry(req, &e);
     } else {
         CHECK(error_code != 0);
         fuse_reply_err(req, error_code);
     }
+    inval_cached_listing(fuse->se, cached_listing);
 }
 
-static void pf_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+static void do_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
     ATRACE_CALL();
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
@@ -842,11 +1364,22 @@ static void pf_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
         child_node->SetDeleted();
     }
 
+    const fuse_ino_t cached_listing = get_cached_listing(fuse, parent_node);
+    invalidate_attr(fuse, parent_node);
     fuse_reply_err(req, 0);
+    inval_cached_listing(fuse->se, cached_listing);
+}
+
+static void pf_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    count_request(get_fuse(req), FUSE_UNLINK);
+    run_upcall(get_fuse(req), [req, parent, name = string(name)] {
+        do_unlink(req, parent, name.c_str());
+    });
 }
 
 static void pf_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_RMDIR);
     struct fuse* fuse = get_fuse(req);
     node* parent_node = fuse->FromInode(parent);
     if (!parent_node) {
@@ -868,7 +1401,9 @@ static void pf_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
         return;
     }
 
-    if (rmdir(child_path.c_str()) < 0) {
+    if (at_parent(fuse, parent_node, child_path, [](int dirfd, const char* path) {
+            return unlinkat(dirfd, path, AT_REMOVEDIR);
+        }) < 0) {
         fuse_reply_err(req, errno);
         return;
     }
@@ -879,7 +1414,10 @@ static void pf_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
         child_node->SetDeleted();
     }
 
+    const fuse_ino_t cached_listing = get_cached_listing(fuse, parent_node);
+    invalidate_attr(fuse, parent_node);
     fuse_reply_err(req, 0);
+    inval_cached_listing(fuse->se, cached_listing);
 }
 /*
 static void pf_symlink(fuse_req_t req, const char* link, fuse_ino_t parent,
@@ -889,7 +1427,7 @@ static void pf_symlink(fuse_req_t req, const char* link, fuse_ino_t parent,
 }
 */
 static int do_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t new_parent,
-                     const char* new_name, unsigned int flags) {
+                     const char* new_name, unsigned int flags, fuse_ino_t cached_listings[2]) {
     ATRACE_CALL();
     struct fuse* fuse = get_fuse(req);
 
@@ -934,6 +1472,13 @@ static int do_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_i
     // EFAULT/EIO is reported due to JNI exception.
     if (res == 0) {
         child_node->Rename(new_name, new_parent_node);
+        invalidate_attr(fuse, child_node);
+        invalidate_attr(fuse, old_parent_node);
+        invalidate_attr(fuse, new_parent_node);
+        cached_listings[0] = get_cached_listing(fuse, old_parent_node);
+        if (new_parent_node != old_parent_node) {
+            cached_listings[1] = get_cached_listing(fuse, new_parent_node);
+        }
     }
     TRACE_NODE(child_node, req) << "new_child";
 
@@ -943,8 +1488,12 @@ static int do_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_i
 
 static void pf_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t new_parent,
                       const char* new_name, unsigned int flags) {
-    int res = do_rename(req, parent, name, new_parent, new_name, flags);
+    count_request(get_fuse(req), FUSE_RENAME);
+    fuse_ino_t cached_listings[2] = {0, 0};
+    int res = do_rename(req, parent, name, new_parent, new_name, flags, cached_listings);
     fuse_reply_err(req, res);
+    inval_cached_listing(get_fuse(req)->se, cached_listings[0]);
+    inval_cached_listing(get_fuse(req)->se, cached_listings[1]);
 }
 
 /*
@@ -955,8 +1504,34 @@ static void pf_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t new_parent,
 }
 */
 
-static handle* create_handle_for_node(struct fuse* fuse, const string& path, int fd, node* node,
-                                      const RedactionInfo* ri) {
+/*
+ * Opens |path| on the lower filesystem with |flags| on the open pool of |fuse|, and returns the
+ * resulting fd or -errno. Only for opens that have no side effects on the lower filesystem.
+ */
+static std::future<int> open_lower_speculatively(struct fuse* fuse, const string& path,
+                                                 int flags) {
+    auto task = std::make_shared<std::packaged_task<int()>>([path, flags] {
+        // Don't let a FIFO block the open pool until its peer shows up, the permission check
+        // may well fail. O_NONBLOCK doesn't affect regular files but is cleared again anyway.
+        const int fd = open(path.c_str(), flags | O_NONBLOCK);
+        if (fd < 0) {
+            return -errno;
+        }
+        if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+            const int error = errno;
+            close(fd);
+            return -error;
+        }
+        return fd;
+    });
+    std::future<int> fd = task->get_future();
+    fuse->open_pool->Post([task] { (*task)(); });
+    return fd;
+}
+
+static handle* create_handle_for_node(struct fuse* fuse, const string& path,
+                                      std::shared_ptr<LowerFile> file, node* node,
+                                      const RedactionInfo* ri, bool for_write) {
     std::lock_guard<std::recursive_mutex> guard(fuse->lock);
     // We don't want to use the FUSE VFS cache in two cases:
     // 1. When redaction is needed because app A with EXIF access might access
@@ -971,14 +1546,74 @@ static handle* create_handle_for_node(struct fuse* fuse, const string& path, int
     // b. Reading from a FUSE fd with caching enabled may not see the latest writes using
     // the lower fs fd because those writes did not go through the FUSE layer and reads from
     // FUSE after that write may be served from cache
-    bool direct_io = ri->isRedactionNeeded() || is_file_locked(fd, path);
+    // Neither applies to a handle that only reads when the lower fs fds are all read-only, since
+    // the page cache was dropped when the last writable one was handed out, see
+    // ShouldOpenWithFuse. Watching the writers doesn't make caching safe while one is open:
+    // inotify doesn't report stores through MAP_SHARED mappings, and a renamed file isn't watched.
+    bool direct_io = ri->isRedactionNeeded();
+    if (!direct_io && is_file_locked(file->fd, path)) {
+        direct_io = for_write || !fuse->watch_lower_writers || is_file_write_locked(file->fd);
+    }
 
-    handle* h = new handle(fd, ri, !direct_io);
+    handle* h = new handle(std::move(file), ri, !direct_io);
     node->AddHandle(h);
     return h;
 }
 
-static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+/*
+ * Creates a handle whose lower file is only opened on first use, at the current path of |node|.
+ * Unlike an fd, a path may lead to another file by then: the handle only opens the file |st|
+ * describes, the one its redaction ranges were computed for, and fails with ESTALE otherwise.
+ */
+static handle* create_lazy_handle_for_node(struct fuse* fuse, int open_flags, node* node,
+                                           const struct stat& st, const RedactionInfo* ri) {
+    std::lock_guard<std::recursive_mutex> guard(fuse->lock);
+    // Only redacted handles are lazy, they use direct_io anyway: the lock check of
+    // create_handle_for_node would need an fd.
+    handle* h = new handle(
+            [fuse, open_flags, node, dev = st.st_dev,
+             ino = st.st_ino]() -> std::shared_ptr<LowerFile> {
+                std::shared_ptr<LowerFile> file =
+                        fuse->lower_files.Open(node->BuildPath(), open_flags);
+                if (file && (file->dev != dev || file->ino != ino)) {
+                    LOG(WARNING) << "Lazily opened file was replaced";
+                    errno = ESTALE;
+                    return nullptr;
+                }
+                return file;
+            },
+            ri, false /* cached */);
+    node->AddHandle(h);
+    return h;
+}
+
+/*
+ * Computes the redaction ranges of a file MediaProvider decided to redact for |uid|, reading them
+ * from |fd| unless they're cached. Files the daemon can't parse exactly like MediaProvider does
+ * are left to it.
+ */
+static std::unique_ptr<RedactionInfo> get_redaction_info(struct fuse* fuse, const string& path,
+                                                         int fd, uid_t uid, pid_t tid) {
+    ATRACE_CALL();
+    fuse->native_redaction_count.fetch_add(1, std::memory_order_relaxed);
+
+    std::vector<off64_t> ranges;
+    struct stat st;
+    const bool cacheable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (cacheable && fuse->redaction_cache.Lookup(st, &ranges)) {
+        return std::make_unique<RedactionInfo>(ranges.size() / 2, ranges.data());
+    }
+    if (ParseRedactionRanges(fd, path, &ranges)) {
+        if (cacheable) {
+            fuse->redaction_cache.Insert(st, ranges);
+        }
+        return std::make_unique<RedactionInfo>(ranges.size() / 2, ranges.data());
+    }
+    fuse->native_redaction_fallbacks.fetch_add(1, std::memory_order_relaxed);
+    return fuse->mp->GetRedactionInfo(path, uid, tid);
+}
+
+static void do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
     ATRACE_CALL();
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
@@ -1000,12 +1635,6 @@ static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         fi->direct_io = true;
     }
 
-    int status = fuse->mp->IsOpenAllowed(path, ctx->uid, is_requesting_write(fi->flags));
-    if (status) {
-        fuse_reply_err(req, status);
-        return;
-    }
-
     // With the writeback cache enabled, FUSE may generate READ requests even for files that
     // were opened O_WRONLY; so make sure we open it O_RDWR instead.
     int open_flags = fi->flags;
@@ -1018,38 +1647,95 @@ static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         open_flags &= ~O_APPEND;
     }
 
-    const int fd = open(path.c_str(), open_flags);
-    if (fd < 0) {
-        fuse_reply_err(req, errno);
-        return;
+    fuse->open_count.fetch_add(1, std::memory_order_relaxed);
+    const auto start = std::chrono::steady_clock::now();
+
+    // An open without side effects on the lower filesystem can run while MediaProvider checks
+    // permissions; its fd is simply closed if the open turns out not to be allowed.
+    std::future<int> speculative_fd;
+    if (fuse->open_pool && !is_requesting_write(fi->flags) && !(open_flags & (O_CREAT | O_TRUNC))) {
+        speculative_fd = open_lower_speculatively(fuse, path, open_flags);
     }
 
-    // We don't redact if the caller was granted write permission for this file
+    // Permission check and redaction ranges in a single upcall, unless the ranges are computed
+    // here once the lower file is open
     std::unique_ptr<RedactionInfo> ri;
-    if (is_requesting_write(fi->flags)) {
-        ri = std::make_unique<RedactionInfo>();
-    } else {
-        ri = fuse->mp->GetRedactionInfo(path, req->ctx.uid, req->ctx.pid);
+    bool redaction_deferred;
+    int status = fuse->mp->OnFileOpen(path, ctx->uid, ctx->pid, is_requesting_write(fi->flags),
+                                      fuse->native_redaction_enabled, &ri, &redaction_deferred);
+    if (status) {
+        if (speculative_fd.valid()) {
+            const int fd = speculative_fd.get();
+            if (fd >= 0) {
+                close(fd);
+            }
+            fuse->speculative_open_discarded.fetch_add(1, std::memory_order_relaxed);
+        }
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    // Many opens only probe the file, e.g. fstat it and close it. If nothing in the reply depends
+    // on the lower file, leave opening it to the first read. Ranges computed here need the lower
+    // file though. Only regular files can be told apart from a replacement by their inode.
+    struct stat st;
+    if (!speculative_fd.valid() && fuse->lazy_open_enabled && ri && ri->isRedactionNeeded() &&
+        lstat_lower(fuse, node->GetParent(), path, &st) == 0 && S_ISREG(st.st_mode)) {
+        handle* h = create_lazy_handle_for_node(fuse, open_flags, node, st, ri.release());
+        fi->fh = ptr_to_id(h);
+        set_file_open_flags(fuse, fi, true /* direct_io */);
+        fuse->lazy_open_count.fetch_add(1, std::memory_order_relaxed);
+        fuse->open_latency.Record(std::chrono::steady_clock::now() - start);
+        fuse_reply_open(req, fi);
+        return;
     }
 
+    // Handles of the same file opened with the same flags share their lower fd
+    std::shared_ptr<LowerFile> file;
+    if (speculative_fd.valid()) {
+        const int fd = speculative_fd.get();
+        if (fd < 0) {
+            fuse_reply_err(req, -fd);
+            return;
+        }
+        file = fuse->lower_files.Adopt(fd, open_flags);
+    } else if (at_parent(fuse, node->GetParent(), path, [&](int dirfd, const char* path) {
+                   file = fuse->lower_files.Open(path, open_flags, dirfd);
+                   return file ? 0 : -1;
+               }) < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    if (open_flags & O_TRUNC) {
+        invalidate_attr(fuse, node);
+    }
+
+    if (redaction_deferred) {
+        ri = get_redaction_info(fuse, path, file->fd, ctx->uid, ctx->pid);
+    }
     if (!ri) {
-        close(fd);
         fuse_reply_err(req, EFAULT);
         return;
     }
 
-    handle* h = create_handle_for_node(fuse, path, fd, node, ri.release());
+    handle* h = create_handle_for_node(fuse, path, std::move(file), node, ri.release(),
+                                       is_requesting_write(fi->flags));
     fi->fh = ptr_to_id(h);
-    fi->keep_cache = 1;
-    fi->direct_io = !h->cached;
+    set_file_open_flags(fuse, fi, !h->cached);
+    fuse->open_latency.Record(std::chrono::steady_clock::now() - start);
     fuse_reply_open(req, fi);
 }
 
+static void pf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    count_request(get_fuse(req), FUSE_OPEN);
+    run_upcall(get_fuse(req), [req, ino, fi = *fi]() mutable { do_open(req, ino, &fi); });
+}
+
 static void do_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info* fi) {
     handle* h = reinterpret_cast<handle*>(fi->fh);
     struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
 
-    buf.buf[0].fd = h->fd;
+    buf.buf[0].fd = h->GetFd();
     buf.buf[0].pos = off;
     buf.buf[0].flags =
             (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
@@ -1085,6 +1771,20 @@ static void create_file_fuse_buf(size_t size, off_t pos, int fd, fuse_buf* buf)
     buf->mem = nullptr;
 }
 
+/**
+ * Sets the parameters for a fuse_buf that reads zeroes. They come from fuse->zero_fd if there's
+ * one, so that a redacted reply is only made of fd buffers: libfuse splices their pages into the
+ * reply pipe instead of copying the zeroes into it.
+ */
+static void create_zero_fuse_buf(size_t size, fuse_buf* buf, struct fuse* fuse) {
+    if (fuse->zero_fd < 0) {
+        create_mem_fuse_buf(size, buf, fuse);
+        return;
+    }
+    create_file_fuse_buf(size, 0, fuse->zero_fd, buf);
+    fuse->zero_bytes_from_memfd.fetch_add(size, std::memory_order_relaxed);
+}
+
 static void do_read_with_redaction(fuse_req_t req, size_t size, off_t off, fuse_file_info* fi) {
     handle* h = reinterpret_cast<handle*>(fi->fh);
     auto overlapping_rr = h->ri->getOverlappingRedactionRanges(size, off);
@@ -1130,7 +1830,7 @@ static void do_read_with_redaction(fuse_req_t req, size_t size, off_t off, fuse_
             // end should be the end of the redacted range, but can't be out of
             // the read request bounds
             end = std::min(static_cast<off_t>(off + size - 1), overlapping_rr->at(rr_idx).second);
-            create_mem_fuse_buf(/*size*/ end - start + 1, &(bufvec.buf[i]), get_fuse(req));
+            create_zero_fuse_buf(/*size*/ end - start + 1, &(bufvec.buf[i]), get_fuse(req));
             ++rr_idx;
         } else {
             // Handle a non-redacted range
@@ -1138,7 +1838,7 @@ static void do_read_with_redaction(fuse_req_t req, size_t size, off_t off, fuse_
             // the end of the read request
             end = std::min(static_cast<off_t>(off + size - 1),
                     overlapping_rr->at(rr_idx).first - 1);
-            create_file_fuse_buf(/*size*/ end - start + 1, start, h->fd, &(bufvec.buf[i]));
+            create_file_fuse_buf(/*size*/ end - start + 1, start, h->GetFd(), &(bufvec.buf[i]));
         }
         start = end + 1;
     }
@@ -1149,16 +1849,34 @@ static void do_read_with_redaction(fuse_req_t req, size_t size, off_t off, fuse_
 static void pf_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                     struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_READ);
     handle* h = reinterpret_cast<handle*>(fi->fh);
     struct fuse* fuse = get_fuse(req);
 
-    fuse->fadviser.Record(h->fd, size);
+    // Opens the lower file of a lazy handle, do_read* can then use the fd right away
+    const int fd = h->GetFd();
+    if (fd < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    fuse->fadviser.Record(fd, off, size);
 
     if (h->ri->isRedactionNeeded()) {
         do_read_with_redaction(req, size, off, fi);
     } else {
         do_read(req, size, off, fi);
     }
+
+    // Only once the read is replied to, so that the reader doesn't wait for the readahead
+    if (fuse->readahead_enabled && !h->cached) {
+        const mediaprovider::fuse::ReadaheadTracker::Range range = h->readahead.OnRead(off, size);
+        if (range.length) {
+            posix_fadvise(fd, range.offset, range.length, POSIX_FADV_WILLNEED);
+            fuse->readahead_count.fetch_add(1, std::memory_order_relaxed);
+            fuse->readahead_bytes.fetch_add(range.length, std::memory_order_relaxed);
+        }
+    }
 }
 
 /*
@@ -1175,74 +1893,153 @@ static void pf_write_buf(fuse_req_t req,
                          off_t off,
                          struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_WRITE);
     handle* h = reinterpret_cast<handle*>(fi->fh);
     struct fuse_bufvec buf = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
     ssize_t size;
     struct fuse* fuse = get_fuse(req);
 
-    buf.buf[0].fd = h->fd;
+    const int fd = h->GetFd();
+    if (fd < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    buf.buf[0].fd = fd;
     buf.buf[0].pos = off;
     buf.buf[0].flags =
             (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
     size = fuse_buf_copy(&buf, bufv, (enum fuse_buf_copy_flags) 0);
+    // Even failed writes may have modified the file
+    const LowerFile* file = h->GetFile();
+    fuse->redaction_cache.Invalidate(file->dev, file->ino);
+    invalidate_attr(fuse, fuse->FromInode(ino));
 
     if (size < 0)
         fuse_reply_err(req, -size);
     else {
         fuse_reply_write(req, size);
-        fuse->fadviser.Record(h->fd, size);
+        fuse->fadviser.Record(fd, off, size);
     }
 }
-// Haven't tested this one. Not sure what calls it.
-#if 0
-static void pf_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
-                                 off_t off_in, struct fuse_file_info* fi_in,
-                                 fuse_ino_t ino_out, off_t off_out,
-                                 struct fuse_file_info* fi_out, size_t len,
-                                 int flags)
-{
-    handle* h_in = reinterpret_cast<handle *>(fi_in->fh);
-    handle* h_out = reinterpret_cast<handle *>(fi_out->fh);
-    struct fuse_bufvec buf_in = FUSE_BUFVEC_INIT(len);
-    struct fuse_bufvec buf_out = FUSE_BUFVEC_INIT(len);
-    ssize_t size;
 
-    buf_in.buf[0].fd = h_in->fd;
-    buf_in.buf[0].pos = off_in;
-    buf_in.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+/*
+ * Returns true if the lower file |fd| was opened for write. As for pf_write_buf, only handles
+ * MediaProvider allowed to open for write have a writable lower file. Lower files are never
+ * opened O_APPEND, the kernel already rejects copies to files opened for append.
+ */
+static bool is_writable(int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_ACCMODE) != O_RDONLY;
+}
+
+/*
+ * Copies a range between two open files on the lower filesystem, without the data going through
+ * the daemon or the kernel's FUSE read and write paths, see copyFileRange.
+ */
+static void pf_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                               struct fuse_file_info* fi_in, fuse_ino_t ino_out, off_t off_out,
+                               struct fuse_file_info* fi_out, size_t len, int flags) {
+    ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_COPY_FILE_RANGE);
+    handle* h_in = reinterpret_cast<handle*>(fi_in->fh);
+    handle* h_out = reinterpret_cast<handle*>(fi_out->fh);
+    struct fuse* fuse = get_fuse(req);
 
-    buf_out.buf[0].fd = h_out->fd;
-    buf_out.buf[0].pos = off_out;
-    buf_out.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
-    size = fuse_buf_copy(&buf_out, &buf_in, (enum fuse_buf_copy_flags) 0);
+    if (flags) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    // Copying the lower file would leak what redaction hides. EXDEV makes the kernel fall back
+    // to reading the source through pf_read.
+    if (h_in->ri->isRedactionNeeded()) {
+        fuse_reply_err(req, EXDEV);
+        return;
+    }
+
+    const int fd_in = h_in->GetFd();
+    if (fd_in < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    const int fd_out = h_out->GetFd();
+    if (fd_out < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    if (!is_writable(fd_out)) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+
+    const ssize_t size = mediaprovider::fuse::copyFileRange(fd_in, off_in, fd_out, off_out, len);
+    const LowerFile* file = h_out->GetFile();
+    fuse->redaction_cache.Invalidate(file->dev, file->ino);
+    invalidate_attr(fuse, fuse->FromInode(ino_out));
 
     if (size < 0) {
         fuse_reply_err(req, -size);
+    } else {
+        fuse_reply_write(req, size);
+        fuse->fadviser.Record(fd_out, off_out, size);
+    }
+}
+
+/*
+ * Allocates or deallocates space of an open file on the lower filesystem, so that apps recording
+ * large files can preallocate them. The lower filesystem enforces quotas and the supported modes.
+ */
+static void pf_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                         struct fuse_file_info* fi) {
+    ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_FALLOCATE);
+    handle* h = reinterpret_cast<handle*>(fi->fh);
+    struct fuse* fuse = get_fuse(req);
+
+    const int fd = h->GetFd();
+    if (fd < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    if (!is_writable(fd)) {
+        fuse_reply_err(req, EBADF);
+        return;
     }
 
-    fuse_reply_write(req, size);
+    const int res = fallocate(fd, mode, offset, length);
+    const int err = res < 0 ? errno : 0;
+    // Modes other than preallocation change the content
+    const LowerFile* file = h->GetFile();
+    fuse->redaction_cache.Invalidate(file->dev, file->ino);
+    invalidate_attr(fuse, fuse->FromInode(ino));
+    fuse_reply_err(req, err);
 }
-#endif
+
 static void pf_flush(fuse_req_t req,
                      fuse_ino_t ino,
                      struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_FLUSH);
     struct fuse* fuse = get_fuse(req);
     TRACE_NODE(nullptr, req) << "noop";
-    fuse_reply_err(req, 0);
+    // With fewer round trips, ENOSYS makes the kernel stop sending FLUSH on every close. It still
+    // writes back dirty pages before the close returns.
+    fuse_reply_err(req, fuse->fewer_round_trips ? ENOSYS : 0);
 }
 
 static void pf_release(fuse_req_t req,
                        fuse_ino_t ino,
                        struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_RELEASE);
     struct fuse* fuse = get_fuse(req);
 
     node* node = fuse->FromInode(ino);
     handle* h = reinterpret_cast<handle*>(fi->fh);
     TRACE_NODE(node, req);
 
-    fuse->fadviser.Close(h->fd);
+    if (!h->IsMaterialized()) {
+        fuse->lazy_open_unused.fetch_add(1, std::memory_order_relaxed);
+    }
     if (node) {
         node->DestroyHandle(h);
     }
@@ -1262,9 +2059,22 @@ static void pf_fsync(fuse_req_t req,
                      int datasync,
                      struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_FSYNC);
+    const auto start = std::chrono::steady_clock::now();
     handle* h = reinterpret_cast<handle*>(fi->fh);
-    int err = do_sync_common(h->fd, datasync);
+    struct fuse* fuse = get_fuse(req);
+    const int fd = h->GetFd();
+    int err;
+    if (fd < 0) {
+        err = errno;
+    } else if (fuse->fsync_batching_enabled && h->GetFile()->dev) {
+        // Fsyncs of a file queued behind a running one then share a single sync of it
+        err = fuse->sync_batcher.Sync(fd, h->GetFile()->dev, h->GetFile()->ino, datasync);
+    } else {
+        err = do_sync_common(fd, datasync);
+    }
 
+    fuse->fsync_latency.Record(std::chrono::steady_clock::now() - start);
     fuse_reply_err(req, err);
 }
 
@@ -1272,6 +2082,7 @@ static void pf_fsyncdir(fuse_req_t req,
                         fuse_ino_t ino,
                         int datasync,
                         struct fuse_file_info* fi) {
+    count_request(get_fuse(req), FUSE_FSYNCDIR);
     dirhandle* h = reinterpret_cast<dirhandle*>(fi->fh);
     int err = do_sync_common(dirfd(h->d), datasync);
 
@@ -1282,6 +2093,7 @@ static void pf_opendir(fuse_req_t req,
                        fuse_ino_t ino,
                        struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_OPENDIR);
     struct fuse* fuse = get_fuse(req);
     node* node = fuse->FromInode(ino);
     if (!node) {
@@ -1303,9 +2115,16 @@ static void pf_opendir(fuse_req_t req,
         return;
     }
 
-    DIR* dir = opendir(path.c_str());
+    const int fd = at_parent(fuse, node->GetParent(), path, [](int dirfd, const char* path) {
+        return openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    });
+    DIR* dir = fd < 0 ? nullptr : fdopendir(fd);
     if (!dir) {
-        fuse_reply_err(req, errno);
+        const int error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        fuse_reply_err(req, error);
         return;
     }
 
@@ -1313,6 +2132,18 @@ static void pf_opendir(fuse_req_t req,
     node->AddDirHandle(h);
 
     fi->fh = ptr_to_id(h);
+    // The kernel caches a single listing per directory, served to every handle opened with
+    // cache_readdir whatever its uid. Only root and shell list the lower fs as is: the listings
+    // of apps are filtered by MediaProvider by what each uid may see, which changes with
+    // permissions and ownership rather than with the directory, so they're never cached. Handles
+    // without cache_readdir neither read nor fill the cache.
+    // It's dropped whenever the directory changes, through FUSE or behind our back when
+    // MediaProvider calls InvalidateFuseDentryCache.
+    if (fuse->fewer_round_trips && fuse->mp->ListsLowerFs(ctx->uid)) {
+        node->SetListingCached();
+        fi->cache_readdir = 1;
+        fi->keep_cache = 1;
+    }
     fuse_reply_open(req, fi);
 }
 
@@ -1416,6 +2247,7 @@ static void do_readdir_common(fuse_req_t req,
 static void pf_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                        struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_READDIR);
     do_readdir_common(req, ino, size, off, fi, false);
 }
 
@@ -1425,6 +2257,7 @@ static void pf_readdirplus(fuse_req_t req,
                            off_t off,
                            struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_READDIRPLUS);
     do_readdir_common(req, ino, size, off, fi, true);
 }
 
@@ -1432,6 +2265,7 @@ static void pf_releasedir(fuse_req_t req,
                           fuse_ino_t ino,
                           struct fuse_file_info* fi) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_RELEASEDIR);
     struct fuse* fuse = get_fuse(req);
 
     node* node = fuse->FromInode(ino);
@@ -1447,6 +2281,7 @@ static void pf_releasedir(fuse_req_t req,
 
 static void pf_statfs(fuse_req_t req, fuse_ino_t ino) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_STATFS);
     struct statvfs st;
     struct fuse* fuse = get_fuse(req);
 
@@ -1480,6 +2315,7 @@ static void pf_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name)
 
 static void pf_access(fuse_req_t req, fuse_ino_t ino, int mask) {
     ATRACE_CALL();
+    count_request(get_fuse(req), FUSE_ACCESS);
     struct fuse* fuse = get_fuse(req);
 
     node* node = fuse->FromInode(ino);
@@ -1495,13 +2331,18 @@ static void pf_access(fuse_req_t req, fuse_ino_t ino, int mask) {
     TRACE_NODE(node, req);
 
     // exists() checks are always allowed.
+    struct stat stat;
     if (mask == F_OK) {
-        int res = access(path.c_str(), F_OK);
+        int res = fuse->attr_cache_max_age.count()
+                          ? lstat_cached(fuse, node, path, &stat)
+                          : at_parent(fuse, node->GetParent(), path,
+                                      [](int dirfd, const char* path) {
+                                          return faccessat(dirfd, path, F_OK, 0);
+                                      });
         fuse_reply_err(req, res ? errno : 0);
         return;
     }
-    struct stat stat;
-    if (lstat(path.c_str(), &stat)) {
+    if (lstat_cached(fuse, node, path, &stat)) {
         // File doesn't exist
         fuse_reply_err(req, ENOENT);
         return;
@@ -1533,7 +2374,7 @@ static void pf_access(fuse_req_t req, fuse_ino_t ino, int mask) {
     fuse_reply_err(req, status);
 }
 
-static void pf_create(fuse_req_t req,
+static void do_create(fuse_req_t req,
                       fuse_ino_t parent,
                       const char* name,
                       mode_t mode,
@@ -1555,6 +2396,7 @@ static void pf_create(fuse_req_t req,
 
     const string child_path = parent_path + "/" + name;
 
+    fuse->create_count.fetch_add(1, std::memory_order_relaxed);
     int mp_return_code = fuse->mp->InsertFile(child_path.c_str(), req->ctx.uid);
     if (mp_return_code) {
         fuse_reply_err(req, mp_return_code);
@@ -1574,7 +2416,10 @@ static void pf_create(fuse_req_t req,
     }
 
     mode = (mode & (~0777)) | 0664;
-    int fd = open(child_path.c_str(), open_flags, mode);
+    const int fd = at_parent(fuse, parent_node, child_path,
+                             [open_flags, mode](int dirfd, const char* path) {
+                                 return openat(dirfd, path, open_flags, mode);
+                             });
     if (fd < 0) {
         int error_code = errno;
         // We've already inserted the file into the MP database before the
@@ -1583,6 +2428,7 @@ static void pf_create(fuse_req_t req,
         fuse_reply_err(req, error_code);
         return;
     }
+    std::shared_ptr<LowerFile> file = fuse->lower_files.Adopt(fd, open_flags);
 
     int error_code = 0;
     struct fuse_entry_param e;
@@ -1594,18 +2440,32 @@ static void pf_create(fuse_req_t req,
         return;
     }
 
-    // Let MediaProvider know we've created a new file
+    // Let MediaProvider know we've created a new file. This doesn't wait for MediaProvider.
     fuse->mp->OnFileCreated(child_path);
 
     // TODO(b/147274248): Assume there will be no EXIF to redact.
     // This prevents crashing during reads but can be a security hole if a malicious app opens an fd
     // to the file before all the EXIF content is written. We could special case reads before the
     // first close after a file has just been created.
-    handle* h = create_handle_for_node(fuse, child_path, fd, node, new RedactionInfo());
+    handle* h = create_handle_for_node(fuse, child_path, std::move(file), node,
+                                       new RedactionInfo(), is_requesting_write(fi->flags));
     fi->fh = ptr_to_id(h);
-    fi->keep_cache = 1;
-    fi->direct_io = !h->cached;
+    set_file_open_flags(fuse, fi, !h->cached);
+    const fuse_ino_t cached_listing = get_cached_listing(fuse, parent_node);
+    invalidate_attr(fuse, parent_node);
     fuse_reply_create(req, &e, fi);
+    inval_cached_listing(fuse->se, cached_listing);
+}
+
+static void pf_create(fuse_req_t req,
+                      fuse_ino_t parent,
+                      const char* name,
+                      mode_t mode,
+                      struct fuse_file_info* fi) {
+    count_request(get_fuse(req), FUSE_CREATE);
+    run_upcall(get_fuse(req), [req, parent, name = string(name), mode, fi = *fi]() mutable {
+        do_create(req, parent, name.c_str(), mode, &fi);
+    });
 }
 /*
 static void pf_getlk(fuse_req_t req, fuse_ino_t ino,
@@ -1651,12 +2511,6 @@ static void pf_flock(fuse_req_t req, fuse_ino_t ino,
 {
     cout << "TODO:" << __func__;
 }
-
-static void pf_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
-                       off_t offset, off_t length, struct fuse_file_info* fi)
-{
-    cout << "TODO:" << __func__;
-}
 */
 
 static struct fuse_lowlevel_ops ops{
@@ -1684,10 +2538,10 @@ static struct fuse_lowlevel_ops ops{
     .write_buf = pf_write_buf,
     /*.retrieve_reply = pf_retrieve_reply,*/
     .forget_multi = pf_forget_multi,
-    /*.flock = pf_flock,
-    .fallocate = pf_fallocate,*/
+    /*.flock = pf_flock,*/
+    .fallocate = pf_fallocate,
     .readdirplus = pf_readdirplus,
-    /*.copy_file_range = pf_copy_file_range,*/
+    .copy_file_range = pf_copy_file_range,
 };
 
 static struct fuse_loop_config config = {
@@ -1710,8 +2564,369 @@ static void fuse_logger(enum fuse_log_level level, const char* fmt, va_list ap)
     __android_log_vprint(fuse_to_android_loglevel.at(level), LIBFUSE_LOG_TAG, fmt, ap);
 }
 
+#ifdef FUSE_CAP_OVER_IO_URING
+/*
+ * Returns true if the kernel can transport FUSE requests over io_uring (Linux 6.14+).
+ *
+ * The fuse module only exposes this parameter when built with CONFIG_FUSE_IO_URING, and the
+ * feature stays disabled until it is set to 'Y'.
+ */
+static bool is_fuse_io_uring_supported() {
+    std::string value;
+    if (!android::base::ReadFileToString("/sys/module/fuse/parameters/enable_uring", &value)) {
+        return false;
+    }
+    return android::base::Trim(value) == "Y";
+}
+#endif
+
+/*
+ * Decides whether this session should use FUSE over io_uring.
+ *
+ * With io_uring, libfuse sets up one ring per CPU and the kernel queues each request on the ring
+ * of the CPU that issued it, so a request is received, handled and answered on the same core
+ * without a read() and a write() on /dev/fuse. This needs support from both the kernel and
+ * libfuse; if either is missing we stay on the regular multi-threaded /dev/fuse loop.
+ */
+static bool should_use_io_uring() {
+    if (!android::base::GetBoolProperty(kPropIoUringEnabled, false)) {
+        return false;
+    }
+#ifdef FUSE_CAP_OVER_IO_URING
+    if (is_fuse_io_uring_supported()) {
+        return true;
+    }
+    LOG(WARNING) << "FUSE over io_uring not supported by kernel, using /dev/fuse";
+#else
+    LOG(WARNING) << "FUSE over io_uring not supported by libfuse, using /dev/fuse";
+#endif
+    return false;
+}
+
+/*
+ * Returns a memfd of |size| bytes of zeroes, sealed so that they can't change, or -1 on failure.
+ *
+ * The pages are allocated up front: splicing from a hole would allocate and zero a new page for
+ * every read instead of handing out references to the same pages.
+ */
+static int create_zero_fd(size_t size) {
+    android::base::unique_fd fd(memfd_create("fuse_zero", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (fd < 0) {
+        PLOG(WARNING) << "Failed to create zero memfd, redacted ranges won't be spliced";
+        return -1;
+    }
+    if (fallocate(fd, 0, 0, size) ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        PLOG(WARNING) << "Failed to set up zero memfd, redacted ranges won't be spliced";
+        return -1;
+    }
+    return fd.release();
+}
+
+/*
+ * Returns the size of the largest read and write requests to negotiate with the kernel: the
+ * property, rounded down to pages, between the default and MAX_REQUEST_PAGES pages. Larger
+ * requests help large sequential transfers, such as camera recordings and video playback.
+ */
+static size_t get_max_request_size() {
+    const size_t page_size = getpagesize();
+    const size_t size = android::base::GetUintProperty<size_t>(kPropMaxRequestSize,
+                                                               DEFAULT_MAX_REQUEST_SIZE);
+    return std::clamp(size, DEFAULT_MAX_REQUEST_SIZE, MAX_REQUEST_PAGES * page_size) / page_size *
+           page_size;
+}
+
+/*
+ * Returns true if the handler for |opcode| never calls into MediaProvider.
+ *
+ * When the worker pool is enabled, these requests are handled by the receiver threads
+ * themselves, so a JNI upcall stalling on MediaProvider can't hold up data I/O of other apps.
+ */
+static bool is_jni_free_opcode(uint32_t opcode) {
+    switch (opcode) {
+        case FUSE_INIT:
+        case FUSE_DESTROY:
+        case FUSE_INTERRUPT:
+        case FUSE_READ:
+        case FUSE_WRITE:
+        case FUSE_COPY_FILE_RANGE:
+        case FUSE_FALLOCATE:
+        case FUSE_FLUSH:
+        case FUSE_FSYNC:
+        case FUSE_FSYNCDIR:
+        case FUSE_FORGET:
+        case FUSE_BATCH_FORGET:
+        case FUSE_RELEASE:
+        case FUSE_RELEASEDIR:
+        case FUSE_STATFS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    for (const std::string& cpu : android::base::Split(list, ",")) {
+        int value;
+        if (android::base::ParseInt(android::base::Trim(cpu), &value, 0, CPU_SETSIZE - 1)) {
+            cpus.push_back(value);
+        } else if (!cpu.empty()) {
+            LOG(WARNING) << "Ignoring invalid CPU in worker affinity: " << cpu;
+        }
+    }
+    return cpus;
+}
+
+/*
+ * Replacement for fuse_session_loop_mt with a reserve of threads for requests that never call
+ * into Java.
+ *
+ * Receiver threads read requests from /dev/fuse. JNI-free requests (see is_jni_free_opcode)
+ * are handled right away on the receiver; everything else is copied and queued on |jni_pool|.
+ * Like fuse_session_loop_mt, a new receiver is started whenever all of them are busy handling
+ * a request, up to |max_receivers|, so there is always one left waiting on /dev/fuse.
+ *
+ * If |io_pool| is set, reads and non-spliced writes are queued on it as well instead of being
+ * handled by the receivers. Requests queued on either pool then go through the UidSchedulers of
+ * |fuse|, so that a uid streaming lots of data can't starve the requests of other uids.
+ */
+class FuseSessionLoop {
+  public:
+    FuseSessionLoop(struct fuse* fuse, WorkerPool* jni_pool, WorkerPool* io_pool,
+                    size_t min_receivers, size_t max_receivers, const std::vector<int>& cpus)
+        : fuse_(fuse),
+          se_(fuse->se),
+          jni_pool_(jni_pool),
+          io_pool_(io_pool),
+          min_receivers_(std::max<size_t>(min_receivers, 1)),
+          max_receivers_(std::max(max_receivers, min_receivers_)),
+          cpus_(cpus),
+          receivers_(0),
+          receivers_count_(0),
+          busy_receivers_(0) {}
+
+    // Blocks until the session exits. Requests already queued on the pools may still be
+    // running when this returns.
+    int Run() {
+        std::unique_lock<std::mutex> lock(lock_);
+        for (size_t i = 0; i < min_receivers_; i++) {
+            StartReceiverLocked();
+        }
+        exit_cv_.wait(lock, [this] { return receivers_ == 0; });
+
+        int err = se_->error;
+        fuse_session_reset(se_);
+        return err;
+    }
+
+  private:
+    void StartReceiverLocked() {
+        receivers_++;
+        receivers_count_.store(receivers_, std::memory_order_relaxed);
+        std::thread(&FuseSessionLoop::ReceiverLoop, this).detach();
+    }
+
+    void ReceiverLoop() {
+        pthread_setname_np(pthread_self(), "fuse-io");
+        if (!cpus_.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus_) {
+                CPU_SET(cpu, &set);
+            }
+            if (sched_setaffinity(0, sizeof(set), &set)) {
+                PLOG(WARNING) << "Failed to set CPU affinity for FUSE receiver";
+            }
+        }
+
+        struct fuse_buf buf = {};
+        while (!fuse_session_exited(se_)) {
+            buf.flags = static_cast<fuse_buf_flags>(0);
+            int res = fuse_session_receive_buf(se_, &buf);
+            if (res == -EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                if (res < 0) {
+                    fuse_session_exit(se_);
+                }
+                break;
+            }
+
+            // Requests with a payload left in the pipe (spliced writes) must be processed by the
+            // thread that received them; they are JNI-free anyway.
+            if (!(buf.flags & FUSE_BUF_IS_FD) && buf.size >= sizeof(struct fuse_in_header)) {
+                const auto* in = reinterpret_cast<const struct fuse_in_header*>(buf.mem);
+                if (!is_jni_free_opcode(in->opcode)) {
+                    Dispatch(buf, jni_pool_, &fuse_->jni_scheduler, 1);
+                    continue;
+                }
+                if (io_pool_ && (in->opcode == FUSE_READ || in->opcode == FUSE_WRITE ||
+                                 in->opcode == FUSE_COPY_FILE_RANGE)) {
+                    Dispatch(buf, io_pool_, &fuse_->io_scheduler, GetIoCost(buf));
+                    continue;
+                }
+            }
+
+            if (busy_receivers_.fetch_add(1, std::memory_order_relaxed) + 1 >=
+                receivers_count_.load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> guard(lock_);
+                if (receivers_ < max_receivers_) {
+                    StartReceiverLocked();
+                }
+            }
+            fuse_session_process_buf(se_, &buf);
+            busy_receivers_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        free(buf.mem);
+
+        std::lock_guard<std::mutex> guard(lock_);
+        receivers_--;
+        receivers_count_.store(receivers_, std::memory_order_relaxed);
+        // Notify with |lock_| held so Run() can't return before we're done with this object
+        exit_cv_.notify_all();
+    }
+
+    // Returns the scheduling cost of the READ, WRITE or COPY_FILE_RANGE request in |buf|.
+    uint32_t GetIoCost(const struct fuse_buf& buf) const {
+        const char* mem = static_cast<const char*>(buf.mem);
+        const auto* in = reinterpret_cast<const struct fuse_in_header*>(mem);
+        uint32_t size = 0;
+        if (in->opcode == FUSE_READ && buf.size >= sizeof(*in) + sizeof(struct fuse_read_in)) {
+            size = reinterpret_cast<const struct fuse_read_in*>(mem + sizeof(*in))->size;
+        } else if (in->opcode == FUSE_WRITE &&
+                   buf.size >= sizeof(*in) + sizeof(struct fuse_write_in)) {
+            size = reinterpret_cast<const struct fuse_write_in*>(mem + sizeof(*in))->size;
+        } else if (in->opcode == FUSE_COPY_FILE_RANGE &&
+                   buf.size >= sizeof(*in) + sizeof(struct fuse_copy_file_range_in)) {
+            // Copies may share extents rather than move the data, bound their cost like a write
+            size = std::min<uint64_t>(
+                    reinterpret_cast<const struct fuse_copy_file_range_in*>(mem + sizeof(*in))->len,
+                    fuse_->max_request_size);
+        }
+        return 1 + size / kSchedulerCostUnitBytes;
+    }
+
+    // Hands a copy of the request in |buf| over to |pool|, in the order decided by |scheduler|.
+    // The receive buffer is sized for the largest possible write, so we only copy the bytes
+    // actually received.
+    void Dispatch(const struct fuse_buf& buf, WorkerPool* pool, UidScheduler* scheduler,
+                  uint32_t cost) {
+        const char* mem = static_cast<const char*>(buf.mem);
+        struct fuse_session* se = se_;
+        std::function<void()> task = [se, data = std::vector<char>(mem, mem + buf.size)]() mutable {
+            struct fuse_buf req_buf = {};
+            req_buf.size = data.size();
+            req_buf.mem = data.data();
+            fuse_session_process_buf(se, &req_buf);
+        };
+
+        if (!fuse_->use_uid_scheduler) {
+            pool->Post(std::move(task));
+            return;
+        }
+        // Every task pushed is matched by exactly one RunNext(), which runs whichever task is
+        // next in fair order by then, not necessarily this one.
+        const uid_t uid = reinterpret_cast<const struct fuse_in_header*>(mem)->uid;
+        scheduler->Push(uid, cost, std::move(task));
+        pool->Post([scheduler] { scheduler->RunNext(); });
+    }
+
+    struct fuse* const fuse_;
+    struct fuse_session* const se_;
+    WorkerPool* const jni_pool_;
+    WorkerPool* const io_pool_;
+    const size_t min_receivers_;
+    const size_t max_receivers_;
+    const std::vector<int> cpus_;
+
+    std::mutex lock_;
+    std::condition_variable exit_cv_;
+    // Number of alive receivers. Guarded by |lock_|.
+    size_t receivers_;
+    // Lock-free copy of |receivers_| for the request path.
+    std::atomic_size_t receivers_count_;
+    // Number of receivers currently handling a request instead of waiting on /dev/fuse.
+    std::atomic_size_t busy_receivers_;
+};
+
+/*
+ * Runs the session of |fuse| on a FuseSessionLoop with bounds taken from system properties,
+ * instead of fuse_session_loop_mt.
+ */
+static int fuse_session_loop_pool(struct fuse* fuse) {
+    using android::base::GetUintProperty;
+
+    const std::vector<int> cpus = parse_cpu_list(android::base::GetProperty(kPropWorkerCpus, ""));
+    const size_t io_min = GetUintProperty<size_t>(kPropIoThreadsMin, 2);
+    const size_t io_max = GetUintProperty<size_t>(kPropIoThreadsMax, 8);
+
+    WorkerPool::Options options;
+    options.min_threads = GetUintProperty<size_t>(kPropJniThreadsMin, 2);
+    options.max_threads =
+            std::max({options.min_threads, GetUintProperty<size_t>(kPropJniThreadsMax, 16),
+                      static_cast<size_t>(1)});
+    options.grow_queue_depth = GetUintProperty<size_t>(kPropJniGrowQueueDepth, 0);
+    options.cpus = cpus;
+    options.on_thread_start = init_upcall_thread;
+    WorkerPool jni_pool("fuse-jni", options);
+
+    // Reads and writes only need their own threads to be scheduled, otherwise the receivers
+    // handle them right away.
+    std::unique_ptr<WorkerPool> io_pool;
+    if (fuse->use_uid_scheduler) {
+        WorkerPool::Options io_options;
+        io_options.min_threads = io_min;
+        io_options.max_threads = std::max({io_min, io_max, static_cast<size_t>(1)});
+        io_options.cpus = cpus;
+        io_pool = std::make_unique<WorkerPool>("fuse-rw", io_options);
+    }
+
+    FuseSessionLoop loop(fuse, &jni_pool, io_pool.get(), io_min, io_max, cpus);
+    LOG(INFO) << "Using FUSE worker pool with " << options.min_threads << "-"
+              << options.max_threads << " JNI threads"
+              << (fuse->use_uid_scheduler ? " and uid scheduling" : "");
+    int res = loop.Run();
+
+    // Requests still queued reference nodes and handles, finish them before the session goes
+    if (io_pool) {
+        io_pool->Shutdown();
+    }
+    jni_pool.Shutdown();
+    return res;
+}
+
+/*
+ * Handles the requests of |fuse| on the calling thread until INIT is negotiated, so that the loop
+ * serving the session can be chosen knowing whether requests come over io_uring.
+ *
+ * Returns false if the session ended before INIT.
+ */
+static bool fuse_session_process_init(struct fuse* fuse) {
+    struct fuse_session* se = fuse->se;
+    struct fuse_buf buf = {};
+    while (!fuse->active->load(std::memory_order_acquire) && !fuse_session_exited(se)) {
+        buf.flags = static_cast<fuse_buf_flags>(0);
+        int res = fuse_session_receive_buf(se, &buf);
+        if (res == -EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(se);
+            }
+            break;
+        }
+        fuse_session_process_buf(se, &buf);
+    }
+    free(buf.mem);
+    return fuse->active->load(std::memory_order_acquire);
+}
+
 bool FuseDaemon::ShouldOpenWithFuse(int fd, bool for_read, const std::string& path) {
     bool use_fuse = false;
+    bool writer_handed_out = false;
 
     if (active.load(std::memory_order_acquire)) {
         std::lock_guard<std::recursive_mutex> guard(fuse->lock);
@@ -1723,10 +2938,22 @@ bool FuseDaemon::ShouldOpenWithFuse(int fd, bool for_read, const std::string& pa
             // when all fd references (including dups) are closed. This can happen when
             // we try to set a write lock twice on the same file
             use_fuse = set_file_lock(fd, for_read, path);
+            if (!use_fuse && !for_read && fuse->watch_lower_writers && fuse->dir_watcher) {
+                // Keeps the attributes the kernel caches fresh while the app writes. The watch
+                // goes once the last fd to the file is closed.
+                fuse->dir_watcher->WatchFile(path);
+                writer_handed_out = true;
+            }
         }
     } else {
         LOG(WARNING) << "FUSE daemon is inactive. Cannot open file with FUSE";
     }
+    if (writer_handed_out) {
+        // Pages cached before are stale once the app writes, and handles opened from now on
+        // don't cache until the fd is closed, see create_handle_for_node. Unlike the watch, this
+        // also covers stores through mappings and writes after a rename.
+        inval_lower_write(fuse, path, false /* closed */);
+    }
 
     return use_fuse;
 }
@@ -1737,6 +2964,7 @@ void FuseDaemon::InvalidateFuseDentryCache(const std::string& path) {
         string name;
         fuse_ino_t parent;
         fuse_ino_t child;
+        fuse_ino_t cached_listing = 0;
         {
             std::lock_guard<std::recursive_mutex> guard(fuse->lock);
             const node* node = node::LookupAbsolutePath(fuse->root, path);
@@ -1744,17 +2972,141 @@ void FuseDaemon::InvalidateFuseDentryCache(const std::string& path) {
                 name = node->GetName();
                 child = fuse->ToInode(const_cast<class node*>(node));
                 parent = fuse->ToInode(node->GetParent());
+                cached_listing = get_cached_listing(fuse, node->GetParent());
+                invalidate_attr(fuse, const_cast<class node*>(node));
+                invalidate_attr(fuse, node->GetParent());
+                forget_dir_fds(fuse, node);
+            } else {
+                // The kernel has never looked |path| up, but it may well be listed now, e.g. when
+                // MediaProvider created it on the lower filesystem.
+                const string parent_path = path.substr(0, path.rfind('/'));
+                const class node* parent_node = node::LookupAbsolutePath(fuse->root, parent_path);
+                if (parent_node) {
+                    cached_listing =
+                            get_cached_listing(fuse, const_cast<class node*>(parent_node));
+                }
             }
         }
 
         if (!name.empty()) {
             fuse_inval(fuse->se, parent, child, name, path);
         }
+        inval_cached_listing(fuse->se, cached_listing);
     } else {
         LOG(WARNING) << "FUSE daemon is inactive. Cannot invalidate dentry";
     }
 }
 
+void FuseDaemon::SetUidForeground(uid_t uid, bool foreground) {
+    if (active.load(std::memory_order_acquire)) {
+        fuse->jni_scheduler.SetForeground(uid, foreground);
+        fuse->io_scheduler.SetForeground(uid, foreground);
+    } else {
+        LOG(WARNING) << "FUSE daemon is inactive. Cannot set uid foreground";
+    }
+}
+
+static void dump_scheduler_stats(const UidScheduler& scheduler, const string& name,
+                                 std::ostringstream* out) {
+    *out << "  " << name << " queue depth: " << scheduler.GetQueueDepth() << "\n";
+    for (const auto& [uid, stats] : scheduler.GetStats()) {
+        *out << "    uid=" << uid << " requests=" << stats.count
+             << " avg_wait_us=" << stats.total_wait.count() / std::max<uint64_t>(stats.count, 1)
+             << " max_wait_us=" << stats.max_wait.count() << "\n";
+    }
+}
+
+std::string FuseDaemon::Dump() {
+    std::ostringstream out;
+    if (active.load(std::memory_order_acquire)) {
+        out << "Requests: open=" << fuse->open_count.load(std::memory_order_relaxed)
+            << " create=" << fuse->create_count.load(std::memory_order_relaxed) << "\n";
+        out << "Open latency: p50<" << fuse->open_latency.GetPercentileUs(50)
+            << "us p99<" << fuse->open_latency.GetPercentileUs(99) << "us";
+        if (fuse->open_pool) {
+            out << " speculative_discarded="
+                << fuse->speculative_open_discarded.load(std::memory_order_relaxed);
+        }
+        out << "\n";
+        FAdviser::Stats fadvise_stats = fuse->fadviser.GetStats();
+        out << "FAdviser: tracked_bytes=" << fadvise_stats.tracked_bytes
+            << " threshold=" << fadvise_stats.threshold << " target=" << fadvise_stats.target
+            << " memory_pressure=" << fadvise_stats.memory_pressure
+            << " lost_records=" << fadvise_stats.lost_records << "\n";
+        for (int i = 0; i < FAdviser::kReasonCount; i++) {
+            const FAdviser::Reason reason = static_cast<FAdviser::Reason>(i);
+            out << "  dropped_bytes[" << FAdviser::ReasonToString(reason)
+                << "]=" << fadvise_stats.dropped_bytes[i] << "\n";
+        }
+        out << "Max request size: read=" << fuse->se->conn.max_read
+            << " write=" << fuse->se->conn.max_write << "\n";
+        const mediaprovider::fuse::LowerFileTable::Stats lower_stats =
+                fuse->lower_files.GetStats();
+        out << "Lower files: open=" << lower_stats.open_files << " opens=" << lower_stats.opens
+            << " shared=" << lower_stats.shared << "\n";
+        if (fuse->lazy_open_enabled) {
+            out << "Lazy opens: count=" << fuse->lazy_open_count.load(std::memory_order_relaxed)
+                << " never_opened=" << fuse->lazy_open_unused.load(std::memory_order_relaxed)
+                << "\n";
+        }
+        out << "Redaction: zero_bytes_from_memfd="
+            << fuse->zero_bytes_from_memfd.load(std::memory_order_relaxed)
+            << " native=" << fuse->native_redaction_count.load(std::memory_order_relaxed)
+            << " native_fallbacks="
+            << fuse->native_redaction_fallbacks.load(std::memory_order_relaxed) << "\n";
+        const RedactionCache::Stats cache_stats = fuse->redaction_cache.GetStats();
+        out << "Redaction cache: hits=" << cache_stats.hits << " misses=" << cache_stats.misses
+            << " invalidations=" << cache_stats.invalidations
+            << " persistent=" << cache_stats.persistent << "\n";
+        out << "Requests by opcode:";
+        for (uint32_t opcode = 0; opcode < kCountedOpcodes; opcode++) {
+            const uint64_t count = fuse->request_counts[opcode].load(std::memory_order_relaxed);
+            if (count) {
+                out << " " << get_opcode_name(opcode) << "=" << count;
+            }
+        }
+        out << "\n";
+        out << "Fsync latency: p50<" << fuse->fsync_latency.GetPercentileUs(50)
+            << "us p99<" << fuse->fsync_latency.GetPercentileUs(99) << "us";
+        if (fuse->fsync_batching_enabled) {
+            const SyncBatcher::Stats sync_stats = fuse->sync_batcher.GetStats();
+            out << " batches=" << sync_stats.batches << " batched=" << sync_stats.batched;
+        }
+        out << "\n";
+        {
+            std::lock_guard<std::recursive_mutex> guard(fuse->lock);
+            if (fuse->dir_watcher) {
+                const DirWatcher::Stats watch_stats = fuse->dir_watcher->GetStats();
+                out << "Lower fs watches: count=" << watch_stats.watches
+                    << " changes=" << watch_stats.changes
+                    << " overflows=" << watch_stats.overflows << "\n";
+            }
+        }
+        if (fuse->attr_cache_max_age.count()) {
+            out << "Attr cache: hits=" << fuse->attr_cache_hits.load(std::memory_order_relaxed)
+                << " misses=" << fuse->attr_cache_misses.load(std::memory_order_relaxed) << "\n";
+        }
+        if (fuse->dir_fds.IsEnabled()) {
+            const DirFdCache::Stats fd_stats = fuse->dir_fds.GetStats();
+            out << "Directory fds: open=" << fd_stats.open << " hits=" << fd_stats.hits
+                << " misses=" << fd_stats.misses << " evictions=" << fd_stats.evictions << "\n";
+        }
+        out << "Readahead: count=" << fuse->readahead_count.load(std::memory_order_relaxed)
+            << " bytes=" << fuse->readahead_bytes.load(std::memory_order_relaxed) << "\n";
+        out << "MediaProvider upcalls:\n" << mp.DumpUpcallStats();
+        if (fuse->use_uid_scheduler) {
+            out << "UID scheduler:\n";
+            dump_scheduler_stats(fuse->jni_scheduler, "JNI", &out);
+            dump_scheduler_stats(fuse->io_scheduler, "I/O", &out);
+        } else {
+            out << "UID scheduler: disabled\n";
+        }
+    } else {
+        out << "FUSE daemon is inactive\n";
+    }
+    return out.str();
+}
+
 FuseDaemon::FuseDaemon(JNIEnv* env, jobject mediaProvider) : mp(env, mediaProvider),
                                                              active(false), fuse(nullptr) {}
 
@@ -1780,15 +3132,21 @@ void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path) {
         return;
     }
 
+    const bool use_io_uring = should_use_io_uring();
+    const size_t max_request_size = get_max_request_size();
+
     args = FUSE_ARGS_INIT(0, nullptr);
     if (fuse_opt_add_arg(&args, path.c_str()) || fuse_opt_add_arg(&args, "-odebug") ||
-        fuse_opt_add_arg(&args, ("-omax_read=" + std::to_string(MAX_READ_SIZE)).c_str())) {
+        fuse_opt_add_arg(&args, ("-omax_read=" + std::to_string(max_request_size)).c_str()) ||
+        (use_io_uring && fuse_opt_add_arg(&args, "-oio_uring"))) {
         LOG(ERROR) << "ERROR: failed to set options";
         return;
     }
 
     struct fuse fuse_default(path);
     fuse_default.mp = &mp;
+    fuse_default.use_io_uring = use_io_uring;
+    fuse_default.max_request_size = max_request_size;
     // fuse_default is stack allocated, but it's safe to save it as an instance variable because
     // this method blocks and FuseDaemon#active tells if we are currently blocking
     fuse = &fuse_default;
@@ -1797,10 +3155,11 @@ void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path) {
     // so we mmap the maximum length of redacted ranges in the beginning and save memory allocations
     // on each read.
     fuse_default.zero_addr = static_cast<char*>(mmap(
-            NULL, MAX_READ_SIZE, PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, /*fd*/ -1, /*off*/ 0));
+            NULL, max_request_size, PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, /*fd*/ -1, /*off*/ 0));
     if (fuse_default.zero_addr == MAP_FAILED) {
         LOG(FATAL) << "mmap failed - could not start fuse! errno = " << errno;
     }
+    fuse_default.zero_fd = create_zero_fd(max_request_size);
 
     // Custom logging for libfuse
     if (android::base::GetBoolProperty("persist.sys.fuse.log", false)) {
@@ -1818,17 +3177,82 @@ void FuseDaemon::Start(android::base::unique_fd fd, const std::string& path) {
     se->fd = fd.release();  // libfuse owns the FD now
     se->mountpoint = strdup(path.c_str());
 
+    // Opens lower files while MediaProvider checks whether the open is allowed
+    if (android::base::GetBoolProperty(kPropSpeculativeOpenEnabled, false)) {
+        WorkerPool::Options options;
+        options.min_threads = 1;
+        options.max_threads = 4;
+        fuse_default.open_pool = std::make_unique<WorkerPool>("fuse-open", options);
+    }
+    if (fuse_default.watch_entries || fuse_default.watch_lower_writers) {
+        fuse_default.dir_watcher = std::make_unique<DirWatcher>(
+                android::base::GetUintProperty<size_t>(kPropLowerFsWatchesMax, 4096),
+                [&fuse_default](const string& dir, const string& name, bool replaced) {
+                    inval_lower_fs_change(&fuse_default, dir, name, replaced);
+                },
+                [&fuse_default](const string& path, bool closed) {
+                    inval_lower_write(&fuse_default, path, closed);
+                });
+        if (!fuse_default.dir_watcher->IsStarted()) {
+            LOG(WARNING) << "Failed to set up lower fs watches, disabling them";
+            fuse_default.dir_watcher.reset();
+            fuse_default.watch_entries = false;
+            fuse_default.watch_lower_writers = false;
+        }
+    }
+
     // Single thread. Useful for debugging
     // fuse_session_loop(se);
-    // Multi-threaded
-    LOG(INFO) << "Starting fuse...";
-    fuse_session_loop_mt(se, &config);
+    // Multi-threaded. When FUSE over io_uring was negotiated, libfuse has started its per-CPU ring
+    // threads while handling INIT and the /dev/fuse workers see few requests if any. pf_init
+    // clears |use_io_uring| if the kernel refused it, so the loop is picked once INIT is done.
+    if (!fuse_session_process_init(&fuse_default)) {
+        LOG(ERROR) << "FUSE session ended before INIT";
+    } else if (!fuse_default.use_io_uring &&
+               android::base::GetBoolProperty(kPropWorkerPoolEnabled, false)) {
+        LOG(INFO) << "Starting fuse...";
+        fuse_default.use_uid_scheduler =
+                android::base::GetBoolProperty(kPropUidSchedulerEnabled, true);
+        // Upcalls already run on the JNI threads of the pool, they don't need another hop
+        fuse_session_loop_pool(&fuse_default);
+    } else {
+        LOG(INFO) << "Starting fuse" << (fuse_default.use_io_uring ? " over io_uring..." : "...");
+        if (android::base::GetBoolProperty(kPropAsyncUpcallsEnabled, false)) {
+            WorkerPool::Options options;
+            options.min_threads = 2;
+            options.max_threads = std::max<size_t>(
+                    android::base::GetUintProperty<size_t>(kPropAsyncUpcallsMax, 16), 2);
+            options.on_thread_start = init_upcall_thread;
+            fuse_default.upcall_pool = std::make_unique<WorkerPool>("fuse-upcall", options);
+            LOG(INFO) << "Using async upcalls with up to " << options.max_threads << " threads";
+        }
+        fuse_session_loop_mt(se, &config);
+        if (fuse_default.upcall_pool) {
+            // Upcalls still queued reference nodes, finish them before the session goes
+            fuse_default.upcall_pool->Shutdown();
+        }
+    }
+    if (fuse_default.open_pool) {
+        fuse_default.open_pool->Shutdown();
+    }
     fuse->active->store(false, std::memory_order_release);
+    // Java threads that saw the daemon active may still use the watcher under |lock|, and its
+    // callbacks do. Take it away under the lock, then stop its thread outside of it since the
+    // callbacks take the lock as well.
+    std::unique_ptr<DirWatcher> dir_watcher;
+    {
+        std::lock_guard<std::recursive_mutex> guard(fuse_default.lock);
+        dir_watcher = std::move(fuse_default.dir_watcher);
+    }
+    dir_watcher.reset();
     LOG(INFO) << "Ending fuse...";
 
-    if (munmap(fuse_default.zero_addr, MAX_READ_SIZE)) {
+    if (munmap(fuse_default.zero_addr, max_request_size)) {
         PLOG(ERROR) << "munmap failed!";
     }
+    if (fuse_default.zero_fd >= 0) {
+        close(fuse_default.zero_fd);
+    }
 
     fuse_opt_free_args(&args);
     fuse_session_destroy(se);
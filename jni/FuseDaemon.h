@@ -17,6 +17,8 @@
 #ifndef MEDIAPROVIDER_JNI_FUSEDAEMON_H_
 #define MEDIAPROVIDER_JNI_FUSEDAEMON_H_
 
+#include <sys/types.h>
+
 #include <memory>
 #include <string>
 
@@ -54,6 +56,16 @@ class FuseDaemon final {
      */
     void InvalidateFuseDentryCache(const std::string& path);
 
+    /**
+     * Boost the scheduling weight of requests from |uid| while it's in the foreground
+     */
+    void SetUidForeground(uid_t uid, bool foreground);
+
+    /**
+     * Returns a human readable dump of the daemon state for dumpsys
+     */
+    std::string Dump();
+
   private:
     FuseDaemon(const FuseDaemon&) = delete;
     void operator=(const FuseDaemon&) = delete;
@@ -16,6 +16,12 @@
 
 #include "include/libfuse_jni/FuseUtils.h"
 
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -50,5 +56,45 @@ bool containsMount(const string& path, const string& userid) {
            android::base::EqualsIgnoreCase(path_suffix, obb_suffix);
 }
 
+ssize_t copyFileRange(int fd_in, off64_t off_in, int fd_out, off64_t off_out, size_t len) {
+    // copy_file_range only has a libc wrapper from API 34
+    loff_t in = off_in;
+    loff_t out = off_out;
+    const ssize_t res = syscall(__NR_copy_file_range, fd_in, &in, fd_out, &out, len, 0);
+    if (res >= 0) {
+        return res;
+    }
+    if (errno != EXDEV && errno != EOPNOTSUPP && errno != ENOSYS) {
+        return -errno;
+    }
+
+    // Bound the time a single request spends copying, callers copy the rest with further calls
+    static constexpr size_t kBufferSize = 128 * 1024;
+    static constexpr size_t kMaxFallbackCopy = 8 * 1024 * 1024;
+    std::unique_ptr<char[]> buf(new char[kBufferSize]);
+    len = std::min(len, kMaxFallbackCopy);
+    size_t copied = 0;
+    while (copied < len) {
+        const ssize_t read = pread64(fd_in, buf.get(), std::min(len - copied, kBufferSize),
+                                     off_in + copied);
+        if (read < 0) {
+            return copied ? copied : -errno;
+        }
+        if (read == 0) {
+            break;
+        }
+        for (ssize_t written = 0; written < read;) {
+            const ssize_t res = pwrite64(fd_out, buf.get() + written, read - written,
+                                         off_out + copied + written);
+            if (res < 0) {
+                return copied + written ? copied + written : -errno;
+            }
+            written += res;
+        }
+        copied += read;
+    }
+    return copied;
+}
+
 }  // namespace fuse
 }  // namespace mediaprovider
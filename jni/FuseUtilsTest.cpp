@@ -18,7 +18,12 @@
 
 #include "libfuse_jni/FuseUtils.h"
 
+#include <android-base/file.h>
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <string>
 
 using namespace mediaprovider::fuse;
 
@@ -64,3 +69,38 @@ TEST(FuseUtilsTest, testContainsMount_isFalseForPathWithWrongUserid) {
     EXPECT_FALSE(containsMount("/storage/emulated/12345/Android/obb", "1234"));
     EXPECT_FALSE(containsMount("/storage/emulated/1234/Android/obb", "5678"));
 }
+
+TEST(FuseUtilsTest, testCopyFileRange) {
+    TemporaryFile in;
+    TemporaryFile out;
+    ASSERT_TRUE(android::base::WriteStringToFile("0123456789", in.path));
+    ASSERT_TRUE(android::base::WriteStringToFile("abcdefghij", out.path));
+
+    EXPECT_EQ(4, copyFileRange(in.fd, 2, out.fd, 5, 4));
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(out.path, &content));
+    EXPECT_EQ("abcde2345j", content);
+}
+
+TEST(FuseUtilsTest, testCopyFileRange_stopsAtEndOfInput) {
+    TemporaryFile in;
+    TemporaryFile out;
+    ASSERT_TRUE(android::base::WriteStringToFile("0123", in.path));
+
+    EXPECT_EQ(2, copyFileRange(in.fd, 2, out.fd, 0, 100));
+    EXPECT_EQ(0, copyFileRange(in.fd, 4, out.fd, 2, 100));
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(out.path, &content));
+    EXPECT_EQ("23", content);
+}
+
+TEST(FuseUtilsTest, testCopyFileRange_failsOnReadOnlyOutput) {
+    TemporaryFile in;
+    TemporaryFile out;
+    ASSERT_TRUE(android::base::WriteStringToFile("0123", in.path));
+    const int fd = open(out.path, O_RDONLY | O_CLOEXEC);
+    ASSERT_LE(0, fd);
+
+    EXPECT_EQ(-EBADF, copyFileRange(in.fd, 0, fd, 0, 4));
+    close(fd);
+}
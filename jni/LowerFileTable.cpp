@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libfuse_jni/LowerFileTable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+// Open flags that change how I/O on the fd behaves. Files opened with different values of these
+// are never shared.
+constexpr int kIoFlags = O_ACCMODE | O_APPEND | O_DIRECT | O_SYNC | O_DSYNC | O_NOATIME;
+
+}  // namespace
+
+LowerFileTable::LowerFileTable(std::function<void(int fd)> on_close)
+    : on_close_(std::move(on_close)), opens_(0), shared_(0) {}
+
+std::shared_ptr<LowerFile> LowerFileTable::Open(const std::string& path, int flags, int dirfd) {
+    // Opens with side effects on the file always go to the lower filesystem
+    if (!(flags & (O_CREAT | O_TRUNC))) {
+        struct stat st;
+        if (fstatat(dirfd, path.c_str(), &st, 0) == 0 && S_ISREG(st.st_mode)) {
+            std::shared_ptr<LowerFile> file = Lookup(Key(st.st_dev, st.st_ino, flags & kIoFlags));
+            if (file) {
+                opens_.fetch_add(1, std::memory_order_relaxed);
+                shared_.fetch_add(1, std::memory_order_relaxed);
+                return file;
+            }
+        }
+    }
+
+    const int fd = openat(dirfd, path.c_str(), flags);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return Adopt(fd, flags);
+}
+
+std::shared_ptr<LowerFile> LowerFileTable::Adopt(int fd, int flags) {
+    opens_.fetch_add(1, std::memory_order_relaxed);
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        return Insert(fd, Key(), false);
+    }
+
+    const Key key(st.st_dev, st.st_ino, flags & kIoFlags);
+    std::shared_ptr<LowerFile> file = Lookup(key);
+    if (file) {
+        close(fd);
+        shared_.fetch_add(1, std::memory_order_relaxed);
+        return file;
+    }
+    return Insert(fd, key, true);
+}
+
+LowerFileTable::Stats LowerFileTable::GetStats() const {
+    Stats stats;
+    stats.opens = opens_.load(std::memory_order_relaxed);
+    stats.shared = shared_.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(lock_);
+    stats.open_files = files_.size();
+    return stats;
+}
+
+std::shared_ptr<LowerFile> LowerFileTable::Lookup(const Key& key) {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    auto it = files_.find(key);
+    return it == files_.end() ? nullptr : it->second.lock();
+}
+
+std::shared_ptr<LowerFile> LowerFileTable::Insert(int fd, const Key& key, bool shared) {
+    auto release = [this, key, shared](LowerFile* file) {
+        if (shared) {
+            std::lock_guard<std::mutex> guard(lock_);
+            // The entry may already be another file if this one expired right before an open
+            auto it = files_.find(key);
+            if (it != files_.end() && it->second.expired()) {
+                files_.erase(it);
+            }
+        }
+        if (on_close_) {
+            on_close_(file->fd);
+        }
+        delete file;
+    };
+    std::shared_ptr<LowerFile> file(new LowerFile(fd, std::get<0>(key), std::get<1>(key)), release);
+    if (!shared) {
+        return file;
+    }
+
+    std::shared_ptr<LowerFile> existing;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        std::weak_ptr<LowerFile>& entry = files_[key];
+        existing = entry.lock();
+        if (!existing) {
+            entry = file;
+            return file;
+        }
+    }
+
+    // Another thread opened the same file in the meantime, share that one instead
+    file.reset();
+    shared_.fetch_add(1, std::memory_order_relaxed);
+    return existing;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
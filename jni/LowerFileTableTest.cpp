@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "LowerFileTableTest"
+
+#include <android-base/file.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "libfuse_jni/LowerFileTable.h"
+
+using namespace mediaprovider::fuse;
+
+class LowerFileTableTest : public ::testing::Test {
+  protected:
+    LowerFileTableTest() : table([this](int fd) { closed.push_back(fd); }) {}
+
+    TemporaryFile file;
+    TemporaryDir dir;
+    std::vector<int> closed;
+    LowerFileTable table;
+};
+
+TEST_F(LowerFileTableTest, testSameFileAndFlagsShareFd) {
+    std::shared_ptr<LowerFile> f1 = table.Open(file.path, O_RDONLY);
+    std::shared_ptr<LowerFile> f2 = table.Open(file.path, O_RDONLY);
+    ASSERT_NE(nullptr, f1);
+    EXPECT_EQ(f1, f2);
+
+    LowerFileTable::Stats stats = table.GetStats();
+    EXPECT_EQ(2, stats.opens);
+    EXPECT_EQ(1, stats.shared);
+    EXPECT_EQ(1, stats.open_files);
+}
+
+TEST_F(LowerFileTableTest, testDifferentFlagsDontShareFd) {
+    std::shared_ptr<LowerFile> f1 = table.Open(file.path, O_RDONLY);
+    std::shared_ptr<LowerFile> f2 = table.Open(file.path, O_RDWR);
+    std::shared_ptr<LowerFile> f3 = table.Open(file.path, O_RDWR | O_SYNC);
+    EXPECT_NE(f1->fd, f2->fd);
+    EXPECT_NE(f2->fd, f3->fd);
+    EXPECT_EQ(3, table.GetStats().open_files);
+}
+
+TEST_F(LowerFileTableTest, testFileClosedWithLastReference) {
+    std::shared_ptr<LowerFile> f1 = table.Open(file.path, O_RDONLY);
+    std::shared_ptr<LowerFile> f2 = table.Open(file.path, O_RDONLY);
+    const int fd = f1->fd;
+
+    f1.reset();
+    EXPECT_TRUE(closed.empty());
+    f2.reset();
+    ASSERT_EQ(1, closed.size());
+    EXPECT_EQ(fd, closed[0]);
+    EXPECT_EQ(0, table.GetStats().open_files);
+
+    // A new open gets a new file
+    std::shared_ptr<LowerFile> f3 = table.Open(file.path, O_RDONLY);
+    ASSERT_NE(nullptr, f3);
+    EXPECT_EQ(1, table.GetStats().open_files);
+}
+
+TEST_F(LowerFileTableTest, testAdoptSharesOpenFile) {
+    std::shared_ptr<LowerFile> f1 = table.Open(file.path, O_RDONLY);
+
+    const int fd = open(file.path, O_RDONLY);
+    ASSERT_GE(fd, 0);
+    std::shared_ptr<LowerFile> f2 = table.Adopt(fd, O_RDONLY);
+    EXPECT_EQ(f1, f2);
+    // The adopted fd was closed right away and isn't reported as a file being closed
+    EXPECT_EQ(-1, fcntl(fd, F_GETFD));
+    EXPECT_TRUE(closed.empty());
+}
+
+TEST_F(LowerFileTableTest, testTruncatingOpenStillShares) {
+    ASSERT_TRUE(android::base::WriteStringToFile("data", file.path));
+    std::shared_ptr<LowerFile> f1 = table.Open(file.path, O_RDWR);
+    std::shared_ptr<LowerFile> f2 = table.Open(file.path, O_RDWR | O_TRUNC);
+    EXPECT_EQ(f1, f2);
+
+    // The file was truncated by the open
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(file.path, &content));
+    EXPECT_EQ("", content);
+}
+
+TEST_F(LowerFileTableTest, testDirectoriesArentShared) {
+    std::shared_ptr<LowerFile> f1 = table.Open(dir.path, O_RDONLY | O_DIRECTORY);
+    std::shared_ptr<LowerFile> f2 = table.Open(dir.path, O_RDONLY | O_DIRECTORY);
+    ASSERT_NE(nullptr, f1);
+    EXPECT_NE(f1, f2);
+    EXPECT_EQ(0, table.GetStats().open_files);
+}
+
+TEST_F(LowerFileTableTest, testFileIdentity) {
+    struct stat st;
+    ASSERT_EQ(0, stat(file.path, &st));
+    std::shared_ptr<LowerFile> f = table.Open(file.path, O_RDONLY);
+    EXPECT_EQ(st.st_dev, f->dev);
+    EXPECT_EQ(st.st_ino, f->ino);
+
+    std::shared_ptr<LowerFile> d = table.Open(dir.path, O_RDONLY | O_DIRECTORY);
+    EXPECT_EQ(0, d->ino);
+}
+
+TEST_F(LowerFileTableTest, testOpenRelativeToDirShares) {
+    const std::string path = std::string(dir.path) + "/f";
+    ASSERT_TRUE(android::base::WriteStringToFile("x", path));
+    const int dirfd = open(dir.path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    ASSERT_GE(dirfd, 0);
+
+    std::shared_ptr<LowerFile> f1 = table.Open(path, O_RDONLY);
+    std::shared_ptr<LowerFile> f2 = table.Open("f", O_RDONLY, dirfd);
+    ASSERT_NE(nullptr, f1);
+    EXPECT_EQ(f1, f2);
+    EXPECT_EQ(nullptr, table.Open("missing", O_RDONLY, dirfd));
+    EXPECT_EQ(ENOENT, errno);
+
+    close(dirfd);
+    f1.reset();
+    f2.reset();
+    unlink(path.c_str());
+}
+
+TEST_F(LowerFileTableTest, testOpenFailureSetsErrno) {
+    EXPECT_EQ(nullptr, table.Open(std::string(dir.path) + "/missing", O_RDONLY));
+    EXPECT_EQ(ENOENT, errno);
+}
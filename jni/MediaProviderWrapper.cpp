@@ -27,6 +27,7 @@
 #include <pthread.h>
 
 #include <mutex>
+#include <sstream>
 #include <unordered_map>
 
 namespace mediaprovider {
@@ -38,6 +39,9 @@ namespace {
 
 constexpr const char* kPropRedactionEnabled = "persist.sys.fuse.redaction-enabled";
 
+// Redaction status returned by onFileOpenForFuse when the ranges are left to the caller.
+constexpr jlong kRedactionDeferred = -1;
+
 constexpr uid_t ROOT_UID = 0;
 constexpr uid_t SHELL_UID = 2000;
 
@@ -220,13 +224,53 @@ int renameInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_ren
     return res;
 }
 
-void onFileCreatedInternal(JNIEnv* env, jobject media_provider_object,
-                           jmethodID mid_on_file_created, const string& path) {
+int onFileOpenInternal(JNIEnv* env, jobject media_provider_object, jmethodID mid_on_file_open,
+                       const string& path, uid_t uid, pid_t tid, bool for_write, bool redact,
+                       bool native_redaction, std::unique_ptr<RedactionInfo>* ri,
+                       bool* redaction_deferred) {
     ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(path.c_str()));
+    ScopedLongArrayRO res(env, static_cast<jlongArray>(env->CallObjectMethod(
+                                       media_provider_object, mid_on_file_open, j_path.get(), uid,
+                                       tid, for_write, redact, native_redaction)));
 
-    env->CallVoidMethod(media_provider_object, mid_on_file_created, j_path.get());
+    if (CheckForJniException(env)) {
+        return EFAULT;
+    }
+
+    // The result is {open status, redaction status, redaction ranges...}
+    if (res.size() < 2 || res.size() % 2) {
+        LOG(ERROR) << "Error while opening file: unexpected result length " << res.size();
+        return EFAULT;
+    }
+    const int status = res[0];
+    if (!status && res[1] == kRedactionDeferred) {
+        *redaction_deferred = true;
+        return 0;
+    }
+    if (status || res[1]) {
+        return status;
+    }
+
+    if (res.size() > 2) {
+        *ri = std::make_unique<RedactionInfo>((res.size() - 2) / 2, res.get() + 2);
+    } else {
+        // No ranges to redact
+        *ri = std::make_unique<RedactionInfo>();
+    }
+    return 0;
+}
+
+void onFilesCreatedInternal(JNIEnv* env, jobject media_provider_object, jclass string_class,
+                            jmethodID mid_on_files_created, const std::vector<string>& paths) {
+    ScopedLocalRef<jobjectArray> j_paths(
+            env, env->NewObjectArray(paths.size(), string_class, nullptr));
+    for (size_t i = 0; i < paths.size(); i++) {
+        ScopedLocalRef<jstring> j_path(env, env->NewStringUTF(paths[i].c_str()));
+        env->SetObjectArrayElement(j_paths.get(), i, j_path.get());
+    }
+
+    env->CallVoidMethod(media_provider_object, mid_on_files_created, j_paths.get());
     CheckForJniException(env);
-    return;
 }
 
 }  // namespace
@@ -245,7 +289,8 @@ void MediaProviderWrapper::OneTimeInit(JavaVM* vm) {
                        MediaProviderWrapper::DetachThreadFunction);
 }
 
-MediaProviderWrapper::MediaProviderWrapper(JNIEnv* env, jobject media_provider) {
+MediaProviderWrapper::MediaProviderWrapper(JNIEnv* env, jobject media_provider)
+    : created_notifier_exit_(false) {
     if (!media_provider) {
         LOG(FATAL) << "MediaProvider is null!";
     }
@@ -256,6 +301,7 @@ MediaProviderWrapper::MediaProviderWrapper(JNIEnv* env, jobject media_provider)
         LOG(FATAL) << "Could not find class MediaProvider";
     }
     media_provider_class_ = reinterpret_cast<jclass>(env->NewGlobalRef(media_provider_class_));
+    string_class_ = reinterpret_cast<jclass>(env->NewGlobalRef(env->FindClass("java/lang/String")));
 
     // Cache methods - Before calling a method, make sure you cache it here
     mid_get_redaction_ranges_ = CacheMethod(env, "getRedactionRanges", "(Ljava/lang/String;II)[J",
@@ -278,12 +324,24 @@ MediaProviderWrapper::MediaProviderWrapper(JNIEnv* env, jobject media_provider)
                               /*is_static*/ false);
     mid_is_uid_for_package_ = CacheMethod(env, "isUidForPackage", "(Ljava/lang/String;I)Z",
                               /*is_static*/ false);
-    mid_on_file_created_ = CacheMethod(env, "onFileCreated", "(Ljava/lang/String;)V",
-                                       /*is_static*/ false);
+    mid_on_file_open_ = CacheMethod(env, "onFileOpen", "(Ljava/lang/String;IIZZZ)[J",
+                                    /*is_static*/ false);
+    mid_on_files_created_ = CacheMethod(env, "onFilesCreated", "([Ljava/lang/String;)V",
+                                        /*is_static*/ false);
+
+    created_notifier_ = std::thread(&MediaProviderWrapper::FileCreatedNotifierLoop, this);
 }
 
 MediaProviderWrapper::~MediaProviderWrapper() {
+    {
+        std::lock_guard<std::mutex> guard(created_lock_);
+        created_notifier_exit_ = true;
+    }
+    created_cv_.notify_one();
+    created_notifier_.join();
+
     JNIEnv* env = MaybeAttachCurrentThread();
+    env->DeleteGlobalRef(string_class_);
     env->DeleteGlobalRef(media_provider_object_);
     env->DeleteGlobalRef(media_provider_class_);
 }
@@ -297,6 +355,7 @@ std::unique_ptr<RedactionInfo> MediaProviderWrapper::GetRedactionInfo(const stri
     // Default value in case JNI thread was being terminated, causes the read to fail.
     std::unique_ptr<RedactionInfo> res = nullptr;
 
+    ScopedUpcall upcall(this, kGetRedactionRanges);
     JNIEnv* env = MaybeAttachCurrentThread();
     auto ri = getRedactionInfoInternal(env, media_provider_object_, mid_get_redaction_ranges_, uid,
                                        tid, path);
@@ -310,6 +369,7 @@ int MediaProviderWrapper::InsertFile(const string& path, uid_t uid) {
         return 0;
     }
 
+    ScopedUpcall upcall(this, kInsertFile);
     JNIEnv* env = MaybeAttachCurrentThread();
     return insertFileInternal(env, media_provider_object_, mid_insert_file_, path, uid);
 }
@@ -320,6 +380,7 @@ int MediaProviderWrapper::DeleteFile(const string& path, uid_t uid) {
         return res;
     }
 
+    ScopedUpcall upcall(this, kDeleteFile);
     JNIEnv* env = MaybeAttachCurrentThread();
     return deleteFileInternal(env, media_provider_object_, mid_delete_file_, path, uid);
 }
@@ -329,12 +390,14 @@ int MediaProviderWrapper::IsOpenAllowed(const string& path, uid_t uid, bool for_
         return 0;
     }
 
+    ScopedUpcall upcall(this, kIsOpenAllowed);
     JNIEnv* env = MaybeAttachCurrentThread();
     return isOpenAllowedInternal(env, media_provider_object_, mid_is_open_allowed_, path, uid,
                                  for_write);
 }
 
 void MediaProviderWrapper::ScanFile(const string& path) {
+    ScopedUpcall upcall(this, kScanFile);
     JNIEnv* env = MaybeAttachCurrentThread();
     scanFileInternal(env, media_provider_object_, mid_scan_file_, path);
 }
@@ -344,6 +407,7 @@ int MediaProviderWrapper::IsCreatingDirAllowed(const string& path, uid_t uid) {
         return 0;
     }
 
+    ScopedUpcall upcall(this, kIsMkdirOrRmdirAllowed);
     JNIEnv* env = MaybeAttachCurrentThread();
     return isMkdirOrRmdirAllowedInternal(env, media_provider_object_,
                                          mid_is_mkdir_or_rmdir_allowed_, path, uid,
@@ -355,6 +419,7 @@ int MediaProviderWrapper::IsDeletingDirAllowed(const string& path, uid_t uid) {
         return 0;
     }
 
+    ScopedUpcall upcall(this, kIsMkdirOrRmdirAllowed);
     JNIEnv* env = MaybeAttachCurrentThread();
     return isMkdirOrRmdirAllowedInternal(env, media_provider_object_,
                                          mid_is_mkdir_or_rmdir_allowed_, path, uid,
@@ -370,6 +435,7 @@ std::vector<std::shared_ptr<DirectoryEntry>> MediaProviderWrapper::GetDirectoryE
         return res;
     }
 
+    ScopedUpcall upcall(this, kGetFilesInDir);
     JNIEnv* env = MaybeAttachCurrentThread();
     res = getFilesInDirectoryInternal(env, media_provider_object_, mid_get_files_in_dir_, uid, path);
 
@@ -385,11 +451,16 @@ std::vector<std::shared_ptr<DirectoryEntry>> MediaProviderWrapper::GetDirectoryE
     return res;
 }
 
+bool MediaProviderWrapper::ListsLowerFs(uid_t uid) const {
+    return shouldBypassMediaProvider(uid);
+}
+
 int MediaProviderWrapper::IsOpendirAllowed(const string& path, uid_t uid, bool forWrite) {
     if (shouldBypassMediaProvider(uid)) {
         return 0;
     }
 
+    ScopedUpcall upcall(this, kIsOpendirAllowed);
     JNIEnv* env = MaybeAttachCurrentThread();
     return isOpendirAllowedInternal(env, media_provider_object_, mid_is_opendir_allowed_, path, uid,
                                     forWrite);
@@ -400,6 +471,7 @@ bool MediaProviderWrapper::IsUidForPackage(const string& pkg, uid_t uid) {
         return true;
     }
 
+    ScopedUpcall upcall(this, kIsUidForPackage);
     JNIEnv* env = MaybeAttachCurrentThread();
     return isUidForPackageInternal(env, media_provider_object_, mid_is_uid_for_package_, pkg, uid);
 }
@@ -413,20 +485,110 @@ int MediaProviderWrapper::Rename(const string& old_path, const string& new_path,
         return res;
     }
 
+    ScopedUpcall upcall(this, kRename);
     JNIEnv* env = MaybeAttachCurrentThread();
     return renameInternal(env, media_provider_object_, mid_rename_, old_path, new_path, uid);
 }
 
-void MediaProviderWrapper::OnFileCreated(const string& path) {
+int MediaProviderWrapper::OnFileOpen(const string& path, uid_t uid, pid_t tid, bool for_write,
+                                     bool native_redaction, std::unique_ptr<RedactionInfo>* ri,
+                                     bool* redaction_deferred) {
+    *ri = nullptr;
+    *redaction_deferred = false;
+    if (shouldBypassMediaProvider(uid)) {
+        *ri = std::make_unique<RedactionInfo>();
+        return 0;
+    }
+
+    // We don't redact if the caller was granted write permission for this file
+    const bool redact = !for_write && GetBoolProperty(kPropRedactionEnabled, true);
+
+    ScopedUpcall upcall(this, kOnFileOpen);
     JNIEnv* env = MaybeAttachCurrentThread();
+    return onFileOpenInternal(env, media_provider_object_, mid_on_file_open_, path, uid, tid,
+                              for_write, redact, native_redaction, ri, redaction_deferred);
+}
 
-    return onFileCreatedInternal(env, media_provider_object_, mid_on_file_created_, path);
+void MediaProviderWrapper::OnFileCreated(const string& path) {
+    {
+        std::lock_guard<std::mutex> guard(created_lock_);
+        created_paths_.push_back(path);
+    }
+    created_cv_.notify_one();
+}
+
+std::string MediaProviderWrapper::DumpUpcallStats() const {
+    static constexpr const char* kUpcallNames[kUpcallCount] = {
+            "getRedactionRanges",
+            "insertFileIfNecessary",
+            "deleteFile",
+            "isOpenAllowed",
+            "onFileOpen",
+            "scanFile",
+            "isDirectoryCreationOrDeletionAllowed",
+            "isOpendirAllowed",
+            "getFilesInDirectory",
+            "rename",
+            "isUidForPackage",
+            "onFilesCreated",
+    };
+
+    std::ostringstream out;
+    for (int i = 0; i < kUpcallCount; i++) {
+        const uint64_t count = upcall_stats_[i].count.load(std::memory_order_relaxed);
+        if (!count) {
+            continue;
+        }
+        out << "  " << kUpcallNames[i] << ": calls=" << count << " avg_us="
+            << upcall_stats_[i].total_us.load(std::memory_order_relaxed) / count
+            << " max_us=" << upcall_stats_[i].max_us.load(std::memory_order_relaxed) << "\n";
+    }
+    return out.str();
 }
 
 /*****************************************************************************************/
 /******************************** Private member functions *******************************/
 /*****************************************************************************************/
 
+MediaProviderWrapper::ScopedUpcall::ScopedUpcall(MediaProviderWrapper* mp, Upcall upcall)
+    : stats_(&mp->upcall_stats_[upcall]), start_(std::chrono::steady_clock::now()) {}
+
+MediaProviderWrapper::ScopedUpcall::~ScopedUpcall() {
+    const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - start_)
+                                .count();
+    stats_->count.fetch_add(1, std::memory_order_relaxed);
+    stats_->total_us.fetch_add(us, std::memory_order_relaxed);
+    uint64_t max = stats_->max_us.load(std::memory_order_relaxed);
+    while (us > max && !stats_->max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+void MediaProviderWrapper::FileCreatedNotifierLoop() {
+    pthread_setname_np(pthread_self(), "fuse-created");
+
+    std::unique_lock<std::mutex> lock(created_lock_);
+    while (true) {
+        created_cv_.wait(lock,
+                         [this] { return !created_paths_.empty() || created_notifier_exit_; });
+        if (created_paths_.empty()) {
+            break;
+        }
+
+        // Everything created while the previous batch was being notified goes in a single upcall
+        std::vector<string> paths;
+        paths.swap(created_paths_);
+        lock.unlock();
+        {
+            ScopedUpcall upcall(this, kOnFilesCreated);
+            JNIEnv* env = MaybeAttachCurrentThread();
+            onFilesCreatedInternal(env, media_provider_object_, string_class_,
+                                   mid_on_files_created_, paths);
+        }
+        lock.lock();
+    }
+}
+
 /**
  * Finds MediaProvider method and adds it to methods map so it can be quickly called later.
  */
@@ -447,6 +609,10 @@ jmethodID MediaProviderWrapper::CacheMethod(JNIEnv* env, const char method_name[
     return mid;
 }
 
+void MediaProviderWrapper::AttachCurrentThread() {
+    MaybeAttachCurrentThread();
+}
+
 void MediaProviderWrapper::DetachThreadFunction(void* unused) {
     int detach = gJavaVm->DetachCurrentThread();
     CHECK_EQ(detach, 0);
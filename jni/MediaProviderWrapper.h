@@ -22,12 +22,14 @@
 
 #include <dirent.h>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <mutex>
 #include <queue>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "libfuse_jni/ReaddirHelper.h"
 #include "libfuse_jni/RedactionInfo.h"
@@ -90,6 +92,12 @@ class MediaProviderWrapper final {
                                                                      const std::string& path,
                                                                      DIR* dirp);
 
+    /**
+     * Returns true if the directory entries of |uid| are always those of the lower file system,
+     * so that they're the same for every such uid.
+     */
+    bool ListsLowerFs(uid_t uid) const;
+
     /**
      * Determines if the given UID is allowed to open the file denoted by the given path.
      *
@@ -100,6 +108,27 @@ class MediaProviderWrapper final {
      */
     int IsOpenAllowed(const std::string& path, uid_t uid, bool for_write);
 
+    /**
+     * Determines if the given UID is allowed to open the file denoted by the given path and
+     * computes its RedactionInfo, in a single upcall.
+     *
+     * @param path the path of the file to be opened
+     * @param uid UID of the calling app
+     * @param tid thread id making the open request
+     * @param for_write specifies if the file is to be opened for write, in which case nothing
+     * is redacted
+     * @param native_redaction whether the caller computes the redaction ranges itself, in which
+     * case MediaProvider only decides whether ranges need to be redacted
+     * @param ri set to the RedactionInfo of the file if the open is allowed, or to nullptr if it
+     * couldn't be computed or was left to the caller
+     * @param redaction_deferred set if ranges need to be redacted and the caller has to compute
+     * them, |ri| is then nullptr
+     * @return 0 upon success or errno value upon failure.
+     */
+    int OnFileOpen(const std::string& path, uid_t uid, pid_t tid, bool for_write,
+                   bool native_redaction, std::unique_ptr<RedactionInfo>* ri,
+                   bool* redaction_deferred);
+
     /**
      * Potentially triggers a scan of the file before closing it and reconciles it with the
      * MediaProvider database.
@@ -160,21 +189,74 @@ class MediaProviderWrapper final {
     /**
      * Called whenever a file has been created through FUSE.
      *
+     * MediaProvider is notified asynchronously and in batches, so that creating a file only
+     * costs a single upcall, InsertFile().
+     *
      * @param path path of the file that has been created.
      */
     void OnFileCreated(const std::string& path);
 
+    /**
+     * Returns a human readable dump of the number and latency of upcalls per MediaProvider
+     * method.
+     */
+    std::string DumpUpcallStats() const;
+
     /**
      * Initializes per-process static variables associated with the lifetime of
      * a managed runtime.
      */
     static void OneTimeInit(JavaVM* vm);
 
+    /**
+     * Attaches the calling thread to the JVM ahead of its first upcall, so that threads
+     * dedicated to upcalls don't pay for it while a request is waiting.
+     */
+    static void AttachCurrentThread();
+
     /** TLS Key to map a given thread to its JNIEnv. */
     static pthread_key_t gJniEnvKey;
 
   private:
+    // MediaProvider methods called from FUSE, to account for upcalls.
+    enum Upcall {
+        kGetRedactionRanges,
+        kInsertFile,
+        kDeleteFile,
+        kIsOpenAllowed,
+        kOnFileOpen,
+        kScanFile,
+        kIsMkdirOrRmdirAllowed,
+        kIsOpendirAllowed,
+        kGetFilesInDir,
+        kRename,
+        kIsUidForPackage,
+        kOnFilesCreated,
+        kUpcallCount,
+    };
+
+    struct UpcallStats {
+        std::atomic_uint64_t count{0};
+        std::atomic_uint64_t total_us{0};
+        std::atomic_uint64_t max_us{0};
+    };
+
+    // Accounts for one upcall to |upcall| from construction to destruction.
+    class ScopedUpcall {
+      public:
+        ScopedUpcall(MediaProviderWrapper* mp, Upcall upcall);
+        ~ScopedUpcall();
+
+      private:
+        UpcallStats* const stats_;
+        const std::chrono::steady_clock::time_point start_;
+    };
+
+    // Notifies MediaProvider of the paths queued by OnFileCreated().
+    void FileCreatedNotifierLoop();
+
     jclass media_provider_class_;
+    jclass string_class_;
     jobject media_provider_object_;
     /** Cached MediaProvider method IDs **/
     jmethodID mid_get_redaction_ranges_;
@@ -187,7 +269,18 @@ class MediaProviderWrapper final {
     jmethodID mid_get_files_in_dir_;
     jmethodID mid_rename_;
     jmethodID mid_is_uid_for_package_;
-    jmethodID mid_on_file_created_;
+    jmethodID mid_on_file_open_;
+    jmethodID mid_on_files_created_;
+
+    UpcallStats upcall_stats_[kUpcallCount];
+
+    std::mutex created_lock_;
+    std::condition_variable created_cv_;
+    // Paths created and not notified yet. Guarded by |created_lock_|.
+    std::vector<std::string> created_paths_;
+    // Guarded by |created_lock_|.
+    bool created_notifier_exit_;
+    std::thread created_notifier_;
 
     /**
      * Auxiliary for caching MediaProvider methods.
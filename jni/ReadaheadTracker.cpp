@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libfuse_jni/ReadaheadTracker.h"
+
+#include <algorithm>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+// A read continues the stream if it starts this close to where the stream is expected, since
+// the reads of a stream may be handled by several threads and arrive slightly out of order.
+constexpr off_t kSequentialSlack = 256 * 1024;
+
+// Reads in a row after which a stream is considered sequential.
+constexpr int kSequentialReads = 2;
+
+}  // namespace
+
+ReadaheadTracker::Range ReadaheadTracker::OnRead(off_t offset, size_t size) {
+    std::lock_guard<std::mutex> guard(lock_);
+    const off_t end = offset + size;
+
+    if (offset < next_offset_ - kSequentialSlack || offset > next_offset_ + kSequentialSlack) {
+        // This read may be the first of a new stream
+        next_offset_ = end;
+        readahead_end_ = end;
+        window_ = 0;
+        sequential_reads_ = 1;
+        return {0, 0};
+    }
+
+    next_offset_ = std::max(next_offset_, end);
+    if (++sequential_reads_ < kSequentialReads) {
+        return {0, 0};
+    }
+    if (!window_) {
+        window_ = kInitialWindow;
+    } else if (readahead_end_ - next_offset_ >= static_cast<off_t>(window_ / 2)) {
+        // Still well ahead of the reader
+        return {0, 0};
+    }
+
+    const off_t start = std::max(readahead_end_, next_offset_);
+    readahead_end_ = next_offset_ + window_;
+    window_ = std::min(window_ * 2, kMaxWindow);
+    if (readahead_end_ <= start) {
+        return {0, 0};
+    }
+    return {start, static_cast<size_t>(readahead_end_ - start)};
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ReadaheadTrackerTest"
+
+#include <gtest/gtest.h>
+
+#include "libfuse_jni/ReadaheadTracker.h"
+
+using namespace mediaprovider::fuse;
+
+constexpr size_t kReadSize = 128 * 1024;
+
+TEST(ReadaheadTrackerTest, testRandomReadsDontReadahead) {
+    ReadaheadTracker tracker;
+
+    const off_t offsets[] = {10 * 1024 * 1024, 0, 50 * 1024 * 1024, 3 * 1024 * 1024};
+    for (off_t offset : offsets) {
+        EXPECT_EQ(0, tracker.OnRead(offset, kReadSize).length);
+    }
+}
+
+TEST(ReadaheadTrackerTest, testSequentialReadsReadahead) {
+    ReadaheadTracker tracker;
+
+    EXPECT_EQ(0, tracker.OnRead(0, kReadSize).length);
+    ReadaheadTracker::Range range = tracker.OnRead(kReadSize, kReadSize);
+    EXPECT_EQ(2 * kReadSize, range.offset);
+    EXPECT_EQ(ReadaheadTracker::kInitialWindow, range.length);
+}
+
+TEST(ReadaheadTrackerTest, testWindowGrowsUpToMax) {
+    ReadaheadTracker tracker;
+
+    off_t readahead_end = 0;
+    size_t max_length = 0;
+    for (off_t offset = 0; offset < 64 * 1024 * 1024; offset += kReadSize) {
+        ReadaheadTracker::Range range = tracker.OnRead(offset, kReadSize);
+        if (!range.length) continue;
+
+        // Ranges are contiguous and never more than a window ahead of the reader
+        if (readahead_end) {
+            EXPECT_EQ(readahead_end, range.offset);
+        }
+        readahead_end = range.offset + range.length;
+        EXPECT_LE(readahead_end, offset + kReadSize + ReadaheadTracker::kMaxWindow);
+        max_length = std::max(max_length, range.length);
+
+        // The reader never catches up with the data read ahead
+        EXPECT_GT(readahead_end, offset + kReadSize);
+    }
+    EXPECT_GT(max_length, ReadaheadTracker::kInitialWindow);
+    EXPECT_LE(max_length, ReadaheadTracker::kMaxWindow);
+}
+
+TEST(ReadaheadTrackerTest, testSeekResetsWindow) {
+    ReadaheadTracker tracker;
+
+    for (off_t offset = 0; offset < 8 * 1024 * 1024; offset += kReadSize) {
+        tracker.OnRead(offset, kReadSize);
+    }
+
+    const off_t seek = 100 * 1024 * 1024;
+    EXPECT_EQ(0, tracker.OnRead(seek, kReadSize).length);
+    ReadaheadTracker::Range range = tracker.OnRead(seek + kReadSize, kReadSize);
+    EXPECT_EQ(seek + 2 * kReadSize, range.offset);
+    EXPECT_EQ(ReadaheadTracker::kInitialWindow, range.length);
+}
+
+TEST(ReadaheadTrackerTest, testSlightlyOutOfOrderReadsAreSequential) {
+    ReadaheadTracker tracker;
+
+    EXPECT_EQ(0, tracker.OnRead(0, kReadSize).length);
+    // Two threads handled the next reads, the second one arrives first
+    EXPECT_NE(0, tracker.OnRead(2 * kReadSize, kReadSize).length);
+    tracker.OnRead(kReadSize, kReadSize);
+    EXPECT_NE(0, tracker.OnRead(3 * kReadSize, kReadSize).length);
+}
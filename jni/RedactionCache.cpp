@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RedactionCache"
+
+#include "libfuse_jni/RedactionCache.h"
+
+#include <android-base/logging.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x52444354;  // RDCT
+// Bump whenever the layout of the sidecar file changes, its entries are then discarded.
+constexpr uint32_t kVersion = 1;
+
+constexpr uint64_t kFnvOffset = 0xcbf29ce484222325ull;
+constexpr uint64_t kFnvPrime = 0x100000001b3ull;
+
+uint64_t Fnv(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * kFnvPrime;
+    }
+    return hash;
+}
+
+}  // namespace
+
+RedactionCache::RedactionCache(const std::string& path, size_t num_entries)
+    : num_entries_(std::max(kWays, (num_entries + kWays - 1) / kWays * kWays)),
+      map_size_(sizeof(Header) + num_entries_ * sizeof(Entry)),
+      map_(MAP_FAILED),
+      persistent_(false),
+      header_(nullptr),
+      entries_(nullptr),
+      clock_(0),
+      hits_(0),
+      misses_(0),
+      invalidations_(0) {
+    if (!path.empty()) {
+        persistent_ = Map(path);
+    }
+    if (!persistent_) {
+        map_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                    0);
+        CHECK(map_ != MAP_FAILED) << "Failed to allocate the redaction cache";
+    }
+
+    header_ = static_cast<Header*>(map_);
+    entries_ = reinterpret_cast<Entry*>(header_ + 1);
+    if (header_->magic != kMagic || header_->version != kVersion ||
+        header_->num_entries != num_entries_) {
+        memset(map_, 0, map_size_);
+        header_->magic = kMagic;
+        header_->version = kVersion;
+        header_->num_entries = num_entries_;
+        return;
+    }
+
+    // Reservations of the previous run will never be filled
+    for (size_t i = 0; i < num_entries_; i++) {
+        if (entries_[i].state == kReserved) {
+            entries_[i].state = kEmpty;
+        }
+        clock_ = std::max(clock_, entries_[i].last_used);
+    }
+}
+
+RedactionCache::~RedactionCache() {
+    munmap(map_, map_size_);
+}
+
+bool RedactionCache::Map(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        PLOG(WARNING) << "Failed to open " << path << ", redaction ranges are cached in memory";
+        return false;
+    }
+
+    struct stat st;
+    bool res = fstat(fd, &st) == 0;
+    if (res && st.st_size != static_cast<off_t>(map_size_)) {
+        // Resized files start over from zeroes
+        res = ftruncate(fd, 0) == 0 && ftruncate(fd, map_size_) == 0;
+    }
+    if (res) {
+        map_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        res = map_ != MAP_FAILED;
+    }
+    if (!res) {
+        PLOG(WARNING) << "Failed to map " << path << ", redaction ranges are cached in memory";
+    }
+    close(fd);
+    return res;
+}
+
+RedactionCache::Entry* RedactionCache::Find(uint64_t dev, uint64_t ino, bool create) {
+    const uint64_t hash = Fnv(Fnv(kFnvOffset, &dev, sizeof(dev)), &ino, sizeof(ino));
+    Entry* set = entries_ + (hash % (num_entries_ / kWays)) * kWays;
+
+    Entry* victim = set;
+    for (size_t i = 0; i < kWays; i++) {
+        Entry* entry = set + i;
+        if (entry->state != kEmpty && entry->dev == dev && entry->ino == ino) {
+            return entry;
+        }
+        if (!create) continue;
+        // Empty entries first, then the least recently used one
+        if (victim->state != kEmpty &&
+            (entry->state == kEmpty || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+    if (!create) return nullptr;
+
+    victim->state = kEmpty;
+    victim->dev = dev;
+    victim->ino = ino;
+    return victim;
+}
+
+bool RedactionCache::Matches(const Entry& entry, const struct stat& st) {
+    return entry.mtime_sec == st.st_mtim.tv_sec && entry.mtime_nsec == st.st_mtim.tv_nsec &&
+           entry.size == st.st_size;
+}
+
+uint64_t RedactionCache::Checksum(const Entry& entry) {
+    uint64_t hash = kFnvOffset;
+    hash = Fnv(hash, &entry.dev, sizeof(entry.dev));
+    hash = Fnv(hash, &entry.ino, sizeof(entry.ino));
+    hash = Fnv(hash, &entry.mtime_sec, sizeof(entry.mtime_sec));
+    hash = Fnv(hash, &entry.mtime_nsec, sizeof(entry.mtime_nsec));
+    hash = Fnv(hash, &entry.size, sizeof(entry.size));
+    hash = Fnv(hash, &entry.num_ranges, sizeof(entry.num_ranges));
+    return Fnv(hash, entry.ranges,
+               std::min<size_t>(entry.num_ranges, kMaxRanges) * 2 * sizeof(entry.ranges[0]));
+}
+
+bool RedactionCache::Lookup(const struct stat& st, std::vector<off64_t>* ranges) {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    Entry* entry = Find(st.st_dev, st.st_ino, true /* create */);
+    if (entry->state == kValid && Matches(*entry, st) && entry->num_ranges <= kMaxRanges &&
+        entry->checksum == Checksum(*entry)) {
+        entry->last_used = ++clock_;
+        ranges->assign(entry->ranges, entry->ranges + entry->num_ranges * 2);
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Reserve the entry for the ranges about to be computed
+    entry->state = kEmpty;
+    entry->mtime_sec = st.st_mtim.tv_sec;
+    entry->mtime_nsec = st.st_mtim.tv_nsec;
+    entry->size = st.st_size;
+    entry->num_ranges = 0;
+    entry->last_used = ++clock_;
+    entry->state = kReserved;
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void RedactionCache::Insert(const struct stat& st, const std::vector<off64_t>& ranges) {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    Entry* entry = Find(st.st_dev, st.st_ino, false /* create */);
+    if (!entry || entry->state != kReserved || !Matches(*entry, st)) {
+        // Invalidated or evicted since the miss
+        return;
+    }
+    if (ranges.size() / 2 > kMaxRanges) {
+        entry->state = kEmpty;
+        return;
+    }
+
+    entry->num_ranges = ranges.size() / 2;
+    std::copy(ranges.begin(), ranges.begin() + entry->num_ranges * 2, entry->ranges);
+    entry->checksum = Checksum(*entry);
+    entry->state = kValid;
+}
+
+void RedactionCache::Invalidate(dev_t dev, ino_t ino) {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    Entry* entry = Find(dev, ino, false /* create */);
+    if (entry) {
+        entry->state = kEmpty;
+        invalidations_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+RedactionCache::Stats RedactionCache::GetStats() const {
+    Stats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.invalidations = invalidations_.load(std::memory_order_relaxed);
+    stats.persistent = persistent_;
+    return stats;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RedactionCacheTest"
+
+#include <android-base/file.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "libfuse_jni/RedactionCache.h"
+
+using namespace mediaprovider::fuse;
+
+class RedactionCacheTest : public ::testing::Test {
+  protected:
+    static struct stat Stat(ino_t ino, time_t mtime = 100, off_t size = 1000) {
+        struct stat st = {};
+        st.st_dev = 1;
+        st.st_ino = ino;
+        st.st_mtim.tv_sec = mtime;
+        st.st_size = size;
+        return st;
+    }
+
+    // Caches |ranges| for |st| through a miss.
+    static void Cache(RedactionCache* cache, const struct stat& st,
+                      const std::vector<off64_t>& ranges) {
+        std::vector<off64_t> unused;
+        ASSERT_FALSE(cache->Lookup(st, &unused));
+        cache->Insert(st, ranges);
+    }
+
+    const std::vector<off64_t> ranges = {10, 20, 30, 40};
+};
+
+TEST_F(RedactionCacheTest, testHitAfterInsert) {
+    RedactionCache cache;
+    Cache(&cache, Stat(5), ranges);
+
+    std::vector<off64_t> res;
+    ASSERT_TRUE(cache.Lookup(Stat(5), &res));
+    EXPECT_EQ(ranges, res);
+
+    RedactionCache::Stats stats = cache.GetStats();
+    EXPECT_EQ(1, stats.hits);
+    EXPECT_EQ(1, stats.misses);
+    EXPECT_FALSE(stats.persistent);
+}
+
+TEST_F(RedactionCacheTest, testEmptyRangesAreCached) {
+    RedactionCache cache;
+    Cache(&cache, Stat(5), {});
+
+    std::vector<off64_t> res = {1, 2};
+    ASSERT_TRUE(cache.Lookup(Stat(5), &res));
+    EXPECT_TRUE(res.empty());
+}
+
+TEST_F(RedactionCacheTest, testChangedFileMisses) {
+    RedactionCache cache;
+    Cache(&cache, Stat(5), ranges);
+
+    std::vector<off64_t> res;
+    EXPECT_FALSE(cache.Lookup(Stat(5, 101), &res));
+    EXPECT_FALSE(cache.Lookup(Stat(5, 101, 2000), &res));
+    EXPECT_FALSE(cache.Lookup(Stat(6), &res));
+}
+
+TEST_F(RedactionCacheTest, testInvalidate) {
+    RedactionCache cache;
+    Cache(&cache, Stat(5), ranges);
+    Cache(&cache, Stat(6), ranges);
+
+    cache.Invalidate(1, 5);
+    std::vector<off64_t> res;
+    EXPECT_FALSE(cache.Lookup(Stat(5), &res));
+    EXPECT_TRUE(cache.Lookup(Stat(6), &res));
+    EXPECT_EQ(1, cache.GetStats().invalidations);
+}
+
+TEST_F(RedactionCacheTest, testInvalidateDropsReservation) {
+    RedactionCache cache;
+    std::vector<off64_t> res;
+    ASSERT_FALSE(cache.Lookup(Stat(5), &res));
+
+    // A write between the miss and the insert, the ranges may be stale
+    cache.Invalidate(1, 5);
+    cache.Insert(Stat(5), ranges);
+    EXPECT_FALSE(cache.Lookup(Stat(5), &res));
+}
+
+TEST_F(RedactionCacheTest, testInsertWithoutMatchingMissIsIgnored) {
+    RedactionCache cache;
+    cache.Insert(Stat(5), ranges);
+
+    std::vector<off64_t> res;
+    EXPECT_FALSE(cache.Lookup(Stat(5), &res));
+    cache.Insert(Stat(5, 101), ranges);
+    EXPECT_FALSE(cache.Lookup(Stat(5), &res));
+}
+
+TEST_F(RedactionCacheTest, testTooManyRangesAreNotCached) {
+    RedactionCache cache;
+    Cache(&cache, Stat(5), std::vector<off64_t>((RedactionCache::kMaxRanges + 1) * 2, 0));
+
+    std::vector<off64_t> res;
+    EXPECT_FALSE(cache.Lookup(Stat(5), &res));
+}
+
+TEST_F(RedactionCacheTest, testLeastRecentlyUsedIsEvicted) {
+    // A single set
+    RedactionCache cache("", 4);
+    for (ino_t ino = 1; ino <= 4; ino++) {
+        Cache(&cache, Stat(ino), ranges);
+    }
+    std::vector<off64_t> res;
+    ASSERT_TRUE(cache.Lookup(Stat(1), &res));
+
+    Cache(&cache, Stat(5), ranges);
+    EXPECT_TRUE(cache.Lookup(Stat(1), &res));
+    EXPECT_FALSE(cache.Lookup(Stat(2), &res));
+    EXPECT_TRUE(cache.Lookup(Stat(5), &res));
+}
+
+TEST_F(RedactionCacheTest, testPersistedAcrossInstances) {
+    TemporaryDir dir;
+    const std::string path = std::string(dir.path) + "/cache";
+    {
+        RedactionCache cache(path);
+        EXPECT_TRUE(cache.GetStats().persistent);
+        Cache(&cache, Stat(5), ranges);
+        // Never filled
+        std::vector<off64_t> res;
+        ASSERT_FALSE(cache.Lookup(Stat(6), &res));
+    }
+
+    RedactionCache cache(path);
+    std::vector<off64_t> res;
+    ASSERT_TRUE(cache.Lookup(Stat(5), &res));
+    EXPECT_EQ(ranges, res);
+    EXPECT_FALSE(cache.Lookup(Stat(6), &res));
+}
+
+TEST_F(RedactionCacheTest, testResizedSidecarIsDiscarded) {
+    TemporaryDir dir;
+    const std::string path = std::string(dir.path) + "/cache";
+    {
+        RedactionCache cache(path, 8);
+        Cache(&cache, Stat(5), ranges);
+    }
+
+    RedactionCache cache(path, 16);
+    std::vector<off64_t> res;
+    EXPECT_FALSE(cache.Lookup(Stat(5), &res));
+}
+
+TEST_F(RedactionCacheTest, testCorruptedEntryIsIgnored) {
+    TemporaryDir dir;
+    const std::string path = std::string(dir.path) + "/cache";
+    {
+        RedactionCache cache(path, 4);
+        Cache(&cache, Stat(5), ranges);
+    }
+
+    // Flip the first byte of the ranges of every entry, the header takes 16 bytes
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(path, &content));
+    const size_t entry_size = (content.size() - 16) / 4;
+    const size_t ranges_offset = entry_size - sizeof(int64_t) * RedactionCache::kMaxRanges * 2;
+    for (size_t i = 0; i < 4; i++) {
+        content[16 + i * entry_size + ranges_offset] ^= 1;
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(content, path));
+
+    RedactionCache cache(path, 4);
+    std::vector<off64_t> res;
+    EXPECT_FALSE(cache.Lookup(Stat(5), &res));
+}
+
+TEST_F(RedactionCacheTest, testUnusableSidecarFallsBackToMemory) {
+    RedactionCache cache("/nonexistent/dir/cache");
+    EXPECT_FALSE(cache.GetStats().persistent);
+    Cache(&cache, Stat(5), ranges);
+
+    std::vector<off64_t> res;
+    EXPECT_TRUE(cache.Lookup(Stat(5), &res));
+}
@@ -0,0 +1,537 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RedactionParser"
+
+#include "libfuse_jni/RedactionParser.h"
+
+#include <android-base/logging.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <string_view>
+#include <utility>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+constexpr uint8_t kJpegMarker = 0xff;
+constexpr uint8_t kJpegSoi = 0xd8;
+constexpr uint8_t kJpegEoi = 0xd9;
+constexpr uint8_t kJpegSos = 0xda;
+constexpr uint8_t kJpegApp1 = 0xe1;
+
+constexpr uint8_t kExifIdentifier[] = {'E', 'x', 'i', 'f', 0, 0};
+constexpr char kXmpIdentifier[] = "http://ns.adobe.com/xap/1.0/";
+
+// Segments read before giving up on finding the start of the image data.
+constexpr int kMaxJpegSegments = 256;
+
+constexpr uint16_t kTiffMagic = 42;
+constexpr uint16_t kTagGpsIfdPointer = 0x8825;
+constexpr uint16_t kTagXmp = 0x02bc;
+
+enum TiffFormat : uint16_t {
+    kFormatByte = 1,
+    kFormatAscii = 2,
+    kFormatShort = 3,
+    kFormatLong = 4,
+    kFormatRational = 5,
+    kFormatUndefined = 7,
+};
+
+// Bytes per component of each TIFF format, indexed by format.
+constexpr uint32_t kTiffFormatSizes[] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
+
+struct GpsTag {
+    uint16_t tag;
+    // Format of the tag as defined by EXIF. Tags in any other format are left to ExifInterface.
+    uint16_t format;
+};
+
+// GPS tags redacted, in the order of MediaProvider#REDACTED_EXIF_TAGS.
+constexpr GpsTag kRedactedGpsTags[] = {
+        {0x06, kFormatRational},   // GPSAltitude
+        {0x05, kFormatByte},       // GPSAltitudeRef
+        {0x1c, kFormatUndefined},  // GPSAreaInformation
+        {0x0b, kFormatRational},   // GPSDOP
+        {0x1d, kFormatAscii},      // GPSDateStamp
+        {0x18, kFormatRational},   // GPSDestBearing
+        {0x17, kFormatAscii},      // GPSDestBearingRef
+        {0x1a, kFormatRational},   // GPSDestDistance
+        {0x19, kFormatAscii},      // GPSDestDistanceRef
+        {0x14, kFormatRational},   // GPSDestLatitude
+        {0x13, kFormatAscii},      // GPSDestLatitudeRef
+        {0x16, kFormatRational},   // GPSDestLongitude
+        {0x15, kFormatAscii},      // GPSDestLongitudeRef
+        {0x1e, kFormatShort},      // GPSDifferential
+        {0x11, kFormatRational},   // GPSImgDirection
+        {0x10, kFormatAscii},      // GPSImgDirectionRef
+        {0x02, kFormatRational},   // GPSLatitude
+        {0x01, kFormatAscii},      // GPSLatitudeRef
+        {0x04, kFormatRational},   // GPSLongitude
+        {0x03, kFormatAscii},      // GPSLongitudeRef
+        {0x12, kFormatAscii},      // GPSMapDatum
+        {0x0a, kFormatAscii},      // GPSMeasureMode
+        {0x1b, kFormatUndefined},  // GPSProcessingMethod
+        {0x08, kFormatAscii},      // GPSSatellites
+        {0x0d, kFormatRational},   // GPSSpeed
+        {0x0c, kFormatAscii},      // GPSSpeedRef
+        {0x09, kFormatAscii},      // GPSStatus
+        {0x07, kFormatRational},   // GPSTimeStamp
+        {0x0f, kFormatRational},   // GPSTrack
+        {0x0e, kFormatAscii},      // GPSTrackRef
+        {0x00, kFormatByte},       // GPSVersionID
+};
+// Every tag up to this one is redacted.
+constexpr uint16_t kLastRedactedGpsTag = 0x1e;
+
+constexpr uint32_t kBoxFtyp = 0x66747970;
+constexpr uint32_t kBoxHdlr = 0x68646c72;
+constexpr uint32_t kBoxUuid = 0x75756964;
+constexpr uint32_t kBoxMeta = 0x6d657461;
+constexpr uint32_t kBoxXmp = 0x584d505f;
+
+// Boxes redacted, in the order of MediaProvider#REDACTED_ISO_BOXES.
+constexpr uint32_t kRedactedBoxes[] = {
+        0x6c6f6369,  // loci
+        0xa978797a,  // ©xyz
+        0x67707320,  // gps
+        0x67707330,  // gps0
+};
+
+// be7acfcb-97a9-42e8-9c71-999491e3afac
+constexpr uint8_t kXmpUuid[] = {0xbe, 0x7a, 0xcf, 0xcb, 0x97, 0xa9, 0x42, 0xe8,
+                                0x9c, 0x71, 0x99, 0x94, 0x91, 0xe3, 0xaf, 0xac};
+
+// Boxes parsed before giving up, the Java parser keeps them all in memory.
+constexpr size_t kMaxBoxes = 64 * 1024;
+
+// XMP packets larger than this are left to the Java parser rather than read.
+constexpr size_t kMaxXmpSize = 1024 * 1024;
+
+// Same as IsoInterface#isBoxParent.
+bool IsParentBox(uint32_t type) {
+    switch (type) {
+        case 0x6d6f6f76:  // moov
+        case 0x6d6f6f66:  // moof
+        case 0x74726166:  // traf
+        case 0x6d667261:  // mfra
+        case 0x7472616b:  // trak
+        case 0x74726566:  // tref
+        case 0x6d646961:  // mdia
+        case 0x6d696e66:  // minf
+        case 0x64696e66:  // dinf
+        case 0x7374626c:  // stbl
+        case 0x65647473:  // edts
+        case 0x75647461:  // udta
+        case 0x6970726f:  // ipro
+        case 0x73696e66:  // sinf
+        case 0x686e7469:  // hnti
+        case 0x68696e66:  // hinf
+        case 0x6a703268:  // jp2h
+        case 0x696c7374:  // ilst
+        case 0x6d657461:  // meta
+            return true;
+        default:
+            return false;
+    }
+}
+
+enum class FileType { kUnsupported, kJpeg, kIso };
+
+// Mirrors the mime types MediaProvider resolves from the extension and hands to ExifInterface or
+// IsoInterface. Types both parsers handle, e.g. HEIF, are left to Java.
+FileType GetFileType(const std::string& path) {
+    const size_t dot = path.find_last_of("./");
+    if (dot == std::string::npos || path[dot] != '.') return FileType::kUnsupported;
+
+    std::string extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "jpg" || extension == "jpeg") {
+        return FileType::kJpeg;
+    }
+    if (extension == "mp4" || extension == "3gp" || extension == "3gpp" || extension == "3g2" ||
+        extension == "3gpp2") {
+        return FileType::kIso;
+    }
+    return FileType::kUnsupported;
+}
+
+bool ReadFully(int fd, void* buf, size_t size, off64_t offset) {
+    uint8_t* p = static_cast<uint8_t*>(buf);
+    while (size) {
+        const ssize_t res = TEMP_FAILURE_RETRY(pread64(fd, p, size, offset));
+        if (res <= 0) return false;
+        p += res;
+        size -= res;
+        offset += res;
+    }
+    return true;
+}
+
+uint32_t ReadU32Be(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Only GPS properties of the exif namespace are redacted from XMP packets, and their names all
+// start with "GPS". Packets that don't mention it have nothing to redact.
+bool MayHoldGps(const uint8_t* data, size_t size) {
+    return std::string_view(reinterpret_cast<const char*>(data), size).find("GPS") !=
+           std::string_view::npos;
+}
+
+bool MayHoldGps(int fd, off64_t offset, off64_t size) {
+    if (size > static_cast<off64_t>(kMaxXmpSize)) return true;
+
+    std::vector<uint8_t> data(size);
+    return !ReadFully(fd, data.data(), size, offset) || MayHoldGps(data.data(), size);
+}
+
+class TiffReader {
+  public:
+    TiffReader(const uint8_t* data, size_t size)
+        : data_(data), size_(size), little_endian_(false) {}
+
+    bool Init() {
+        if (size_ < 8) return false;
+        if (data_[0] == 'I' && data_[1] == 'I') {
+            little_endian_ = true;
+        } else if (data_[0] != 'M' || data_[1] != 'M') {
+            return false;
+        }
+        uint16_t magic;
+        return ReadU16(2, &magic) && magic == kTiffMagic;
+    }
+
+    bool ReadU16(uint64_t offset, uint16_t* value) const {
+        if (offset + 2 > size_) return false;
+        const uint8_t* p = data_ + offset;
+        *value = little_endian_ ? (p[1] << 8 | p[0]) : (p[0] << 8 | p[1]);
+        return true;
+    }
+
+    bool ReadU32(uint64_t offset, uint32_t* value) const {
+        if (offset + 4 > size_) return false;
+        const uint8_t* p = data_ + offset;
+        *value = little_endian_
+                         ? (static_cast<uint32_t>(p[3]) << 24 | p[2] << 16 | p[1] << 8 | p[0])
+                         : ReadU32Be(p);
+        return true;
+    }
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    const uint8_t* const data_;
+    const size_t size_;
+    bool little_endian_;
+};
+
+struct IfdEntry {
+    uint16_t tag;
+    uint16_t format;
+    // Where the value is stored and how long it is, relative to the TIFF header.
+    uint64_t value_offset;
+    uint64_t value_size;
+};
+
+// Reads the entries of the IFD at |offset|, with the location of their value. Returns false if
+// the IFD or a value doesn't fit in the TIFF data, or has an unknown format.
+bool ReadIfd(const TiffReader& tiff, uint32_t offset, std::vector<IfdEntry>* entries) {
+    uint16_t count;
+    if (!tiff.ReadU16(offset, &count)) return false;
+
+    for (uint16_t i = 0; i < count; i++) {
+        const uint64_t entry_offset = offset + 2 + i * 12ull;
+        IfdEntry entry;
+        uint32_t components;
+        if (!tiff.ReadU16(entry_offset, &entry.tag) ||
+            !tiff.ReadU16(entry_offset + 2, &entry.format) ||
+            !tiff.ReadU32(entry_offset + 4, &components)) {
+            return false;
+        }
+        if (entry.format == 0 || entry.format >= std::size(kTiffFormatSizes)) return false;
+
+        entry.value_size = static_cast<uint64_t>(components) * kTiffFormatSizes[entry.format];
+        entry.value_offset = entry_offset + 8;
+        if (entry.value_size > 4) {
+            uint32_t value_offset;
+            if (!tiff.ReadU32(entry_offset + 8, &value_offset)) return false;
+            entry.value_offset = value_offset;
+        }
+        if (entry.value_offset + entry.value_size > tiff.size()) return false;
+        entries->push_back(entry);
+    }
+    return true;
+}
+
+// Looks for the GPS IFD pointer among the entries of IFD0 or IFD1, ExifInterface follows it from
+// both. Sets |gps_offset| to where it points, unless another pointer was found already. Returns
+// false if pointers disagree, since ExifInterface only keeps the tags of the last GPS IFD read,
+// or if an XMP packet may hold GPS data.
+bool FindGpsIfd(const TiffReader& tiff, const std::vector<IfdEntry>& ifd, uint32_t* gps_offset) {
+    for (const IfdEntry& entry : ifd) {
+        if (entry.tag == kTagGpsIfdPointer) {
+            uint32_t offset;
+            if (entry.format != kFormatLong || entry.value_size != 4 ||
+                !tiff.ReadU32(entry.value_offset, &offset)) {
+                return false;
+            }
+            if (*gps_offset && *gps_offset != offset) return false;
+            *gps_offset = offset;
+        } else if (entry.tag == kTagXmp &&
+                   MayHoldGps(tiff.data() + entry.value_offset, entry.value_size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Computes the ranges of the GPS tags of the TIFF data held by an EXIF segment. |base| is the
+// offset of the TIFF header within the file, ExifInterface reports ranges relative to the file.
+bool ParseTiff(const uint8_t* data, size_t size, off64_t base, std::vector<off64_t>* ranges) {
+    TiffReader tiff(data, size);
+    uint32_t ifd0_offset;
+    if (!tiff.Init() || !tiff.ReadU32(4, &ifd0_offset)) return false;
+
+    std::vector<IfdEntry> ifd0;
+    if (!ReadIfd(tiff, ifd0_offset, &ifd0)) return false;
+
+    uint32_t gps_offset = 0;
+    if (!FindGpsIfd(tiff, ifd0, &gps_offset)) return false;
+
+    // Like ExifInterface, follow the offset after IFD0 to IFD1, the thumbnail IFD, if it's within
+    // the TIFF data. No other IFD is read from there.
+    uint32_t ifd1_offset;
+    if (tiff.ReadU32(ifd0_offset + 2 + ifd0.size() * 12ull, &ifd1_offset) && ifd1_offset > 0 &&
+        ifd1_offset < size) {
+        std::vector<IfdEntry> ifd1;
+        if (!ReadIfd(tiff, ifd1_offset, &ifd1) || !FindGpsIfd(tiff, ifd1, &gps_offset)) {
+            return false;
+        }
+    }
+    if (!gps_offset) return true;
+
+    std::vector<IfdEntry> gps;
+    if (!ReadIfd(tiff, gps_offset, &gps)) return false;
+
+    const IfdEntry* found[kLastRedactedGpsTag + 1] = {};
+    for (const IfdEntry& entry : gps) {
+        if (entry.tag > kLastRedactedGpsTag) continue;
+        // Which of duplicated tags ExifInterface reports isn't worth guessing
+        if (found[entry.tag]) return false;
+        found[entry.tag] = &entry;
+    }
+
+    for (const GpsTag& tag : kRedactedGpsTags) {
+        const IfdEntry* entry = found[tag.tag];
+        if (!entry) continue;
+        if (entry->format != tag.format) return false;
+
+        ranges->push_back(base + entry->value_offset);
+        ranges->push_back(base + entry->value_offset + entry->value_size);
+    }
+    return true;
+}
+
+bool ParseJpeg(int fd, std::vector<off64_t>* ranges) {
+    uint8_t header[4];
+    if (!ReadFully(fd, header, 2, 0) || header[0] != kJpegMarker || header[1] != kJpegSoi) {
+        return false;
+    }
+
+    bool exif_found = false;
+    std::vector<uint8_t> segment;
+    off64_t offset = 2;
+    for (int i = 0; i < kMaxJpegSegments; i++) {
+        if (!ReadFully(fd, header, 2, offset) || header[0] != kJpegMarker) return false;
+
+        const uint8_t marker = header[1];
+        if (marker == kJpegSos || marker == kJpegEoi) {
+            // No metadata past the start of the image data
+            return true;
+        }
+
+        if (!ReadFully(fd, header + 2, 2, offset + 2)) return false;
+        const size_t length = header[2] << 8 | header[3];
+        if (length < 2) return false;
+        const off64_t data_offset = offset + 4;
+        const size_t data_size = length - 2;
+
+        if (marker == kJpegApp1) {
+            segment.resize(data_size);
+            if (!ReadFully(fd, segment.data(), data_size, data_offset)) return false;
+
+            if (data_size >= sizeof(kExifIdentifier) &&
+                !memcmp(segment.data(), kExifIdentifier, sizeof(kExifIdentifier))) {
+                if (exif_found) return false;
+                exif_found = true;
+                if (!ParseTiff(segment.data() + sizeof(kExifIdentifier),
+                               data_size - sizeof(kExifIdentifier),
+                               data_offset + sizeof(kExifIdentifier), ranges)) {
+                    return false;
+                }
+            } else if (data_size >= sizeof(kXmpIdentifier) &&
+                       !memcmp(segment.data(), kXmpIdentifier, sizeof(kXmpIdentifier)) &&
+                       MayHoldGps(segment.data(), data_size)) {
+                return false;
+            }
+        }
+        offset = data_offset + data_size;
+    }
+    return false;
+}
+
+struct Box {
+    uint32_t type;
+    off64_t offset;
+    off64_t length;
+    off64_t header_size;
+};
+
+enum class BoxResult { kBox, kEnd, kUnsupported };
+
+// Parses the box at |offset| within a parent ending at |end|, the same way as
+// IsoInterface#parseNextBox. kEnd is returned where it would return null, and kUnsupported where
+// it would throw.
+BoxResult ParseBox(int fd, off64_t offset, off64_t end, Box* box) {
+    if (end - offset < 8) return BoxResult::kEnd;
+
+    uint8_t header[16];
+    if (!ReadFully(fd, header, 8, offset)) return BoxResult::kUnsupported;
+
+    int64_t length = ReadU32Be(header);
+    box->type = ReadU32Be(header + 4);
+    box->offset = offset;
+    box->header_size = 8;
+    if (length == 0) {
+        // The box extends to the end of its parent
+        length = end - offset;
+    } else if (length == 1) {
+        box->header_size += 8;
+        if (!ReadFully(fd, header + 8, 8, offset + 8)) return BoxResult::kUnsupported;
+        length = static_cast<int64_t>(static_cast<uint64_t>(ReadU32Be(header + 8)) << 32 |
+                                      ReadU32Be(header + 12));
+    }
+    if (length < box->header_size || length > end - offset) return BoxResult::kEnd;
+    box->length = length;
+
+    if (box->type == kBoxUuid) {
+        uint8_t uuid[16];
+        if (!ReadFully(fd, uuid, sizeof(uuid), offset + box->header_size)) {
+            return BoxResult::kUnsupported;
+        }
+        box->header_size += sizeof(uuid);
+        if (length > INT32_MAX) return BoxResult::kEnd;
+        if (length < box->header_size) return BoxResult::kUnsupported;
+        if (!memcmp(uuid, kXmpUuid, sizeof(uuid)) &&
+            MayHoldGps(fd, offset + box->header_size, length - box->header_size)) {
+            return BoxResult::kUnsupported;
+        }
+    } else if (box->type == kBoxXmp) {
+        if (length > INT32_MAX) return BoxResult::kEnd;
+        if (MayHoldGps(fd, offset + box->header_size, length - box->header_size)) {
+            return BoxResult::kUnsupported;
+        }
+    } else if (box->type == kBoxMeta && length != box->header_size) {
+        // ISO meta boxes have a version and flags before their children, QuickTime ones don't
+        uint8_t next[8];
+        if (!ReadFully(fd, next, sizeof(next), offset + box->header_size)) {
+            return BoxResult::kUnsupported;
+        }
+        if (ReadU32Be(next + 4) != kBoxHdlr) {
+            box->header_size += 4;
+        }
+    }
+    return BoxResult::kBox;
+}
+
+bool ParseIso(int fd, std::vector<off64_t>* ranges) {
+    uint8_t ftyp[4];
+    if (!ReadFully(fd, ftyp, sizeof(ftyp), 4) || ReadU32Be(ftyp) != kBoxFtyp) {
+        // Not an ISO base media file, nothing to redact
+        return true;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) return false;
+
+    // Boxes are listed breadth first, which is the order IsoInterface reports them in
+    std::vector<Box> boxes;
+    std::deque<std::pair<off64_t, off64_t>> parents = {{0, st.st_size}};
+    while (!parents.empty()) {
+        off64_t offset = parents.front().first;
+        const off64_t end = parents.front().second;
+        parents.pop_front();
+
+        Box box;
+        BoxResult result;
+        while ((result = ParseBox(fd, offset, end, &box)) == BoxResult::kBox) {
+            if (boxes.size() == kMaxBoxes) return false;
+            boxes.push_back(box);
+            if (IsParentBox(box.type)) {
+                parents.emplace_back(box.offset + box.header_size, box.offset + box.length);
+            }
+            offset = box.offset + box.length;
+        }
+        if (result == BoxResult::kUnsupported) return false;
+    }
+
+    for (uint32_t type : kRedactedBoxes) {
+        for (const Box& box : boxes) {
+            if (box.type == type) {
+                // The box type is redacted too; MediaProvider rewrites it as 'free'
+                ranges->push_back(box.offset + box.header_size - 4);
+                ranges->push_back(box.offset + box.length);
+            }
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+bool ParseRedactionRanges(int fd, const std::string& path, std::vector<off64_t>* ranges) {
+    ranges->clear();
+
+    bool parsed;
+    switch (GetFileType(path)) {
+        case FileType::kJpeg:
+            parsed = ParseJpeg(fd, ranges);
+            break;
+        case FileType::kIso:
+            parsed = ParseIso(fd, ranges);
+            break;
+        default:
+            return false;
+    }
+
+    if (!parsed) {
+        LOG(VERBOSE) << "Leaving redaction of " << path << " to MediaProvider";
+        ranges->clear();
+    }
+    return parsed;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "RedactionParserTest"
+
+#include <android-base/file.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "libfuse_jni/RedactionParser.h"
+
+using namespace mediaprovider::fuse;
+
+// The expected ranges are the ones MediaProvider#getRedactionRanges returns for the same files;
+// the Java side compares both parsers on real media in MediaProviderTest.
+class RedactionParserTest : public ::testing::Test {
+  protected:
+    // Writes |bytes| to a file named |name| and parses it.
+    bool Parse(const std::string& name, const std::string& bytes, std::vector<off64_t>* ranges) {
+        const std::string path = std::string(dir.path) + "/" + name;
+        EXPECT_TRUE(android::base::WriteStringToFile(bytes, path));
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        EXPECT_LE(0, fd);
+        const bool res = ParseRedactionRanges(fd, path, ranges);
+        close(fd);
+        return res;
+    }
+
+    static void Le16(std::string* out, uint16_t value) {
+        out->push_back(value & 0xff);
+        out->push_back(value >> 8);
+    }
+
+    static void Le32(std::string* out, uint32_t value) {
+        Le16(out, value & 0xffff);
+        Le16(out, value >> 16);
+    }
+
+    static void Be16(std::string* out, uint16_t value) {
+        out->push_back(value >> 8);
+        out->push_back(value & 0xff);
+    }
+
+    static void Be32(std::string* out, uint32_t value) {
+        Be16(out, value >> 16);
+        Be16(out, value & 0xffff);
+    }
+
+    static void Entry(std::string* out, uint16_t tag, uint16_t format, uint32_t count,
+                      uint32_t value) {
+        Le16(out, tag);
+        Le16(out, format);
+        Le32(out, count);
+        Le32(out, value);
+    }
+
+    // Little endian TIFF data with an IFD0 pointing to a GPS IFD holding GPSVersionID,
+    // GPSLatitudeRef and GPSLatitude, in a |latitude_ref_format| format.
+    static std::string GpsTiff(uint16_t latitude_ref_format = 2) {
+        std::string tiff = "II";
+        Le16(&tiff, 42);
+        Le32(&tiff, 8);
+        // IFD0 at 8
+        Le16(&tiff, 1);
+        Entry(&tiff, 0x8825, 4, 1, 26);
+        Le32(&tiff, 0);
+        // GPS IFD at 26
+        Le16(&tiff, 3);
+        Entry(&tiff, 0x00, 1, 4, 0x00000202);
+        Entry(&tiff, 0x01, latitude_ref_format, 2, 'N');
+        Entry(&tiff, 0x02, 5, 3, 68);
+        Le32(&tiff, 0);
+        // GPSLatitude at 68
+        for (int i = 0; i < 6; i++) {
+            Le32(&tiff, i);
+        }
+        return tiff;
+    }
+
+    // Little endian TIFF data with an IFD1 pointing to a GPS IFD holding GPSVersionID,
+    // GPSLatitudeRef and GPSLatitude. IFD0 points to |ifd0_gps_offset| as well if set.
+    static std::string Ifd1GpsTiff(uint32_t ifd0_gps_offset = 0) {
+        std::string tiff = "II";
+        Le16(&tiff, 42);
+        Le32(&tiff, 8);
+        // IFD0 at 8, followed by the offset of IFD1
+        Le16(&tiff, 1);
+        if (ifd0_gps_offset) {
+            Entry(&tiff, 0x8825, 4, 1, ifd0_gps_offset);
+        } else {
+            Entry(&tiff, 0x0100, 3, 1, 1);  // ImageWidth
+        }
+        Le32(&tiff, 26);
+        // IFD1 at 26
+        Le16(&tiff, 1);
+        Entry(&tiff, 0x8825, 4, 1, 44);
+        Le32(&tiff, 0);
+        // GPS IFD at 44
+        Le16(&tiff, 3);
+        Entry(&tiff, 0x00, 1, 4, 0x00000202);
+        Entry(&tiff, 0x01, 2, 2, 'N');
+        Entry(&tiff, 0x02, 5, 3, 86);
+        Le32(&tiff, 0);
+        // GPSLatitude at 86
+        for (int i = 0; i < 6; i++) {
+            Le32(&tiff, i);
+        }
+        return tiff;
+    }
+
+    static std::string Jpeg(const std::vector<std::string>& app1_segments) {
+        std::string jpeg = "\xff\xd8";
+        for (const std::string& segment : app1_segments) {
+            jpeg += "\xff\xe1";
+            Be16(&jpeg, segment.size() + 2);
+            jpeg += segment;
+        }
+        // Start of scan, followed by image data
+        jpeg += std::string("\xff\xda\x00\x02", 4);
+        jpeg += std::string(64, '\x55');
+        return jpeg;
+    }
+
+    static std::string Exif(const std::string& tiff) { return std::string("Exif\0\0", 6) + tiff; }
+
+    static std::string Xmp(const std::string& packet) {
+        return std::string("http://ns.adobe.com/xap/1.0/\0", 29) + packet;
+    }
+
+    static std::string Box(const std::string& type, const std::string& payload) {
+        std::string box;
+        Be32(&box, payload.size() + 8);
+        return box + type + payload;
+    }
+
+    TemporaryDir dir;
+};
+
+TEST_F(RedactionParserTest, testJpegGpsTags) {
+    std::vector<off64_t> ranges;
+    ASSERT_TRUE(Parse("a.jpg", Jpeg({Exif(GpsTiff())}), &ranges));
+
+    // The TIFF header is at 12, ranges are in the order of REDACTED_EXIF_TAGS
+    const std::vector<off64_t> expected = {
+            12 + 68, 12 + 92,  // GPSLatitude, stored out of line
+            12 + 48, 12 + 50,  // GPSLatitudeRef
+            12 + 36, 12 + 40,  // GPSVersionID
+    };
+    EXPECT_EQ(expected, ranges);
+}
+
+TEST_F(RedactionParserTest, testJpegGpsTagsFromIfd1) {
+    std::vector<off64_t> ranges;
+    ASSERT_TRUE(Parse("a.jpg", Jpeg({Exif(Ifd1GpsTiff())}), &ranges));
+
+    const std::vector<off64_t> expected = {
+            12 + 86, 12 + 110,  // GPSLatitude
+            12 + 66, 12 + 68,   // GPSLatitudeRef
+            12 + 54, 12 + 58,   // GPSVersionID
+    };
+    EXPECT_EQ(expected, ranges);
+}
+
+TEST_F(RedactionParserTest, testJpegSameGpsIfdFromBothIfds) {
+    std::vector<off64_t> ranges;
+    ASSERT_TRUE(Parse("a.jpg", Jpeg({Exif(Ifd1GpsTiff(44))}), &ranges));
+    EXPECT_EQ(6, ranges.size());
+}
+
+TEST_F(RedactionParserTest, testJpegConflictingGpsIfdsAreLeftToJava) {
+    std::vector<off64_t> ranges;
+    EXPECT_FALSE(Parse("a.jpg", Jpeg({Exif(Ifd1GpsTiff(26))}), &ranges));
+}
+
+TEST_F(RedactionParserTest, testJpegExtensionIsCaseInsensitive) {
+    std::vector<off64_t> ranges;
+    ASSERT_TRUE(Parse("a.JPEG", Jpeg({Exif(GpsTiff())}), &ranges));
+    EXPECT_EQ(6, ranges.size());
+}
+
+TEST_F(RedactionParserTest, testJpegWithoutExif) {
+    std::vector<off64_t> ranges = {1, 2};
+    ASSERT_TRUE(Parse("a.jpg", Jpeg({}), &ranges));
+    EXPECT_TRUE(ranges.empty());
+}
+
+TEST_F(RedactionParserTest, testJpegXmpWithoutGps) {
+    std::vector<off64_t> ranges;
+    ASSERT_TRUE(Parse("a.jpg", Jpeg({Xmp("<x:xmpmeta><exif:Make>x</exif:Make></x:xmpmeta>"),
+                                     Exif(GpsTiff())}),
+                      &ranges));
+    EXPECT_EQ(6, ranges.size());
+}
+
+TEST_F(RedactionParserTest, testJpegXmpWithGpsIsLeftToJava) {
+    std::vector<off64_t> ranges;
+    EXPECT_FALSE(Parse("a.jpg",
+                       Jpeg({Exif(GpsTiff()),
+                             Xmp("<x:xmpmeta><exif:GPSLatitude>1</exif:GPSLatitude></x:xmpmeta>")}),
+                       &ranges));
+    EXPECT_TRUE(ranges.empty());
+}
+
+TEST_F(RedactionParserTest, testJpegUnexpectedFormatIsLeftToJava) {
+    std::vector<off64_t> ranges;
+    EXPECT_FALSE(Parse("a.jpg", Jpeg({Exif(GpsTiff(7 /* undefined */))}), &ranges));
+}
+
+TEST_F(RedactionParserTest, testTruncatedJpegIsLeftToJava) {
+    const std::string jpeg = Jpeg({Exif(GpsTiff())});
+    std::vector<off64_t> ranges;
+    EXPECT_FALSE(Parse("a.jpg", jpeg.substr(0, 40), &ranges));
+}
+
+TEST_F(RedactionParserTest, testIsoLocationBoxes) {
+    const std::string ftyp = Box("ftyp", "isom");
+    std::string iso_meta_payload;
+    Be32(&iso_meta_payload, 0);  // version and flags
+    iso_meta_payload += Box("gps0", "xy");
+    const std::string udta = Box("udta", Box("\xa9xyz", "+01.0+02.0/") + Box("loci", "home") +
+                                                 Box("meta", iso_meta_payload));
+    const std::string moov = Box("moov", Box("mvhd", std::string(12, '\0')) + udta);
+
+    std::vector<off64_t> ranges;
+    ASSERT_TRUE(Parse("a.mp4", ftyp + moov + Box("mdat", "data"), &ranges));
+
+    // ftyp: 0-12, moov: 12, mvhd: 20-40, udta: 40, ©xyz: 48-67, loci: 67-79, meta: 79,
+    // gps0 after the version and flags of meta: 91-101
+    const std::vector<off64_t> expected = {
+            71, 79,   // loci
+            52, 67,   // ©xyz
+            95, 101,  // gps0
+    };
+    EXPECT_EQ(expected, ranges);
+}
+
+TEST_F(RedactionParserTest, testIsoWithoutFtyp) {
+    std::vector<off64_t> ranges;
+    ASSERT_TRUE(Parse("a.mp4", Box("moov", Box("loci", "home")), &ranges));
+    EXPECT_TRUE(ranges.empty());
+}
+
+TEST_F(RedactionParserTest, testIsoXmpWithGpsIsLeftToJava) {
+    std::vector<off64_t> ranges;
+    EXPECT_FALSE(Parse("a.mp4", Box("ftyp", "isom") + Box("XMP_", "<exif:GPSAltitude/>"),
+                       &ranges));
+}
+
+TEST_F(RedactionParserTest, testOtherTypesAreLeftToJava) {
+    std::vector<off64_t> ranges;
+    EXPECT_FALSE(Parse("a.heic", Box("ftyp", "heic"), &ranges));
+    EXPECT_FALSE(Parse("a.png", "\x89PNG", &ranges));
+    EXPECT_FALSE(Parse("jpg", Jpeg({}), &ranges));
+}
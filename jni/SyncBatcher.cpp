@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "SyncBatcher"
+
+#include "libfuse_jni/SyncBatcher.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+namespace mediaprovider {
+namespace fuse {
+
+namespace {
+
+// Result of a request whose sync hasn't completed yet.
+constexpr int kPending = -1;
+
+int DefaultSyncFile(int fd, bool datasync) {
+    return datasync ? fdatasync(fd) : fsync(fd);
+}
+
+}  // namespace
+
+SyncBatcher::SyncBatcher(SyncFileFunction sync_file)
+    : sync_file_(sync_file ? std::move(sync_file) : DefaultSyncFile),
+      syncs_(0),
+      batches_(0),
+      batched_(0) {}
+
+int SyncBatcher::Sync(int fd, dev_t dev, ino_t ino, bool datasync) {
+    std::unique_lock<std::mutex> lock(lock_);
+    syncs_.fetch_add(1, std::memory_order_relaxed);
+    const auto key = std::make_pair(dev, ino);
+    Group& group = groups_[key];
+    int result = kPending;
+    group.waiting.push_back(&result);
+    group.full |= !datasync;
+
+    // A running sync may have started before our writes, wait for the next one. Once woken with
+    // a result, |group| may be gone already.
+    cv_.wait(lock, [&group, &result] {
+        return result != kPending || (!group.running && group.waiting.front() == &result);
+    });
+    if (result != kPending) {
+        return result;
+    }
+
+    std::vector<int*> batch;
+    batch.swap(group.waiting);
+    const bool full = group.full;
+    group.full = false;
+    group.running = true;
+    lock.unlock();
+
+    if (batch.size() > 1) {
+        batches_.fetch_add(1, std::memory_order_relaxed);
+        batched_.fetch_add(batch.size(), std::memory_order_relaxed);
+    }
+    const int err = sync_file_(fd, !full) ? errno : 0;
+
+    lock.lock();
+    for (int* res : batch) {
+        *res = err;
+    }
+    group.running = false;
+    if (group.waiting.empty()) {
+        groups_.erase(key);
+    }
+    cv_.notify_all();
+    return err;
+}
+
+SyncBatcher::Stats SyncBatcher::GetStats() const {
+    Stats stats;
+    stats.syncs = syncs_.load(std::memory_order_relaxed);
+    stats.batches = batches_.load(std::memory_order_relaxed);
+    stats.batched = batched_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
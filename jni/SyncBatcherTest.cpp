@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "SyncBatcherTest"
+
+#include <android-base/file.h>
+#include <errno.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "libfuse_jni/SyncBatcher.h"
+
+using namespace mediaprovider::fuse;
+
+class SyncBatcherTest : public ::testing::Test {
+  protected:
+    SyncBatcherTest()
+        : batcher([this](int fd, bool datasync) {
+              file_syncs++;
+              if (!datasync) {
+                  full_syncs++;
+              }
+              std::unique_lock<std::mutex> lock(lock_);
+              if (block_fd_ == fd) {
+                  blocked_ = true;
+                  cv_.notify_all();
+                  cv_.wait(lock, [this, fd] { return block_fd_ != fd; });
+              }
+              if (fd == kFailingFd) {
+                  errno = EIO;
+                  return -1;
+              }
+              return 0;
+          }) {}
+
+    // Makes the next sync of |fd| block until Unblock() and waits for it to start, in a thread.
+    std::thread SyncBlocked(int fd, ino_t ino) {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            block_fd_ = fd;
+            blocked_ = false;
+        }
+        std::thread thread([this, fd, ino] { EXPECT_EQ(0, batcher.Sync(fd, 1, ino, true)); });
+        std::unique_lock<std::mutex> lock(lock_);
+        cv_.wait(lock, [this] { return blocked_; });
+        return thread;
+    }
+
+    void Unblock() {
+        std::lock_guard<std::mutex> guard(lock_);
+        block_fd_ = -1;
+        cv_.notify_all();
+    }
+
+    // Waits until |count| syncs were requested in total.
+    void WaitForSyncs(uint64_t count) {
+        while (batcher.GetStats().syncs < count) {
+            std::this_thread::yield();
+        }
+    }
+
+    static constexpr int kFailingFd = 99;
+
+    std::atomic_int file_syncs{0};
+    std::atomic_int full_syncs{0};
+    SyncBatcher batcher;
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    int block_fd_ = -1;
+    bool blocked_ = false;
+};
+
+TEST_F(SyncBatcherTest, testSingleSyncs) {
+    EXPECT_EQ(0, batcher.Sync(1, 1, 5, false));
+    EXPECT_EQ(0, batcher.Sync(2, 1, 5, true));
+    EXPECT_EQ(2, file_syncs);
+    EXPECT_EQ(1, full_syncs);
+
+    SyncBatcher::Stats stats = batcher.GetStats();
+    EXPECT_EQ(2, stats.syncs);
+    EXPECT_EQ(0, stats.batches);
+}
+
+TEST_F(SyncBatcherTest, testConcurrentSyncsOfFileAreBatched) {
+    std::thread running = SyncBlocked(1, 5);
+
+    // Queued behind the running sync, through other fds of the same file
+    std::vector<std::thread> threads;
+    for (int fd = 10; fd < 13; fd++) {
+        threads.emplace_back([this, fd] { EXPECT_EQ(0, batcher.Sync(fd, 1, 5, fd != 11)); });
+    }
+    WaitForSyncs(4);
+    Unblock();
+    running.join();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    // The queued requests share a single sync, a full one as one of them asked for it
+    EXPECT_EQ(2, file_syncs);
+    EXPECT_EQ(1, full_syncs);
+    SyncBatcher::Stats stats = batcher.GetStats();
+    EXPECT_EQ(1, stats.batches);
+    EXPECT_EQ(3, stats.batched);
+}
+
+TEST_F(SyncBatcherTest, testFilesAreSyncedIndependently) {
+    std::thread running = SyncBlocked(1, 5);
+
+    // Not held by the sync of another inode, nor of the same inode on another device
+    EXPECT_EQ(0, batcher.Sync(2, 1, 6, false));
+    EXPECT_EQ(0, batcher.Sync(3, 2, 5, false));
+    Unblock();
+    running.join();
+    EXPECT_EQ(3, file_syncs);
+    EXPECT_EQ(0, batcher.GetStats().batches);
+}
+
+TEST_F(SyncBatcherTest, testErrorIsReportedToBatch) {
+    std::thread running = SyncBlocked(1, 5);
+
+    int first = -1;
+    int second = -1;
+    std::thread t1([this, &first] { first = batcher.Sync(kFailingFd, 1, 5, false); });
+    WaitForSyncs(2);
+    std::thread t2([this, &second] { second = batcher.Sync(10, 1, 5, false); });
+    WaitForSyncs(3);
+    Unblock();
+    running.join();
+    t1.join();
+    t2.join();
+
+    // The batch is synced through the fd of its first request
+    EXPECT_EQ(EIO, first);
+    EXPECT_EQ(EIO, second);
+    EXPECT_EQ(0, batcher.Sync(10, 1, 5, false));
+}
+
+TEST_F(SyncBatcherTest, testRealFiles) {
+    SyncBatcher real;
+    TemporaryFile file;
+    ASSERT_TRUE(android::base::WriteStringToFile("data", file.path));
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back(
+                [&real, &file, i] { EXPECT_EQ(0, real.Sync(file.fd, 1, 1, i % 2)); });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(8, real.GetStats().syncs);
+    EXPECT_EQ(EBADF, real.Sync(-1, 1, 2, false));
+}
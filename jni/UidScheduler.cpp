@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "UidScheduler"
+
+#include "include/libfuse_jni/UidScheduler.h"
+
+#include <android-base/logging.h>
+
+#include <algorithm>
+
+namespace mediaprovider {
+namespace fuse {
+
+// Virtual time units per unit of cost for a task of weight 1. Large enough that dividing by the
+// foreground weight doesn't round the finish tag of any task down to its start tag.
+static constexpr uint64_t kTagScale = 1 << 10;
+
+UidScheduler::UidScheduler(uint32_t foreground_weight)
+    : foreground_weight_(std::max<uint32_t>(foreground_weight, 1)),
+      virtual_time_(0),
+      queue_depth_(0) {}
+
+void UidScheduler::Push(uid_t uid, uint32_t cost, std::function<void()> task) {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    const uint64_t weight = foreground_uids_.count(uid) ? foreground_weight_ : 1;
+    UidQueue& queue = queues_[uid];
+    const uint64_t start_tag = std::max(virtual_time_, queue.finish_tag);
+    if (queue.tasks.empty()) {
+        idle_.erase({queue.finish_tag, uid});
+        heads_.emplace(start_tag, uid);
+    }
+    queue.finish_tag = start_tag + std::max<uint64_t>(cost, 1) * kTagScale / weight;
+
+    queue.tasks.push_back({std::move(task), start_tag, std::chrono::steady_clock::now()});
+    queue_depth_++;
+}
+
+bool UidScheduler::RunNext() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (heads_.empty()) {
+            return false;
+        }
+
+        const auto head = heads_.begin();
+        const uid_t uid = head->second;
+        heads_.erase(head);
+
+        auto queue_it = queues_.find(uid);
+        CHECK(queue_it != queues_.end() && !queue_it->second.tasks.empty());
+        UidQueue& queue = queue_it->second;
+        Task& next = queue.tasks.front();
+        virtual_time_ = next.start_tag;
+
+        const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - next.queued);
+        UidStats& stats = stats_[uid];
+        stats.count++;
+        stats.total_wait += wait;
+        stats.max_wait = std::max(stats.max_wait, wait);
+
+        task = std::move(next.run);
+        queue.tasks.pop_front();
+        queue_depth_--;
+        if (!queue.tasks.empty()) {
+            heads_.emplace(queue.tasks.front().start_tag, uid);
+        } else {
+            idle_.emplace(queue.finish_tag, uid);
+        }
+
+        // Once the virtual time reached its finish tag, an empty queue starts over like a new
+        // one, so there is nothing left to remember for the uid
+        while (!idle_.empty() && idle_.begin()->first <= virtual_time_) {
+            queues_.erase(idle_.begin()->second);
+            idle_.erase(idle_.begin());
+        }
+    }
+
+    task();
+    return true;
+}
+
+void UidScheduler::SetForeground(uid_t uid, bool foreground) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (foreground) {
+        foreground_uids_.insert(uid);
+    } else {
+        foreground_uids_.erase(uid);
+    }
+}
+
+size_t UidScheduler::GetQueueDepth() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return queue_depth_;
+}
+
+size_t UidScheduler::GetQueueCount() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return queues_.size();
+}
+
+std::map<uid_t, UidScheduler::UidStats> UidScheduler::GetStats() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return std::map<uid_t, UidStats>(stats_.begin(), stats_.end());
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "UidSchedulerTest"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "libfuse_jni/UidScheduler.h"
+
+using namespace mediaprovider::fuse;
+
+class UidSchedulerTest : public ::testing::Test {
+  protected:
+    void Push(uid_t uid, uint32_t cost = 1) {
+        scheduler.Push(uid, cost, [this, uid] { order += std::to_string(uid); });
+    }
+
+    void RunAll() {
+        while (scheduler.RunNext()) {
+        }
+    }
+
+    UidScheduler scheduler{4};
+    std::string order;
+};
+
+TEST_F(UidSchedulerTest, testRunNextWhenEmpty) {
+    EXPECT_FALSE(scheduler.RunNext());
+}
+
+TEST_F(UidSchedulerTest, testSingleUidIsFifo) {
+    std::string expected;
+    for (int i = 0; i < 5; i++) {
+        scheduler.Push(1, 1, [this, i] { order += std::to_string(i); });
+        expected += std::to_string(i);
+    }
+    EXPECT_EQ(5, scheduler.GetQueueDepth());
+
+    RunAll();
+    EXPECT_EQ(expected, order);
+    EXPECT_EQ(0, scheduler.GetQueueDepth());
+}
+
+TEST_F(UidSchedulerTest, testUidsInterleave) {
+    for (int i = 0; i < 3; i++) {
+        Push(1);
+    }
+    for (int i = 0; i < 3; i++) {
+        Push(2);
+    }
+
+    RunAll();
+    EXPECT_EQ("121212", order);
+}
+
+TEST_F(UidSchedulerTest, testCostIsShared) {
+    // uid 1 issues large requests, uid 2 small ones: uid 2 gets 4 requests per request of uid 1
+    for (int i = 0; i < 2; i++) {
+        Push(1, 4);
+    }
+    for (int i = 0; i < 8; i++) {
+        Push(2, 1);
+    }
+
+    RunAll();
+    EXPECT_EQ("1222212222", order);
+}
+
+TEST_F(UidSchedulerTest, testForegroundWeight) {
+    scheduler.SetForeground(2, true);
+    for (int i = 0; i < 2; i++) {
+        Push(1);
+    }
+    for (int i = 0; i < 8; i++) {
+        Push(2);
+    }
+
+    RunAll();
+    EXPECT_EQ("1222212222", order);
+
+    // Back in the background, uids share equally again
+    scheduler.SetForeground(2, false);
+    order.clear();
+    for (int i = 0; i < 2; i++) {
+        Push(1);
+        Push(2);
+    }
+    RunAll();
+    EXPECT_EQ("1212", order);
+}
+
+TEST_F(UidSchedulerTest, testIdleUidDoesNotBankCredit) {
+    // uid 1 runs alone for a while, uid 2 showing up later must not be able to monopolize
+    for (int i = 0; i < 4; i++) {
+        Push(1);
+    }
+    RunAll();
+
+    order.clear();
+    for (int i = 0; i < 2; i++) {
+        Push(1);
+    }
+    for (int i = 0; i < 2; i++) {
+        Push(2);
+    }
+    RunAll();
+    // uid 1 already had its turn for the current virtual time, so uid 2 goes first
+    EXPECT_EQ("2121", order);
+}
+
+TEST_F(UidSchedulerTest, testDropsDrainedQueues) {
+    Push(1);
+    Push(2);
+    RunAll();
+    // Both ran at the current virtual time, their finish tags are still ahead of it
+    EXPECT_EQ(2, scheduler.GetQueueCount());
+
+    Push(3, 10);
+    Push(3, 10);
+    RunAll();
+    EXPECT_EQ(1, scheduler.GetQueueCount());
+
+    // A dropped uid is scheduled like a new one
+    order.clear();
+    Push(3);
+    Push(1);
+    RunAll();
+    EXPECT_EQ("13", order);
+}
+
+TEST_F(UidSchedulerTest, testStats) {
+    Push(1);
+    Push(1);
+    Push(2);
+    RunAll();
+
+    std::map<uid_t, UidScheduler::UidStats> stats = scheduler.GetStats();
+    ASSERT_EQ(2, stats.size());
+    EXPECT_EQ(2, stats[1].count);
+    EXPECT_EQ(1, stats[2].count);
+    EXPECT_LE(stats[1].max_wait, stats[1].total_wait);
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "WorkerPool"
+
+#include "include/libfuse_jni/WorkerPool.h"
+
+#include <android-base/logging.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <thread>
+
+namespace mediaprovider {
+namespace fuse {
+
+WorkerPool::WorkerPool(const std::string& name, const Options& options)
+    : name_(name), options_(options), threads_(0), idle_threads_(0), shutdown_(false) {
+    CHECK(options_.min_threads <= options_.max_threads);
+    CHECK(options_.max_threads > 0);
+
+    std::lock_guard<std::mutex> guard(lock_);
+    for (size_t i = 0; i < options_.min_threads; i++) {
+        StartThreadLocked();
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    Shutdown();
+}
+
+void WorkerPool::Post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        CHECK(!shutdown_);
+
+        queue_.push(std::move(task));
+        if (idle_threads_ == 0 && queue_.size() > options_.grow_queue_depth &&
+            threads_ < options_.max_threads) {
+            StartThreadLocked();
+        }
+    }
+    work_cv_.notify_one();
+}
+
+void WorkerPool::Shutdown() {
+    std::unique_lock<std::mutex> lock(lock_);
+    shutdown_ = true;
+    work_cv_.notify_all();
+    exit_cv_.wait(lock, [this] { return threads_ == 0; });
+}
+
+size_t WorkerPool::GetThreadCount() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return threads_;
+}
+
+size_t WorkerPool::GetQueueDepth() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return queue_.size();
+}
+
+void WorkerPool::StartThreadLocked() {
+    threads_++;
+    std::thread(&WorkerPool::ThreadLoop, this).detach();
+}
+
+void WorkerPool::ThreadLoop() {
+    // Thread names are limited to 16 bytes, including the terminating null byte.
+    pthread_setname_np(pthread_self(), name_.substr(0, 15).c_str());
+
+    if (!options_.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : options_.cpus) {
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            PLOG(WARNING) << "Failed to set CPU affinity for " << name_;
+        }
+    }
+
+    if (options_.on_thread_start) {
+        options_.on_thread_start();
+    }
+
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+        if (queue_.empty()) {
+            if (shutdown_) {
+                break;
+            }
+
+            idle_threads_++;
+            bool timed_out = !work_cv_.wait_for(lock, options_.idle_timeout,
+                                                [this] { return !queue_.empty() || shutdown_; });
+            idle_threads_--;
+
+            if (timed_out && threads_ > options_.min_threads) {
+                break;
+            }
+            continue;
+        }
+
+        std::function<void()> task = std::move(queue_.front());
+        queue_.pop();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+
+    threads_--;
+    // Notify with |lock_| held, Shutdown() can only return and let the pool be destroyed once
+    // we released it, after which this thread no longer touches any member.
+    exit_cv_.notify_all();
+}
+
+}  // namespace fuse
+}  // namespace mediaprovider
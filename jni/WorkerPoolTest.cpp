@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "WorkerPoolTest"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "libfuse_jni/WorkerPool.h"
+
+using namespace mediaprovider::fuse;
+using namespace std::chrono_literals;
+
+static WorkerPool::Options MakeOptions(size_t min_threads, size_t max_threads) {
+    WorkerPool::Options options;
+    options.min_threads = min_threads;
+    options.max_threads = max_threads;
+    options.idle_timeout = 100ms;
+    return options;
+}
+
+// Blocks every task that calls Wait() until Release() is called.
+class Gate {
+  public:
+    void Wait() {
+        std::unique_lock<std::mutex> lock(lock_);
+        waiting_++;
+        cv_.notify_all();
+        cv_.wait(lock, [this] { return open_; });
+    }
+
+    void Release() {
+        std::lock_guard<std::mutex> guard(lock_);
+        open_ = true;
+        cv_.notify_all();
+    }
+
+    void WaitForWaiters(int count) {
+        std::unique_lock<std::mutex> lock(lock_);
+        cv_.wait(lock, [this, count] { return waiting_ >= count; });
+    }
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    int waiting_ = 0;
+    bool open_ = false;
+};
+
+TEST(WorkerPoolTest, testRunsAllTasks) {
+    std::atomic_int count(0);
+    {
+        WorkerPool pool("test", MakeOptions(2, 4));
+        for (int i = 0; i < 100; i++) {
+            pool.Post([&count] { count++; });
+        }
+    }
+    EXPECT_EQ(100, count);
+}
+
+TEST(WorkerPoolTest, testStartsMinThreads) {
+    WorkerPool pool("test", MakeOptions(3, 5));
+    EXPECT_EQ(3, pool.GetThreadCount());
+}
+
+TEST(WorkerPoolTest, testGrowsUpToMaxThreads) {
+    Gate gate;
+    WorkerPool pool("test", MakeOptions(1, 3));
+
+    for (int i = 0; i < 5; i++) {
+        pool.Post([&gate] { gate.Wait(); });
+    }
+    gate.WaitForWaiters(3);
+
+    EXPECT_EQ(3, pool.GetThreadCount());
+    EXPECT_EQ(2, pool.GetQueueDepth());
+    gate.Release();
+}
+
+TEST(WorkerPoolTest, testGrowQueueDepth) {
+    WorkerPool::Options options = MakeOptions(1, 4);
+    options.grow_queue_depth = 2;
+    Gate gate;
+    WorkerPool pool("test", options);
+
+    pool.Post([&gate] { gate.Wait(); });
+    gate.WaitForWaiters(1);
+
+    // Two queued tasks are tolerated, the third one starts a new thread
+    pool.Post([&gate] { gate.Wait(); });
+    pool.Post([&gate] { gate.Wait(); });
+    EXPECT_EQ(1, pool.GetThreadCount());
+    pool.Post([&gate] { gate.Wait(); });
+    EXPECT_EQ(2, pool.GetThreadCount());
+
+    gate.Release();
+}
+
+TEST(WorkerPoolTest, testIdleThreadsExit) {
+    Gate gate;
+    WorkerPool pool("test", MakeOptions(1, 3));
+
+    for (int i = 0; i < 3; i++) {
+        pool.Post([&gate] { gate.Wait(); });
+    }
+    gate.WaitForWaiters(3);
+    EXPECT_EQ(3, pool.GetThreadCount());
+    gate.Release();
+
+    for (int i = 0; i < 50 && pool.GetThreadCount() > 1; i++) {
+        std::this_thread::sleep_for(20ms);
+    }
+    EXPECT_EQ(1, pool.GetThreadCount());
+}
+
+TEST(WorkerPoolTest, testOnThreadStart) {
+    std::atomic_int started(0);
+    WorkerPool::Options options = MakeOptions(2, 2);
+    options.on_thread_start = [&started] { started++; };
+    {
+        WorkerPool pool("test", options);
+        pool.Post([] {});
+    }
+    EXPECT_EQ(2, started);
+}
+
+TEST(WorkerPoolTest, testShutdownRunsQueuedTasks) {
+    std::atomic_int count(0);
+    Gate gate;
+    WorkerPool pool("test", MakeOptions(1, 1));
+
+    pool.Post([&gate] { gate.Wait(); });
+    gate.WaitForWaiters(1);
+    for (int i = 0; i < 10; i++) {
+        pool.Post([&count] { count++; });
+    }
+    gate.Release();
+    pool.Shutdown();
+
+    EXPECT_EQ(10, count);
+    EXPECT_EQ(0, pool.GetThreadCount());
+}
@@ -17,14 +17,18 @@
 // Need to use LOGE_EX.
 #define LOG_TAG "FuseDaemonJNI"
 
+#include <fcntl.h>
+#include <nativehelper/scoped_local_ref.h>
 #include <nativehelper/scoped_utf_chars.h>
 
 #include <string>
+#include <vector>
 
 #include "FuseDaemon.h"
 #include "MediaProviderWrapper.h"
 #include "android-base/logging.h"
 #include "android-base/unique_fd.h"
+#include "libfuse_jni/RedactionParser.h"
 
 namespace mediaprovider {
 namespace {
@@ -101,10 +105,50 @@ void com_android_providers_media_FuseDaemon_invalidate_fuse_dentry_cache(JNIEnv*
     // TODO(b/145741152): Throw exception
 }
 
+void com_android_providers_media_FuseDaemon_set_uid_foreground(JNIEnv* env, jobject self,
+                                                               jlong java_daemon, jint uid,
+                                                               jboolean foreground) {
+    fuse::FuseDaemon* const daemon = reinterpret_cast<fuse::FuseDaemon*>(java_daemon);
+    if (daemon) {
+        daemon->SetUidForeground(uid, foreground);
+    }
+}
+
+jstring com_android_providers_media_FuseDaemon_dump(JNIEnv* env, jobject self,
+                                                    jlong java_daemon) {
+    fuse::FuseDaemon* const daemon = reinterpret_cast<fuse::FuseDaemon*>(java_daemon);
+    if (daemon) {
+        return env->NewStringUTF(daemon->Dump().c_str());
+    }
+    return nullptr;
+}
+
 bool com_android_providers_media_FuseDaemon_is_fuse_thread(JNIEnv* env, jclass clazz) {
     return pthread_getspecific(fuse::MediaProviderWrapper::gJniEnvKey) != nullptr;
 }
 
+jlongArray com_android_providers_media_FuseDaemon_get_redaction_ranges(JNIEnv* env, jclass clazz,
+                                                                     jstring java_path) {
+    ScopedUtfChars utf_chars_path(env, java_path);
+    if (!utf_chars_path.c_str()) {
+        return nullptr;
+    }
+
+    android::base::unique_fd fd(open(utf_chars_path.c_str(), O_RDONLY | O_CLOEXEC));
+    std::vector<off64_t> ranges;
+    if (fd < 0 || !fuse::ParseRedactionRanges(fd, utf_chars_path.c_str(), &ranges)) {
+        return nullptr;
+    }
+
+    ScopedLocalRef<jlongArray> res(env, env->NewLongArray(ranges.size()));
+    if (!res.get()) {
+        return nullptr;
+    }
+    std::vector<jlong> values(ranges.begin(), ranges.end());
+    env->SetLongArrayRegion(res.get(), 0, values.size(), values.data());
+    return res.release();
+}
+
 const JNINativeMethod methods[] = {
         {"native_new", "(Lcom/android/providers/media/MediaProvider;)J",
          reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_new)},
@@ -120,7 +164,13 @@ const JNINativeMethod methods[] = {
          reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_is_started)},
         {"native_invalidate_fuse_dentry_cache", "(JLjava/lang/String;)V",
          reinterpret_cast<void*>(
-                 com_android_providers_media_FuseDaemon_invalidate_fuse_dentry_cache)}};
+                 com_android_providers_media_FuseDaemon_invalidate_fuse_dentry_cache)},
+        {"native_set_uid_foreground", "(JIZ)V",
+         reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_set_uid_foreground)},
+        {"native_dump", "(J)Ljava/lang/String;",
+         reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_dump)},
+        {"native_get_redaction_ranges", "(Ljava/lang/String;)[J",
+         reinterpret_cast<void*>(com_android_providers_media_FuseDaemon_get_redaction_ranges)}};
 }  // namespace
 
 void register_android_providers_media_FuseDaemon(JavaVM* vm, JNIEnv* env) {
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DirWalkerJNI"
+
+#include <errno.h>
+#include <nativehelper/scoped_utf_chars.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "android-base/logging.h"
+#include "jni.h"
+#include "libfuse_jni/DirWalker.h"
+
+namespace mediaprovider {
+namespace {
+
+constexpr const char* CLASS_NAME = "com/android/providers/media/scan/DirWalker";
+
+struct JavaDirWalker {
+    JavaDirWalker(size_t threads, size_t max_buffered_bytes, const std::string& skip_pattern)
+        : walker(threads, max_buffered_bytes, skip_pattern) {}
+
+    fuse::DirWalker walker;
+    // The last listing, backing the buffer returned by native_list.
+    std::vector<uint8_t> listing;
+};
+
+jlong com_android_providers_media_scan_DirWalker_new(JNIEnv* env, jclass clazz, jint threads,
+                                                      jint max_buffered_bytes,
+                                                      jstring java_skip_pattern) {
+    ScopedUtfChars utf_chars_skip_pattern(env, java_skip_pattern);
+    if (!utf_chars_skip_pattern.c_str()) {
+        return 0;
+    }
+    return reinterpret_cast<jlong>(
+            new JavaDirWalker(threads, max_buffered_bytes, utf_chars_skip_pattern.c_str()));
+}
+
+void com_android_providers_media_scan_DirWalker_delete(JNIEnv* env, jclass clazz,
+                                                       jlong java_walker) {
+    delete reinterpret_cast<JavaDirWalker*>(java_walker);
+}
+
+jobject com_android_providers_media_scan_DirWalker_list(JNIEnv* env, jclass clazz,
+                                                        jlong java_walker, jstring java_path) {
+    JavaDirWalker* const walker = reinterpret_cast<JavaDirWalker*>(java_walker);
+    ScopedUtfChars utf_chars_path(env, java_path);
+    if (!utf_chars_path.c_str()) {
+        return nullptr;
+    }
+
+    if (!walker->walker.List(utf_chars_path.c_str(), &walker->listing)) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), strerror(errno));
+        return nullptr;
+    }
+    // The buffer needs an address even when there are no entries
+    static uint8_t empty;
+    uint8_t* const data = walker->listing.empty() ? &empty : walker->listing.data();
+    return env->NewDirectByteBuffer(data, walker->listing.size());
+}
+
+void com_android_providers_media_scan_DirWalker_prune(JNIEnv* env, jclass clazz,
+                                                      jlong java_walker, jstring java_path) {
+    JavaDirWalker* const walker = reinterpret_cast<JavaDirWalker*>(java_walker);
+    ScopedUtfChars utf_chars_path(env, java_path);
+    if (!utf_chars_path.c_str()) {
+        return;
+    }
+    walker->walker.Prune(utf_chars_path.c_str());
+}
+
+const JNINativeMethod methods[] = {
+        {"native_new", "(IILjava/lang/String;)J",
+         reinterpret_cast<void*>(com_android_providers_media_scan_DirWalker_new)},
+        {"native_delete", "(J)V",
+         reinterpret_cast<void*>(com_android_providers_media_scan_DirWalker_delete)},
+        {"native_list", "(JLjava/lang/String;)Ljava/nio/ByteBuffer;",
+         reinterpret_cast<void*>(com_android_providers_media_scan_DirWalker_list)},
+        {"native_prune", "(JLjava/lang/String;)V",
+         reinterpret_cast<void*>(com_android_providers_media_scan_DirWalker_prune)}};
+}  // namespace
+
+void register_android_providers_media_scan_DirWalker(JNIEnv* env) {
+    jclass clazz = env->FindClass(CLASS_NAME);
+    if (clazz == nullptr) {
+        LOG(FATAL) << "Unable to find class : " << CLASS_NAME;
+    }
+
+    if (env->RegisterNatives(clazz, methods, sizeof(methods) / sizeof(methods[0])) < 0) {
+        LOG(FATAL) << "Unable to register native methods";
+    }
+}
+}  // namespace mediaprovider
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_DIRFDCACHE_H_
+#define MEDIAPROVIDER_JNI_DIRFDCACHE_H_
+
+#include <unistd.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * An O_PATH fd to a directory on the lower filesystem, to resolve the names of its entries
+ * with the *at() syscalls.
+ */
+struct DirFd {
+    explicit DirFd(int fd) : fd(fd) {}
+    ~DirFd() { close(fd); }
+
+    const int fd;
+
+  private:
+    DirFd(const DirFd&) = delete;
+    void operator=(const DirFd&) = delete;
+};
+
+/**
+ * LRU cache of the DirFds of the most recently used directories, by key. The least recently used
+ * ones are closed once there are more than a maximum, or when the process runs out of fds.
+ *
+ * A DirFd follows its directory when it's renamed, or is left pointing to a removed directory, so
+ * the entry of a directory changed behind the back of the caller must be removed.
+ */
+class DirFdCache {
+  public:
+    struct Stats {
+        // DirFds currently cached.
+        size_t open = 0;
+        // Requests served by a cached DirFd, or that had to open one.
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // DirFds closed to stay under the maximum or because fds ran out.
+        uint64_t evictions = 0;
+    };
+
+    /**
+     * @param max_fds maximum number of DirFds cached, 0 to never cache any
+     */
+    explicit DirFdCache(size_t max_fds);
+
+    /**
+     * Returns the DirFd of the directory |key| at |path|, opening it if it isn't cached.
+     *
+     * @return the DirFd, or nullptr with errno set if it couldn't be opened or caching is disabled
+     */
+    std::shared_ptr<DirFd> Get(uint64_t key, const std::string& path);
+
+    /**
+     * Removes the DirFd of the directory |key|, if cached. It's closed once no longer used.
+     */
+    void Remove(uint64_t key);
+
+    /**
+     * Removes all DirFds.
+     */
+    void Clear();
+
+    bool IsEnabled() const { return max_fds_ > 0; }
+
+    Stats GetStats() const;
+
+  private:
+    DirFdCache(const DirFdCache&) = delete;
+    void operator=(const DirFdCache&) = delete;
+
+    struct Entry {
+        std::shared_ptr<DirFd> dir;
+        // Position of the key in |lru_|.
+        std::list<uint64_t>::iterator lru_pos;
+    };
+
+    // Removes the least recently used entries until at most |size| are left. Must be called with
+    // |lock_| held.
+    void EvictLocked(size_t size);
+
+    const size_t max_fds_;
+
+    mutable std::mutex lock_;
+    // Guarded by |lock_|. The cached DirFds by key, and their keys from the most recently used
+    // to the least.
+    std::unordered_map<uint64_t, Entry> entries_;
+    std::list<uint64_t> lru_;
+
+    std::atomic_uint64_t hits_;
+    std::atomic_uint64_t misses_;
+    std::atomic_uint64_t evictions_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_DIRFDCACHE_H_
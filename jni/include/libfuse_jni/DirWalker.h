@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_DIRWALKER_H_
+#define MEDIAPROVIDER_JNI_DIRWALKER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Lists the directories of a tree for a walk in any order, e.g. depth first like the media
+ * scanner's, by listing the directories below those listed so far ahead of it on a pool of
+ * threads. Each thread lists the directories it found depth first and steals the oldest ones
+ * found by others when it runs out, until the listings not yet taken reach a maximum size.
+ *
+ * A listing holds a record per entry other than . and .., in native byte order:
+ *   int64_t size, int64_t mtime in ms, uint16_t name length, uint8_t type (a DT_* value),
+ *   uint8_t unused, followed by the name, not null terminated
+ * Entries that vanish while their directory is listed are left out.
+ */
+class DirWalker {
+  public:
+    static constexpr size_t kRecordHeaderSize = 20;
+
+    struct Stats {
+        // Directories listed, and how many of those were listed ahead of the walk.
+        uint64_t listed = 0;
+        uint64_t prefetched = 0;
+        // Entries listed.
+        uint64_t entries = 0;
+    };
+
+    /**
+     * @param threads number of threads listing ahead of the walk, 0 to only list on demand
+     * @param max_buffered_bytes size of the listings not yet taken above which no more
+     * directories are listed ahead
+     * @param skip_pattern regex of the paths of directories the walk always skips, matched
+     * ignoring case, which are never listed ahead; empty if there are none
+     */
+    DirWalker(size_t threads, size_t max_buffered_bytes, const std::string& skip_pattern = "");
+
+    /**
+     * Stops listing ahead, no thread is left once this returns.
+     */
+    ~DirWalker();
+
+    /**
+     * Takes the listing of |dir|, listing it now unless it was already, and lists its
+     * subdirectories ahead. Each directory should be listed once.
+     *
+     * @return true with the listing in |listing|, or false with errno set if it couldn't be listed
+     */
+    bool List(const std::string& dir, std::vector<uint8_t>* listing);
+
+    /**
+     * Stops listing ahead below |dir|, which the walk skips, and drops what was listed there.
+     */
+    void Prune(const std::string& dir);
+
+    Stats GetStats() const;
+
+  private:
+    DirWalker(const DirWalker&) = delete;
+    void operator=(const DirWalker&) = delete;
+
+    enum class State { kQueued, kListing, kListed };
+
+    struct Listing {
+        State state;
+        // Set once kListed.
+        std::vector<uint8_t> data;
+        int error;
+    };
+
+    // Lists |dir| into |data| and the paths of its subdirectories to list ahead into |subdirs|,
+    // returns 0 or an errno.
+    int ListDir(const std::string& dir, std::vector<uint8_t>* data,
+                std::vector<std::string>* subdirs);
+    // Queues the subdirectories of a listed directory to be listed ahead by |worker|. Must be
+    // called with |lock_| held.
+    void QueueLocked(size_t worker, std::vector<std::string>* subdirs);
+    // Returns the next directory to list ahead for |worker|, or false to stop. Must be called
+    // with |lock| held.
+    bool NextLocked(size_t worker, std::unique_lock<std::mutex>* lock, std::string* dir);
+    void Loop(size_t worker);
+
+    const size_t max_buffered_bytes_;
+    // Matches no path if empty.
+    const std::regex skip_pattern_;
+
+    mutable std::mutex lock_;
+    // Signaled when there are directories to list ahead, or room for their listings.
+    std::condition_variable work_cv_;
+    // Signaled when directories were listed ahead.
+    std::condition_variable listed_cv_;
+    // Guarded by |lock_|. Directories queued, being listed or listed, but not taken yet by path.
+    std::unordered_map<std::string, Listing> listings_;
+    // Guarded by |lock_|. Directories to list ahead by worker. Workers take their own from the
+    // back and steal from the front of others.
+    std::vector<std::deque<std::string>> queues_;
+    // Guarded by |lock_|. Size of the listings in |listings_|.
+    size_t buffered_bytes_;
+    // Guarded by |lock_|. Worker that queues the subdirectories of those listed on demand.
+    size_t next_queue_;
+    bool stopping_;
+
+    std::atomic_uint64_t listed_;
+    std::atomic_uint64_t prefetched_;
+    std::atomic_uint64_t entries_;
+
+    std::vector<std::thread> threads_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_DIRWALKER_H_
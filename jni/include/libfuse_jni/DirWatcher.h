@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_DIRWATCHER_H_
+#define MEDIAPROVIDER_JNI_DIRWATCHER_H_
+
+#include <sys/inotify.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Reports changes to the entries of directories on the lower filesystem, including those made
+ * behind the back of the FUSE daemon, e.g. by installd, and writes to files, including those made
+ * through lower filesystem fds handed out to apps. Directories and files are watched with inotify,
+ * one watch each, up to a maximum, until they are removed, renamed or unwatched. Changes are
+ * reported on a thread of the watcher.
+ */
+class DirWatcher {
+  public:
+    struct Stats {
+        // Directories and files watched.
+        size_t watches = 0;
+        // Changes reported.
+        uint64_t changes = 0;
+        // Times the kernel dropped events because they weren't read quickly enough.
+        uint64_t overflows = 0;
+    };
+
+    /**
+     * Called when the entry |name| of the watched directory |dir| changed. |replaced| is set when
+     * the name may no longer refer to the same file, otherwise only the file's attributes changed.
+     */
+    typedef std::function<void(const std::string& dir, const std::string& name, bool replaced)>
+            Callback;
+
+    /**
+     * Called when the watched file |path| was written to, or with |closed| set when a writer
+     * closed it. Also called once when the file is renamed, since writes to it are no longer
+     * reported then.
+     */
+    typedef std::function<void(const std::string& path, bool closed)> FileCallback;
+
+    DirWatcher(size_t max_watches, Callback callback, FileCallback file_callback = nullptr);
+
+    /**
+     * Stops the watcher thread, no callbacks run once this returns.
+     */
+    ~DirWatcher();
+
+    /**
+     * Returns false if the watcher couldn't be set up, in which case nothing can be watched.
+     */
+    bool IsStarted() const;
+
+    /**
+     * Starts watching |dir| if it isn't already.
+     *
+     * @return true if changes to the entries of |dir| will be reported, false if it couldn't be
+     * watched, e.g. because the maximum number of watches is reached
+     */
+    bool Watch(const std::string& dir);
+
+    /**
+     * Starts watching writes to the file |path| if it isn't already. Stores through shared
+     * mappings of the file aren't reported, nor are writes once it was renamed.
+     *
+     * @return true if writes to |path| will be reported
+     */
+    bool WatchFile(const std::string& path);
+
+    bool IsWatched(const std::string& path) const;
+
+    /**
+     * Stops watching the directory or file |path|.
+     */
+    void Unwatch(const std::string& path);
+
+    Stats GetStats() const;
+
+  private:
+    DirWatcher(const DirWatcher&) = delete;
+    void operator=(const DirWatcher&) = delete;
+
+    static constexpr uint32_t kMask = IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM |
+                                      IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+    static constexpr uint32_t kFileMask = IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE_SELF |
+                                          IN_DONT_FOLLOW;
+
+    struct Watched {
+        std::string path;
+        bool file;
+    };
+
+    bool AddWatch(const std::string& path, bool file);
+    void Loop();
+    void HandleEvent(const struct inotify_event* event);
+    // Forgets the watch |wd|. Must be called with |lock_| held.
+    void ForgetLocked(int wd);
+
+    const size_t max_watches_;
+    const Callback callback_;
+    const FileCallback file_callback_;
+    int inotify_fd_;
+    // Wakes up the watcher thread to stop it.
+    int stop_fd_;
+
+    mutable std::mutex lock_;
+    // Guarded by |lock_|. What's watched by watch descriptor, and the other way round. A
+    // directory or file may be watched under several names when the lower filesystem is case
+    // insensitive, in which case changes are reported under the first one.
+    std::unordered_map<int, Watched> watched_;
+    std::unordered_map<std::string, int> watches_;
+
+    std::atomic_uint64_t changes_;
+    std::atomic_uint64_t overflows_;
+
+    std::thread thread_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_DIRWATCHER_H_
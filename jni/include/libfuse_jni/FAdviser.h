@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_FADVISER_H_
+#define MEDIAPROVIDER_JNI_FADVISER_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/*
+ * In order to avoid double caching with fuse, call fadvise on the file handles
+ * in the underlying file system. However, if this is done on every read/write,
+ * the fadvises cause a very significant slowdown in tests (specifically fio
+ * seq_write). So call fadvise on the file handles picked by the policy only
+ * after a threshold is passed, and behind sequential streams.
+ *
+ * Record() is called on every read and write, so it never takes a lock: records are pushed to a
+ * ring buffer owned by the calling thread, which the advisor thread drains in batches, early when
+ * a ring fills up. Nothing is held back by the thread itself, so the records of a thread that
+ * goes idle are accounted all the same. Records are dropped if a ring is full.
+ */
+class FAdviser {
+  public:
+    // How the files to drop from the page cache are picked once the threshold is exceeded.
+    enum class Policy {
+        // Largest files first.
+        kSize,
+        // Least recently read or written files first.
+        kLru,
+        // Least recently used files first, or largest files first under memory pressure, to get
+        // back under the target with as few fadvises as possible.
+        kAdaptive,
+    };
+
+    // Why bytes were dropped from the page cache.
+    enum Reason {
+        kReasonSize,
+        kReasonLru,
+        kReasonDropBehind,
+        kReasonCount,
+    };
+
+    struct Options {
+        Policy policy = Policy::kAdaptive;
+        // Bytes tracked before files get dropped, and bytes left tracked afterwards. If 0, both
+        // are derived from the memory available, and lowered under memory pressure.
+        size_t threshold = 0;
+        size_t target = 0;
+        // Whether the pages behind a sequential stream are dropped as the stream moves on.
+        bool drop_behind = true;
+        // Where memory pressure and the memory available are read from.
+        std::string psi_path = "/proc/pressure/memory";
+        std::string meminfo_path = "/proc/meminfo";
+    };
+
+    struct Stats {
+        // Bytes read or written through fds currently tracked.
+        uint64_t tracked_bytes = 0;
+        // Thresholds currently in use.
+        uint64_t threshold = 0;
+        uint64_t target = 0;
+        bool memory_pressure = false;
+        // Bytes dropped from the page cache with POSIX_FADV_DONTNEED, per reason.
+        uint64_t dropped_bytes[kReasonCount] = {};
+        // Records lost because the ring of their thread was full.
+        uint64_t lost_records = 0;
+    };
+
+    FAdviser();
+    explicit FAdviser(const Options& options);
+
+    /** Stops the advisor thread. Record() and Close() must not be called anymore. */
+    ~FAdviser();
+
+    void Record(int fd, off_t offset, size_t size);
+
+    void Close(int fd);
+
+    Stats GetStats() const;
+
+    static const char* ReasonToString(Reason reason);
+
+  private:
+    FAdviser(const FAdviser&) = delete;
+    void operator=(const FAdviser&) = delete;
+
+    struct Message {
+        int fd;
+        // Range of the file read or written.
+        off_t start;
+        off_t end;
+        size_t size;
+    };
+
+    // Single producer, single consumer ring of records. Only the thread it's assigned to pushes
+    // and only the advisor thread pops.
+    class Ring {
+      public:
+        // Returns false if the ring is full. Sets |half_full| if the ring is at least half full
+        // once pushed.
+        bool Push(const Message& message, bool* half_full);
+
+        // Pops every record pushed so far into |out|.
+        void Drain(std::vector<Message>* out);
+
+        // Set once the thread owning the ring exited, so that another thread can take it over.
+        std::atomic_bool orphaned{false};
+        // Written by the producer only.
+        std::atomic_uint64_t lost{0};
+
+      private:
+        static constexpr size_t kCapacity = 256;
+
+        // Producer and consumer indices on separate cache lines, so that a push doesn't
+        // invalidate the line the advisor thread reads from, and the other way around.
+        alignas(64) std::atomic_size_t head_{0};
+        alignas(64) std::atomic_size_t tail_{0};
+        alignas(64) Message messages_[kCapacity];
+    };
+
+    // Per-thread state of the thread calling Record(). It shares the ownership of its ring with
+    // the FAdviser, so that a thread may exit after the FAdviser it recorded to is gone.
+    struct ThreadState {
+        ~ThreadState();
+        void Release();
+
+        // Id of the FAdviser |ring| belongs to. Ids aren't reused, unlike addresses.
+        uint64_t adviser_id = 0;
+        std::shared_ptr<Ring> ring;
+    };
+
+    static ThreadState& GetThreadState(FAdviser* adviser);
+    std::shared_ptr<Ring> AcquireRing();
+
+    struct File {
+        // Bytes recorded and not dropped yet.
+        size_t size = 0;
+        // Drain during which the file was last recorded.
+        uint64_t last_used = 0;
+        // End of the last range recorded, where a sequential stream is expected to continue.
+        off_t next_offset = -1;
+        // Number of records in a row that continued the stream.
+        int sequential_run = 0;
+        // Offset up to which the stream was already dropped.
+        off_t dropped_until = 0;
+    };
+
+    void RecordImpl(const Message& message);
+    void CloseImpl(int fd);
+    void DropBehind(int fd, File* file);
+    void Evict();
+    void Drop(std::map<int, File>::iterator file, Reason reason);
+    void UpdateMemoryState();
+    void MessageLoop();
+
+    const uint64_t id_;
+    const Options options_;
+
+    mutable std::mutex lock_;
+    std::condition_variable cv_;
+    // Every ring ever handed to a thread. Guarded by |lock_|.
+    std::vector<std::shared_ptr<Ring>> rings_;
+    // Fds closed since the last drain. Guarded by |lock_|.
+    std::vector<int> closes_;
+    // Guarded by |lock_|.
+    bool quit_;
+    // Set by threads whose ring is filling up, to have the rings drained before the next interval.
+    std::atomic_bool drain_requested_;
+    // Snapshot of the statistics, updated by the advisor thread. Guarded by |lock_|.
+    Stats stats_;
+
+    // Only accessed from the advisor thread.
+    std::map<int, File> files_;
+    size_t total_size_;
+    size_t threshold_;
+    size_t target_;
+    bool memory_pressure_;
+    uint64_t drain_count_;
+    uint64_t dropped_bytes_[kReasonCount];
+
+    std::thread thread_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_FADVISER_H_
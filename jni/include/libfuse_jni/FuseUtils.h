@@ -17,6 +17,8 @@
 #ifndef MEDIAPROVIDER_JNI_UTILS_H_
 #define MEDIAPROVIDER_JNI_UTILS_H_
 
+#include <sys/types.h>
+
 #include <string>
 
 namespace mediaprovider {
@@ -31,6 +33,16 @@ namespace fuse {
  */
 bool containsMount(const std::string& path, const std::string& userid);
 
+/**
+ * Copies up to |len| bytes from |fd_in| at |off_in| to |fd_out| at |off_out| with
+ * copy_file_range(2), which may share the extents on filesystems that support it. Falls back to
+ * copying through a buffer, at most a few MiB per call, if the kernel or filesystem can't copy
+ * between the two files.
+ *
+ * @return the number of bytes copied, 0 at the end of |fd_in|, or -errno on failure
+ */
+ssize_t copyFileRange(int fd_in, off64_t off_in, int fd_out, off64_t off_out, size_t len);
+
 }  // namespace fuse
 }  // namespace mediaprovider
 
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_LOWERFILETABLE_H_
+#define MEDIAPROVIDER_JNI_LOWERFILETABLE_H_
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * A file open on the lower filesystem. It may be shared by several handles, so it must only be
+ * accessed at explicit offsets (pread/pwrite, splice with an offset), never through the file
+ * position.
+ */
+struct LowerFile {
+    explicit LowerFile(int fd, dev_t dev = 0, ino_t ino = 0) : fd(fd), dev(dev), ino(ino) {}
+    ~LowerFile() { close(fd); }
+
+    const int fd;
+    // Identity of the file, or zeroes if it isn't a regular file.
+    const dev_t dev;
+    const ino_t ino;
+
+  private:
+    LowerFile(const LowerFile&) = delete;
+    void operator=(const LowerFile&) = delete;
+};
+
+/**
+ * Refcounted table of the files open on the lower filesystem, so that handles of the same regular
+ * file opened with the same flags share a single fd instead of opening their own.
+ *
+ * Files are keyed by device, inode and the open flags that affect I/O. Other files, such as
+ * FIFOs, are never shared. The table must outlive the files it returned.
+ */
+class LowerFileTable {
+  public:
+    struct Stats {
+        // Files requested from the table.
+        uint64_t opens = 0;
+        // Opens served by a file already open.
+        uint64_t shared = 0;
+        // Files currently in the table.
+        uint64_t open_files = 0;
+    };
+
+    /**
+     * @param on_close called with the fd of a file right before it's closed
+     */
+    explicit LowerFileTable(std::function<void(int fd)> on_close = nullptr);
+
+    /**
+     * Returns the file at |path| opened with |flags|, shared with other handles if it's open
+     * already. A relative |path| is resolved relative to the directory |dirfd|, like openat.
+     *
+     * @return the file, or nullptr with errno set if it couldn't be opened
+     */
+    std::shared_ptr<LowerFile> Open(const std::string& path, int flags, int dirfd = AT_FDCWD);
+
+    /**
+     * Takes ownership of |fd|, opened with |flags|, and returns its file. If the same file is
+     * open already with the same flags, |fd| is closed and the open file returned instead.
+     */
+    std::shared_ptr<LowerFile> Adopt(int fd, int flags);
+
+    Stats GetStats() const;
+
+  private:
+    LowerFileTable(const LowerFileTable&) = delete;
+    void operator=(const LowerFileTable&) = delete;
+
+    typedef std::tuple<dev_t, ino_t, int> Key;
+
+    std::shared_ptr<LowerFile> Lookup(const Key& key);
+    std::shared_ptr<LowerFile> Insert(int fd, const Key& key, bool shared);
+
+    const std::function<void(int fd)> on_close_;
+
+    mutable std::mutex lock_;
+    // Guarded by |lock_|. Entries are removed when their file is closed.
+    std::map<Key, std::weak_ptr<LowerFile>> files_;
+
+    std::atomic_uint64_t opens_;
+    std::atomic_uint64_t shared_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_LOWERFILETABLE_H_
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_READAHEADTRACKER_H_
+#define MEDIAPROVIDER_JNI_READAHEADTRACKER_H_
+
+#include <sys/types.h>
+
+#include <mutex>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Tracks the reads of a file handle to detect sequential streams, and computes what to read ahead
+ * of them on the lower filesystem.
+ *
+ * The kernel doesn't read ahead for direct_io handles, so a reader of such a handle waits for the
+ * lower filesystem on every read. Once reads are sequential, the window read ahead starts small
+ * and doubles every time the reader consumes half of it, up to a maximum. A read that breaks the
+ * stream resets the window.
+ */
+class ReadaheadTracker {
+  public:
+    struct Range {
+        off_t offset;
+        size_t length;
+    };
+
+    /**
+     * Records a read of |size| bytes at |offset|.
+     *
+     * @return the range to read ahead of the stream, with a length of 0 if there's none
+     */
+    Range OnRead(off_t offset, size_t size);
+
+    static constexpr size_t kInitialWindow = 256 * 1024;
+    static constexpr size_t kMaxWindow = 4 * 1024 * 1024;
+
+  private:
+    std::mutex lock_;
+    // Where the next read of a sequential stream is expected to start.
+    off_t next_offset_ = 0;
+    // End of the range read ahead so far.
+    off_t readahead_end_ = 0;
+    // Size of the next window to read ahead, or 0 if the reads aren't sequential.
+    size_t window_ = 0;
+    // Number of reads in a row in the stream.
+    int sequential_reads_ = 0;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_READAHEADTRACKER_H_
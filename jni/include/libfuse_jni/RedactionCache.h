@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_REDACTIONCACHE_H_
+#define MEDIAPROVIDER_JNI_REDACTIONCACHE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Cache of the redaction ranges of files, keyed by device, inode, mtime and size. The ranges of a
+ * file only depend on its content, so they're shared by every handle and uid.
+ *
+ * Entries live in a fixed size table, either in memory or mapped from a sidecar file so that they
+ * survive restarts of the daemon. Each entry is checksummed, entries torn by a crash are simply
+ * ignored. Since mtime has a coarse granularity, writes must invalidate the entries of the files
+ * they modify explicitly.
+ *
+ * A miss reserves an entry for the file, which Insert() then fills. An invalidation in between
+ * drops the reservation, so that ranges computed from the content before a write are never
+ * inserted after it.
+ */
+class RedactionCache {
+  public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t invalidations = 0;
+        // Whether the entries are persisted to a sidecar file.
+        bool persistent = false;
+    };
+
+    // Ranges of files with more ranges than this aren't cached.
+    static constexpr size_t kMaxRanges = 32;
+    static constexpr size_t kDefaultEntries = 1024;
+
+    /**
+     * @param path sidecar file the entries are persisted to, or empty to keep them in memory.
+     * The entries are kept in memory if the file can't be mapped.
+     * @param num_entries number of files cached, rounded up to a multiple of the associativity
+     */
+    explicit RedactionCache(const std::string& path = "", size_t num_entries = kDefaultEntries);
+    ~RedactionCache();
+
+    /**
+     * Looks up the ranges of the file |st| was returned for, as consecutive start and end offsets.
+     *
+     * @return true on a hit, false on a miss, after which Insert() is expected for the same file
+     */
+    bool Lookup(const struct stat& st, std::vector<off64_t>* ranges);
+
+    /** Caches the ranges computed after a miss, unless the file was invalidated since. */
+    void Insert(const struct stat& st, const std::vector<off64_t>& ranges);
+
+    /** Drops the ranges of the file with inode |ino| on device |dev|. */
+    void Invalidate(dev_t dev, ino_t ino);
+
+    Stats GetStats() const;
+
+  private:
+    RedactionCache(const RedactionCache&) = delete;
+    void operator=(const RedactionCache&) = delete;
+
+    static constexpr size_t kWays = 4;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t num_entries;
+    };
+
+    // Layout of an entry in the table, shared with previous runs through the sidecar file.
+    struct Entry {
+        uint64_t dev;
+        uint64_t ino;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t size;
+        uint32_t state;
+        uint32_t num_ranges;
+        uint64_t last_used;
+        uint64_t checksum;
+        int64_t ranges[kMaxRanges * 2];
+    };
+
+    enum State : uint32_t {
+        kEmpty = 0,
+        kReserved = 1,
+        kValid = 2,
+    };
+
+    bool Map(const std::string& path);
+    // Returns the entry of the file, or if there's none and |create| is set, an empty entry for
+    // it, evicting the least recently used file of its set if needed.
+    Entry* Find(uint64_t dev, uint64_t ino, bool create);
+    static bool Matches(const Entry& entry, const struct stat& st);
+    static uint64_t Checksum(const Entry& entry);
+
+    size_t num_entries_;
+    size_t map_size_;
+    void* map_;
+    bool persistent_;
+
+    mutable std::mutex lock_;
+    // Guarded by |lock_|.
+    Header* header_;
+    Entry* entries_;
+    uint64_t clock_;
+
+    std::atomic_uint64_t hits_;
+    std::atomic_uint64_t misses_;
+    std::atomic_uint64_t invalidations_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_REDACTIONCACHE_H_
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_REDACTIONPARSER_H_
+#define MEDIAPROVIDER_JNI_REDACTIONPARSER_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Computes the ranges of a file holding location metadata, like MediaProvider#getRedactionRanges
+ * does in Java, without an upcall.
+ *
+ * Only the common layouts are parsed: the GPS IFD of the EXIF segment of JPEG files, and the
+ * location boxes of ISO base media files. Files of other types, files laid out in ways the Java
+ * parsers might treat differently, and files whose XMP packet may hold GPS properties are left to
+ * MediaProvider, so that the ranges computed here are always the ones Java would compute.
+ *
+ * The file is read with a bounded number of small preads; nothing is read beyond the metadata.
+ *
+ * @param fd file descriptor opened for read on the file, its offset isn't used
+ * @param path path of the file, its extension determines the type as in MediaProvider
+ * @param ranges set to the ranges to redact, as consecutive pairs of start and end offsets, in
+ * the order MediaProvider returns them
+ * @return true if the ranges were computed, false if MediaProvider has to compute them
+ */
+bool ParseRedactionRanges(int fd, const std::string& path, std::vector<off64_t>* ranges);
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_REDACTIONPARSER_H_
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_SYNCBATCHER_H_
+#define MEDIAPROVIDER_JNI_SYNCBATCHER_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Coalesces concurrent fsyncs of the same file.
+ *
+ * At most one sync of a file runs at a time. The fsyncs of the file that arrive while it runs
+ * wait for it to complete, and the first of them then syncs the file once on behalf of all of
+ * them: every one of them arrived before that sync started, so it covers their writes. The sync
+ * is an fsync if any of them asked for one, and its result is returned to all of them. Syncs of
+ * other files never wait for each other, nor does a request alone.
+ */
+class SyncBatcher {
+  public:
+    struct Stats {
+        // Requests served.
+        uint64_t syncs = 0;
+        // Syncs done on behalf of several requests.
+        uint64_t batches = 0;
+        // Requests in those batches.
+        uint64_t batched = 0;
+    };
+
+    typedef std::function<int(int fd, bool datasync)> SyncFileFunction;
+
+    /**
+     * @param sync_file syncs the file of the fd, returning 0 or -1 with errno set
+     */
+    explicit SyncBatcher(SyncFileFunction sync_file = nullptr);
+
+    /**
+     * Makes the file |fd| durable, like fsync or fdatasync if |datasync| is set.
+     *
+     * @param dev device and |ino| inode of the file, which identify it across fds
+     * @return 0 on success, or the errno of the sync
+     */
+    int Sync(int fd, dev_t dev, ino_t ino, bool datasync);
+
+    Stats GetStats() const;
+
+  private:
+    SyncBatcher(const SyncBatcher&) = delete;
+    void operator=(const SyncBatcher&) = delete;
+
+    struct Group {
+        // Requests waiting for the next sync, where their result goes. The first one does it.
+        std::vector<int*> waiting;
+        // Whether one of them asked for a full fsync.
+        bool full = false;
+        bool running = false;
+    };
+
+    const SyncFileFunction sync_file_;
+
+    std::mutex lock_;
+    // Signaled when a sync completes.
+    std::condition_variable cv_;
+    // Guarded by |lock_|, by device and inode. Groups are removed once idle.
+    std::map<std::pair<dev_t, ino_t>, Group> groups_;
+
+    std::atomic_uint64_t syncs_;
+    std::atomic_uint64_t batches_;
+    std::atomic_uint64_t batched_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_SYNCBATCHER_H_
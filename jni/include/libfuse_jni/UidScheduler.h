@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_UIDSCHEDULER_H_
+#define MEDIAPROVIDER_JNI_UIDSCHEDULER_H_
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * Orders tasks from different uids with start-time fair queuing.
+ *
+ * Every uid has its own FIFO queue. A task is tagged on Push() with a virtual start time,
+ * the later of the current virtual time and the finish time of the previous task of the same
+ * uid, and a finish time of start + cost / weight. RunNext() always runs the queued task with
+ * the smallest start time, so a uid streaming large requests can't hold back another uid for
+ * more than about one request, and foreground uids get |foreground_weight| times the share of
+ * a background uid while both are busy.
+ *
+ * The scheduler doesn't own any thread: callers post one RunNext() to a thread pool for every
+ * task they Push().
+ */
+class UidScheduler {
+  public:
+    struct UidStats {
+        // Number of tasks run.
+        uint64_t count = 0;
+        // Sum and maximum of the time tasks spent queued before running.
+        std::chrono::microseconds total_wait{0};
+        std::chrono::microseconds max_wait{0};
+    };
+
+    explicit UidScheduler(uint32_t foreground_weight);
+
+    /**
+     * Queues |task| for |uid|. |cost| is a relative measure of the work the task represents,
+     * e.g. the number of pages read; it must be at least 1.
+     */
+    void Push(uid_t uid, uint32_t cost, std::function<void()> task);
+
+    /**
+     * Runs the next task according to the fair queuing order, if any.
+     *
+     * Returns false if no task was queued.
+     */
+    bool RunNext();
+
+    /**
+     * Gives |uid| the foreground weight for tasks pushed from now on.
+     */
+    void SetForeground(uid_t uid, bool foreground);
+
+    /**
+     * Returns the number of tasks waiting to run, across all uids.
+     */
+    size_t GetQueueDepth() const;
+
+    /**
+     * Returns the number of uids with a queue, i.e. with tasks waiting to run or that ran ahead
+     * of the current virtual time.
+     */
+    size_t GetQueueCount() const;
+
+    /**
+     * Returns the wait time statistics of every uid that had a task run.
+     */
+    std::map<uid_t, UidStats> GetStats() const;
+
+  private:
+    UidScheduler(const UidScheduler&) = delete;
+    void operator=(const UidScheduler&) = delete;
+
+    struct Task {
+        std::function<void()> run;
+        uint64_t start_tag;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    struct UidQueue {
+        std::deque<Task> tasks;
+        // Finish tag of the last task pushed, the earliest start tag of the next one.
+        uint64_t finish_tag = 0;
+    };
+
+    const uint32_t foreground_weight_;
+
+    mutable std::mutex lock_;
+    // Start tag of the last task run. Guarded by |lock_|.
+    uint64_t virtual_time_;
+    // Queues of the uids with tasks waiting to run. Empty queues are kept to remember their
+    // finish tag until the virtual time catches up with it. Guarded by |lock_|.
+    std::unordered_map<uid_t, UidQueue> queues_;
+    // Start tag and uid of the first task of every non-empty queue. Guarded by |lock_|.
+    std::set<std::pair<uint64_t, uid_t>> heads_;
+    // Finish tag and uid of every empty queue. Guarded by |lock_|.
+    std::set<std::pair<uint64_t, uid_t>> idle_;
+    // Guarded by |lock_|.
+    size_t queue_depth_;
+    // Guarded by |lock_|.
+    std::unordered_set<uid_t> foreground_uids_;
+    // Guarded by |lock_|.
+    std::unordered_map<uid_t, UidStats> stats_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_UIDSCHEDULER_H_
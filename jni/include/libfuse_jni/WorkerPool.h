@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specic language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIAPROVIDER_JNI_WORKERPOOL_H_
+#define MEDIAPROVIDER_JNI_WORKERPOOL_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace mediaprovider {
+namespace fuse {
+
+/**
+ * A bounded pool of threads running tasks in FIFO order.
+ *
+ * The pool starts with |min_threads| threads and grows, up to |max_threads|, whenever
+ * a task is posted while more than |grow_queue_depth| tasks are already waiting and
+ * no thread is idle. Threads above |min_threads| exit after being idle for |idle_timeout|.
+ */
+class WorkerPool {
+  public:
+    struct Options {
+        // Number of threads started up front. These never exit until Shutdown().
+        size_t min_threads = 1;
+        // Upper bound on the number of threads, regardless of the queue depth.
+        size_t max_threads = 1;
+        // Number of queued tasks tolerated before another thread is started.
+        size_t grow_queue_depth = 0;
+        // How long a thread above |min_threads| waits for work before exiting.
+        std::chrono::milliseconds idle_timeout = std::chrono::seconds(10);
+        // CPUs the threads are pinned to. Empty means no affinity.
+        std::vector<int> cpus;
+        // Called on every new thread before it runs its first task.
+        std::function<void()> on_thread_start;
+    };
+
+    WorkerPool(const std::string& name, const Options& options);
+
+    /**
+     * Runs all tasks still queued and waits for every thread to exit.
+     */
+    ~WorkerPool();
+
+    /**
+     * Queues |task| to run on one of the threads of the pool.
+     *
+     * Must not be called after Shutdown().
+     */
+    void Post(std::function<void()> task);
+
+    /**
+     * Stops accepting work, runs the tasks still queued and waits for every thread to exit.
+     */
+    void Shutdown();
+
+    /**
+     * Returns the number of threads currently alive.
+     */
+    size_t GetThreadCount() const;
+
+    /**
+     * Returns the number of tasks waiting for a thread.
+     */
+    size_t GetQueueDepth() const;
+
+  private:
+    WorkerPool(const WorkerPool&) = delete;
+    void operator=(const WorkerPool&) = delete;
+
+    // Starts a new thread. Must be called with |lock_| held.
+    void StartThreadLocked();
+    void ThreadLoop();
+
+    const std::string name_;
+    const Options options_;
+
+    mutable std::mutex lock_;
+    std::condition_variable work_cv_;
+    std::condition_variable exit_cv_;
+    std::queue<std::function<void()>> queue_;
+    // Number of alive threads. Guarded by |lock_|.
+    size_t threads_;
+    // Number of threads waiting for work. Guarded by |lock_|.
+    size_t idle_threads_;
+    // Guarded by |lock_|.
+    bool shutdown_;
+};
+
+}  // namespace fuse
+}  // namespace mediaprovider
+
+#endif  // MEDIAPROVIDER_JNI_WORKERPOOL_H_
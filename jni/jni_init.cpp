@@ -21,6 +21,7 @@
 
 namespace mediaprovider {
 int register_android_providers_media_FuseDaemon(JavaVM* vm, JNIEnv* env);
+void register_android_providers_media_scan_DirWalker(JNIEnv* env);
 }
 
 extern "C" jint JNI_OnLoad(JavaVM* vm, void* /* reserved */) {
@@ -31,6 +32,7 @@ extern "C" jint JNI_OnLoad(JavaVM* vm, void* /* reserved */) {
     }
 
     mediaprovider::register_android_providers_media_FuseDaemon(vm, env);
+    mediaprovider::register_android_providers_media_scan_DirWalker(env);
 
     return JNI_VERSION_1_6;
 }
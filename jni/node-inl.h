@@ -19,7 +19,12 @@
 
 #include <android-base/logging.h>
 
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <limits>
 #include <list>
 #include <memory>
@@ -31,7 +36,9 @@
 #include <utility>
 #include <vector>
 
+#include "libfuse_jni/LowerFileTable.h"
 #include "libfuse_jni/ReaddirHelper.h"
+#include "libfuse_jni/ReadaheadTracker.h"
 #include "libfuse_jni/RedactionInfo.h"
 
 class NodeTest;
@@ -40,15 +47,59 @@ namespace mediaprovider {
 namespace fuse {
 
 struct handle {
-    explicit handle(int fd, const RedactionInfo* ri, bool cached) : fd(fd), ri(ri), cached(cached) {
+    explicit handle(std::shared_ptr<LowerFile> file, const RedactionInfo* ri, bool cached)
+        : ri(ri), cached(cached), file_(std::move(file)), fd_(file_->fd) {
+        CHECK(ri != nullptr);
+    }
+
+    explicit handle(int fd, const RedactionInfo* ri, bool cached)
+        : handle(std::make_shared<LowerFile>(fd), ri, cached) {}
+
+    // A handle whose lower file is only opened by |opener| once it's first needed, for opens
+    // that may never read.
+    explicit handle(std::function<std::shared_ptr<LowerFile>()> opener, const RedactionInfo* ri,
+                    bool cached)
+        : ri(ri), cached(cached), opener_(std::move(opener)), fd_(-1) {
         CHECK(ri != nullptr);
     }
 
-    const int fd;
+    /**
+     * Returns the fd of the lower file, opening it first if needed. The file may be shared with
+     * other handles of the same file, so it must only be accessed at explicit offsets.
+     *
+     * @return the fd, or -1 with errno set if the file couldn't be opened
+     */
+    int GetFd() {
+        const int fd = fd_.load(std::memory_order_acquire);
+        if (fd >= 0) return fd;
+
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!file_) {
+            file_ = opener_();
+            if (!file_) return -1;
+            fd_.store(file_->fd, std::memory_order_release);
+        }
+        return file_->fd;
+    }
+
+    // Whether the lower file has been opened.
+    bool IsMaterialized() const { return fd_.load(std::memory_order_acquire) >= 0; }
+
+    // The lower file, or nullptr if it hasn't been opened. It never changes once opened.
+    const LowerFile* GetFile() const { return IsMaterialized() ? file_.get() : nullptr; }
+
     const std::unique_ptr<const RedactionInfo> ri;
     const bool cached;
+    // Detects sequential reads, to read ahead for direct_io handles.
+    ReadaheadTracker readahead;
 
-    ~handle() { close(fd); }
+  private:
+    std::mutex lock_;
+    // Guarded by |lock_|, null until the lower file is opened.
+    std::shared_ptr<LowerFile> file_;
+    const std::function<std::shared_ptr<LowerFile>()> opener_;
+    // fd of |file_|, or -1 if it's not open yet.
+    std::atomic_int fd_;
 };
 
 struct dirhandle {
@@ -87,6 +138,9 @@ class NodeTracker {
     }
 
     void NodeDeleted(const node* node) {
+        if (on_deleted_) {
+            on_deleted_(node);
+        }
         if (kEnableInodeTracking) {
             std::lock_guard<std::recursive_mutex> guard(*lock_);
             LOG(DEBUG) << "Node: " << reinterpret_cast<uintptr_t>(node) << " deleted.";
@@ -106,9 +160,15 @@ class NodeTracker {
         }
     }
 
+    // Calls |on_deleted| with every node right before it's deleted, with the lock held.
+    void SetDeletedCallback(std::function<void(const node*)> on_deleted) {
+        on_deleted_ = std::move(on_deleted);
+    }
+
   private:
     std::recursive_mutex* lock_;
     std::unordered_set<const node*> active_nodes_;
+    std::function<void(const node*)> on_deleted_;
 };
 
 class node {
@@ -206,6 +266,58 @@ class node {
         deleted_ = true;
     }
 
+    // Records that the kernel may be caching the contents of this directory. The cache outlives
+    // the directory handles, so this stays set for as long as the kernel knows about this node.
+    void SetListingCached() {
+        std::lock_guard<std::recursive_mutex> guard(*lock_);
+
+        listing_cached_ = true;
+    }
+
+    bool IsListingCached() const {
+        std::lock_guard<std::recursive_mutex> guard(*lock_);
+
+        return listing_cached_;
+    }
+
+    // Returns true and the attributes of this node in |st| if they were cached less than
+    // |max_age| ago. Otherwise returns false and the generation to cache them with in
+    // |generation|, which must be read before they are.
+    bool GetCachedAttr(struct stat* st, std::chrono::steady_clock::duration max_age,
+                       uint64_t* generation) const {
+        std::lock_guard<std::recursive_mutex> guard(*lock_);
+
+        if (!cached_attr_ || cached_attr_->generation != attr_generation_ ||
+            std::chrono::steady_clock::now() - cached_attr_->time >= max_age) {
+            *generation = attr_generation_;
+            return false;
+        }
+        *st = cached_attr_->st;
+        return true;
+    }
+
+    // Caches the attributes of this node, unless they were invalidated since |generation|.
+    void SetCachedAttr(const struct stat& st, uint64_t generation) {
+        std::lock_guard<std::recursive_mutex> guard(*lock_);
+
+        if (generation != attr_generation_) {
+            return;
+        }
+        if (!cached_attr_) {
+            cached_attr_ = std::make_unique<CachedAttr>();
+        }
+        cached_attr_->st = st;
+        cached_attr_->time = std::chrono::steady_clock::now();
+        cached_attr_->generation = generation;
+    }
+
+    // Forgets the cached attributes of this node, e.g. because the file was changed.
+    void InvalidateCachedAttr() {
+        std::lock_guard<std::recursive_mutex> guard(*lock_);
+
+        attr_generation_++;
+    }
+
     void Rename(const std::string& name, node* new_parent) {
         std::lock_guard<std::recursive_mutex> guard(*lock_);
 
@@ -252,6 +364,11 @@ class node {
         return name_;
     }
 
+    bool HasChildren() const {
+        std::lock_guard<std::recursive_mutex> guard(*lock_);
+        return !children_.empty();
+    }
+
     node* GetParent() const {
         std::lock_guard<std::recursive_mutex> guard(*lock_);
         return parent_;
@@ -310,6 +427,8 @@ class node {
           refcount_(0),
           parent_(nullptr),
           deleted_(false),
+          listing_cached_(false),
+          attr_generation_(0),
           lock_(lock),
           tracker_(tracker) {
         tracker_->NodeCreated(this);
@@ -417,6 +536,17 @@ class node {
     // List of directory handles associated with this node. Guarded by |lock_|.
     std::vector<std::unique_ptr<dirhandle>> dirhandles_;
     bool deleted_;
+    // Whether the kernel may be caching the listing of this directory. Guarded by |lock_|.
+    bool listing_cached_;
+    struct CachedAttr {
+        struct stat st;
+        std::chrono::steady_clock::time_point time;
+        uint64_t generation;
+    };
+    // The attributes of this node as of |time|, allocated once first cached since most nodes
+    // never are, and valid while their generation is the current one. Guarded by |lock_|.
+    std::unique_ptr<CachedAttr> cached_attr_;
+    uint64_t attr_generation_;
     std::recursive_mutex* lock_;
 
     NodeTracker* const tracker_;
@@ -2,13 +2,17 @@
 
 #include "node-inl.h"
 
+#include <fcntl.h>
+
 #include <algorithm>
 #include <limits>
 #include <memory>
 #include <mutex>
+#include <set>
 
 using mediaprovider::fuse::dirhandle;
 using mediaprovider::fuse::handle;
+using mediaprovider::fuse::LowerFile;
 using mediaprovider::fuse::node;
 using mediaprovider::fuse::NodeTracker;
 
@@ -156,6 +160,52 @@ TEST_F(NodeTest, TestSetDeleted) {
     ASSERT_EQ(nullptr, parent->LookupChildByName("subdir", false /* acquire */));
 }
 
+TEST_F(NodeTest, TestListingCached) {
+    unique_node_ptr dir = CreateNode(nullptr, "/path");
+
+    unique_node_ptr child = CreateNode(dir.get(), "subdir");
+
+    ASSERT_FALSE(dir->IsListingCached());
+    dir->SetListingCached();
+    ASSERT_TRUE(dir->IsListingCached());
+    ASSERT_FALSE(child->IsListingCached());
+}
+
+TEST_F(NodeTest, TestCachedAttr) {
+    unique_node_ptr node = CreateNode(nullptr, "/path");
+    struct stat st = {};
+    st.st_size = 42;
+    struct stat cached = {};
+    uint64_t generation;
+
+    ASSERT_FALSE(node->GetCachedAttr(&cached, std::chrono::hours(1), &generation));
+    node->SetCachedAttr(st, generation);
+    ASSERT_TRUE(node->GetCachedAttr(&cached, std::chrono::hours(1), &generation));
+    ASSERT_EQ(42, cached.st_size);
+    // Too old
+    ASSERT_FALSE(node->GetCachedAttr(&cached, std::chrono::seconds(0), &generation));
+
+    node->InvalidateCachedAttr();
+    ASSERT_FALSE(node->GetCachedAttr(&cached, std::chrono::hours(1), &generation));
+    st.st_size = 43;
+    node->SetCachedAttr(st, generation);
+    ASSERT_TRUE(node->GetCachedAttr(&cached, std::chrono::hours(1), &generation));
+    ASSERT_EQ(43, cached.st_size);
+}
+
+TEST_F(NodeTest, TestCachedAttrInvalidatedWhileStating) {
+    unique_node_ptr node = CreateNode(nullptr, "/path");
+    struct stat st = {};
+    struct stat cached = {};
+    uint64_t generation;
+
+    ASSERT_FALSE(node->GetCachedAttr(&cached, std::chrono::hours(1), &generation));
+    // The file changes after it was stat'ed, but before its attributes are cached
+    node->InvalidateCachedAttr();
+    node->SetCachedAttr(st, generation);
+    ASSERT_FALSE(node->GetCachedAttr(&cached, std::chrono::hours(1), &generation));
+}
+
 TEST_F(NodeTest, DeleteTree) {
     unique_node_ptr parent = CreateNode(nullptr, "/path");
 
@@ -170,6 +220,21 @@ TEST_F(NodeTest, DeleteTree) {
     ASSERT_EQ(nullptr, parent->LookupChildByName("subdir", false /* acquire */));
 }
 
+TEST_F(NodeTest, DeleteTreeCallsDeletedCallback) {
+    unique_node_ptr parent = CreateNode(nullptr, "/path");
+    node* child = node::Create(parent.get(), "subdir", &lock_, &tracker_);
+    node* subchild = node::Create(child, "s1", &lock_, &tracker_);
+    ASSERT_TRUE(parent->HasChildren());
+    ASSERT_FALSE(subchild->HasChildren());
+
+    std::set<const node*> deleted;
+    tracker_.SetDeletedCallback([&deleted](const node* node) { deleted.insert(node); });
+    node::DeleteTree(child);
+    ASSERT_EQ(std::set<const node*>({child, subchild}), deleted);
+    ASSERT_FALSE(parent->HasChildren());
+    tracker_.SetDeletedCallback(nullptr);
+}
+
 TEST_F(NodeTest, LookupChildByName_empty) {
     unique_node_ptr parent = CreateNode(nullptr, "/path");
     unique_node_ptr child = CreateNode(parent.get(), "subdir");
@@ -233,6 +298,57 @@ TEST_F(NodeTest, AddDestroyHandle) {
     EXPECT_DEATH(node->DestroyHandle(h2.get()), "");
 }
 
+TEST_F(NodeTest, DestroyHandleSharingLowerFile) {
+    unique_node_ptr node = CreateNode(nullptr, "/path");
+
+    auto file = std::make_shared<LowerFile>(open("/dev/null", O_RDONLY | O_CLOEXEC));
+    ASSERT_GE(file->fd, 0);
+    handle* h1 = new handle(file, new mediaprovider::fuse::RedactionInfo, true /* cached */);
+    handle* h2 = new handle(file, new mediaprovider::fuse::RedactionInfo, true /* cached */);
+    node->AddHandle(h1);
+    node->AddHandle(h2);
+    ASSERT_EQ(h1->GetFd(), h2->GetFd());
+
+    // The fd stays open as long as a handle uses it
+    const int fd = file->fd;
+    file.reset();
+    node->DestroyHandle(h1);
+    ASSERT_NE(-1, fcntl(fd, F_GETFD));
+    ASSERT_TRUE(node->HasCachedHandle());
+
+    node->DestroyHandle(h2);
+    ASSERT_EQ(-1, fcntl(fd, F_GETFD));
+}
+
+TEST_F(NodeTest, LazyHandleOpensOnFirstUse) {
+    int opens = 0;
+    handle h(
+            [&opens]() {
+                opens++;
+                return std::make_shared<LowerFile>(open("/dev/null", O_RDONLY | O_CLOEXEC));
+            },
+            new mediaprovider::fuse::RedactionInfo, false /* cached */);
+    ASSERT_FALSE(h.IsMaterialized());
+    ASSERT_EQ(0, opens);
+
+    const int fd = h.GetFd();
+    ASSERT_GE(fd, 0);
+    ASSERT_TRUE(h.IsMaterialized());
+    ASSERT_EQ(fd, h.GetFd());
+    ASSERT_EQ(1, opens);
+}
+
+TEST_F(NodeTest, LazyHandleOpenFailure) {
+    handle h([]() -> std::shared_ptr<LowerFile> {
+                errno = ENOENT;
+                return nullptr;
+             },
+             new mediaprovider::fuse::RedactionInfo, false /* cached */);
+    ASSERT_EQ(-1, h.GetFd());
+    ASSERT_EQ(ENOENT, errno);
+    ASSERT_FALSE(h.IsMaterialized());
+}
+
 TEST_F(NodeTest, CaseInsensitive) {
     unique_node_ptr parent = CreateNode(nullptr, "/path");
     unique_node_ptr mixed_child = CreateNode(parent.get(), "cHiLd");
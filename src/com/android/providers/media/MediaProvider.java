@@ -423,6 +423,8 @@ public class MediaProvider extends ContentProvider {
     private final SparseArray<LocalCallingIdentity> mCachedCallingIdentity = new SparseArray<>();
 
     private final OnOpActiveChangedListener mActiveListener = (code, uid, packageName, active) -> {
+        // Apps using the camera are latency sensitive, let their FUSE requests go first
+        ExternalStorageServiceImpl.setPackageForeground(uid, packageName, active);
         synchronized (mCachedCallingIdentity) {
             if (active) {
                 // TODO moltmann: Set correct featureId
@@ -1112,20 +1114,37 @@ public class MediaProvider extends ContentProvider {
     }
 
     /**
-     * Called when a new file is created through FUSE
+     * Called when new files are created through FUSE. FUSE batches the files created while
+     * the previous call was running.
      *
-     * @param file path of the file that was created
+     * @param paths paths of the files that were created
      *
      * Called from JNI in jni/MediaProviderWrapper.cpp
      */
     @Keep
-    public void onFileCreatedForFuse(String path) {
-        // Make sure we update the quota type of the file
-        BackgroundThread.getExecutor().execute(() -> {
+    public void onFilesCreatedForFuse(String[] paths) {
+        // Make sure we update the quota type of the files
+        BackgroundThread.getExecutor().execute(() -> updateQuotaTypeForFilesInternal(paths));
+    }
+
+    /**
+     * Updates the quota type of the files created at {@code paths}, skipping those that are gone
+     * since. Returns the number of files updated.
+     */
+    @VisibleForTesting
+    int updateQuotaTypeForFilesInternal(@NonNull String[] paths) {
+        int updated = 0;
+        for (String path : paths) {
             File file = new File(path);
+            if (!file.exists()) {
+                // Deleted or renamed away before the batch ran
+                continue;
+            }
             int mediaType = MimeUtils.resolveMediaType(MimeUtils.resolveMimeType(file));
             updateQuotaTypeForFileInternal(file, mediaType);
-        });
+            updated++;
+        }
+        return updated;
     }
 
     /**
@@ -2710,10 +2729,19 @@ public class MediaProvider extends ContentProvider {
             }
 
             // Ensure all parent folders of result file exist
+            File firstMissingDir = null;
+            for (File dir = res.getParentFile(); dir != null && !dir.exists();
+                    dir = dir.getParentFile()) {
+                firstMissingDir = dir;
+            }
             res.getParentFile().mkdirs();
             if (!res.getParentFile().exists()) {
                 throw new IllegalStateException("Failed to create directory: " + res);
             }
+            if (firstMissingDir != null) {
+                // The listing of its parent may be cached by FUSE
+                invalidateFuseDentry(firstMissingDir);
+            }
             values.put(MediaColumns.DATA, res.getAbsolutePath());
             // buildFile may have changed the file name, compute values to extract new DISPLAY_NAME.
             // Note: We can't extract displayName from res.getPath() because for pending & trashed
@@ -6362,10 +6390,17 @@ public class MediaProvider extends ContentProvider {
             IsoInterface.BOX_GPS0,
     };
 
+    /**
+     * Redaction status returned by {@link #onFileOpenForFuse} when ranges need to be redacted
+     * and the caller calculates them.
+     */
+    private static final long REDACTION_DEFERRED = -1;
+
     public static final Set<String> sRedactedExifTags = new ArraySet<>(
             Arrays.asList(REDACTED_EXIF_TAGS));
 
-    private static final class RedactionInfo {
+    @VisibleForTesting
+    static final class RedactionInfo {
         public final long[] redactionRanges;
         public final long[] freeOffsets;
         public RedactionInfo(long[] redactionRanges, long[] freeOffsets) {
@@ -6390,31 +6425,35 @@ public class MediaProvider extends ContentProvider {
     @Keep
     @NonNull
     public long[] getRedactionRangesForFuse(String path, int uid, int tid) throws IOException {
-        final File file = new File(path);
+        if (!isRedactionNeededForFuse(path, uid, tid)) {
+            return new long[0];
+        }
+        return getRedactionRanges(new File(path)).redactionRanges;
+    }
 
+    /**
+     * Checks if the ranges containing sensitive metadata of the given file need to be redacted
+     * for the given user that wants to access the file.
+     *
+     * @throws IOException if the file couldn't be found in the database
+     */
+    private boolean isRedactionNeededForFuse(String path, int uid, int tid) throws IOException {
         // When we're calculating redaction ranges for MediaProvider, it means we're actually
         // calculating redaction ranges for another app that called to MediaProvider through Binder.
         // If the tid is in mShouldRedactThreadIds, we should redact, otherwise, we don't redact
         if (uid == android.os.Process.myUid()) {
-            boolean shouldRedact = false;
             synchronized (mShouldRedactThreadIds) {
-                shouldRedact = mShouldRedactThreadIds.indexOf(tid) != -1;
-            }
-            if (shouldRedact) {
-                return getRedactionRanges(file).redactionRanges;
-            } else {
-                return new long[0];
+                return mShouldRedactThreadIds.indexOf(tid) != -1;
             }
         }
 
         final LocalCallingIdentity token =
                 clearLocalCallingIdentity(getCachedCallingIdentityForFuse(uid));
 
-        long[] res = new long[0];
         try {
             if (!isRedactionNeeded()
                     || shouldBypassFuseRestrictions(/*forWrite*/ false, path)) {
-                return res;
+                return false;
             }
 
             final Uri contentUri = FileUtils.getContentUriForPath(path);
@@ -6444,13 +6483,10 @@ public class MediaProvider extends ContentProvider {
                     item, mCallingIdentity.get().pid, mCallingIdentity.get().uid,
                     Intent.FLAG_GRANT_WRITE_URI_PERMISSION) == PERMISSION_GRANTED;
 
-            if (!callerIsOwner && !callerHasUriPermission) {
-                res = getRedactionRanges(file).redactionRanges;
-            }
+            return !callerIsOwner && !callerHasUriPermission;
         } finally {
             restoreLocalCallingIdentity(token);
         }
-        return res;
     }
 
     /**
@@ -6591,6 +6627,54 @@ public class MediaProvider extends ContentProvider {
         }
     }
 
+    /**
+     * Checks if the app with the given {@code uid} is allowed to open the file denoted by
+     * {@code path} and, if so, calculates the ranges to redact for it, saving FUSE an upcall
+     * on every open.
+     *
+     * @param path File path
+     * @param uid UID of the package wanting to open the file
+     * @param tid thread id making IO on the FUSE filesystem
+     * @param forWrite specifies if the file is to be opened for write
+     * @param redact whether redaction ranges should be calculated at all
+     * @param nativeRedaction whether the caller calculates the redaction ranges itself, in which
+     * case this only checks whether they need to be redacted
+     * @return an array holding the result of {@link #isOpenAllowedForFuse}, then 0 or an errno
+     * value if the redaction ranges couldn't be calculated, or {@link #REDACTION_DEFERRED}, then
+     * the ranges as returned by {@link #getRedactionRangesForFuse}. Ranges are only calculated if
+     * the open is allowed and {@code redact} is {@code true}.
+     *
+     * Called from JNI in jni/MediaProviderWrapper.cpp
+     */
+    @Keep
+    @NonNull
+    public long[] onFileOpenForFuse(String path, int uid, int tid, boolean forWrite,
+            boolean redact, boolean nativeRedaction) {
+        final int status = isOpenAllowedForFuse(path, uid, forWrite);
+        if (status != 0 || !redact) {
+            return new long[] { status, 0 };
+        }
+
+        final long[] ranges;
+        try {
+            if (!isRedactionNeededForFuse(path, uid, tid)) {
+                ranges = new long[0];
+            } else if (nativeRedaction) {
+                return new long[] { status, REDACTION_DEFERRED };
+            } else {
+                ranges = getRedactionRanges(new File(path)).redactionRanges;
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "Failed to calculate redaction ranges for " + path, e);
+            return new long[] { status, OsConstants.EIO };
+        }
+
+        final long[] res = new long[ranges.length + 2];
+        res[0] = status;
+        System.arraycopy(ranges, 0, res, 2, ranges.length);
+        return res;
+    }
+
     /**
      * Returns {@code true} if {@link #mCallingIdentity#getSharedPackages(String)} contains the
      * given package name, {@code false} otherwise.
@@ -34,9 +34,13 @@ import com.android.providers.media.MediaProvider;
 import com.android.providers.media.MediaService;
 
 import java.io.File;
+import java.io.FileDescriptor;
 import java.io.IOException;
+import java.io.PrintWriter;
 import java.util.HashMap;
+import java.util.HashSet;
 import java.util.Map;
+import java.util.Set;
 
 /**
  * Handles filesystem I/O from other apps.
@@ -46,6 +50,8 @@ public final class ExternalStorageServiceImpl extends ExternalStorageService {
 
     private static final Object sLock = new Object();
     private static final Map<String, FuseDaemon> sFuseDaemons = new HashMap<>();
+    // Packages in the foreground by uid, a uid stays in the foreground until all are gone
+    private static final Map<Integer, Set<String>> sForegroundPackages = new HashMap<>();
 
     @Override
     public void onStartSession(String sessionId, /* @SessionFlag */ int flag,
@@ -64,6 +70,9 @@ public final class ExternalStorageServiceImpl extends ExternalStorageService {
                 FuseDaemon daemon = new FuseDaemon(mediaProvider, this, deviceFd, sessionId,
                         upperFileSystemPath.getPath());
                 daemon.start();
+                for (int uid : sForegroundPackages.keySet()) {
+                    daemon.setUidForeground(uid, true);
+                }
                 sFuseDaemons.put(sessionId, daemon);
             }
         }
@@ -122,6 +131,49 @@ public final class ExternalStorageServiceImpl extends ExternalStorageService {
         }
     }
 
+    /**
+     * Gives FUSE requests from {@code uid} a higher share of the FUSE threads of every session,
+     * including sessions started later, while {@code packageName} or another package of the same
+     * uid is in the foreground
+     */
+    public static void setPackageForeground(int uid, @NonNull String packageName,
+            boolean foreground) {
+        synchronized (sLock) {
+            final boolean wasForeground = sForegroundPackages.containsKey(uid);
+            Set<String> packages = sForegroundPackages.get(uid);
+            if (foreground) {
+                if (packages == null) {
+                    packages = new HashSet<>();
+                    sForegroundPackages.put(uid, packages);
+                }
+                packages.add(packageName);
+            } else if (packages != null) {
+                packages.remove(packageName);
+                if (packages.isEmpty()) {
+                    sForegroundPackages.remove(uid);
+                }
+            }
+
+            final boolean isForeground = sForegroundPackages.containsKey(uid);
+            if (isForeground != wasForeground) {
+                for (FuseDaemon daemon : sFuseDaemons.values()) {
+                    daemon.setUidForeground(uid, isForeground);
+                }
+            }
+        }
+    }
+
+    @Override
+    protected void dump(FileDescriptor fd, PrintWriter writer, String[] args) {
+        synchronized (sLock) {
+            writer.println("Foreground packages: " + sForegroundPackages);
+            for (Map.Entry<String, FuseDaemon> entry : sFuseDaemons.entrySet()) {
+                writer.println("FUSE session " + entry.getKey() + ":");
+                entry.getValue().dump(writer);
+            }
+        }
+    }
+
     private MediaProvider getMediaProvider() {
         try (ContentProviderClient cpc =
                 getContentResolver().acquireContentProviderClient(MediaStore.AUTHORITY)) {
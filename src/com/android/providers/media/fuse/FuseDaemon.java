@@ -20,10 +20,12 @@ import android.os.ParcelFileDescriptor;
 import android.util.Log;
 
 import androidx.annotation.NonNull;
+import androidx.annotation.VisibleForTesting;
 
 import com.android.internal.annotations.GuardedBy;
 import com.android.providers.media.MediaProvider;
 
+import java.io.PrintWriter;
 import java.util.Objects;
 
 /**
@@ -151,6 +153,33 @@ public final class FuseDaemon extends Thread {
         }
     }
 
+    /**
+     * Gives requests from {@code uid} a higher share of the FUSE worker threads while
+     * {@code foreground} is {@code true}
+     */
+    public void setUidForeground(int uid, boolean foreground) {
+        synchronized (mLock) {
+            if (mPtr == 0) {
+                Log.i(TAG, "setUidForeground failed, FUSE daemon unavailable");
+                return;
+            }
+            native_set_uid_foreground(mPtr, uid, foreground);
+        }
+    }
+
+    /**
+     * Dumps the state of the native FUSE daemon, e.g. per-uid request wait times
+     */
+    public void dump(@NonNull PrintWriter writer) {
+        synchronized (mLock) {
+            if (mPtr == 0) {
+                writer.println("FUSE daemon unavailable");
+                return;
+            }
+            writer.print(native_dump(mPtr));
+        }
+    }
+
     private native long native_new(MediaProvider mediaProvider);
 
     // Takes ownership of the passed in file descriptor!
@@ -161,5 +190,16 @@ public final class FuseDaemon extends Thread {
             int fd);
     private native void native_invalidate_fuse_dentry_cache(long daemon, String path);
     private native boolean native_is_started(long daemon);
+    private native void native_set_uid_foreground(long daemon, int uid, boolean foreground);
+    private native String native_dump(long daemon);
     public static native boolean native_is_fuse_thread();
+
+    /**
+     * Calculates the redaction ranges of {@code path} the way the FUSE daemon does, so that they
+     * can be compared with the ones calculated by {@link MediaProvider#getRedactionRanges}.
+     *
+     * @return the ranges, or {@code null} if the daemon leaves them to MediaProvider
+     */
+    @VisibleForTesting
+    public static native long[] native_get_redaction_ranges(String path);
 }
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.providers.media.scan;
+
+import androidx.annotation.NonNull;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Path;
+import java.nio.file.attribute.BasicFileAttributes;
+import java.nio.file.attribute.FileTime;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Lists directories for a depth first walk of a tree, listing the directories below the ones
+ * listed so far ahead of the walk on native threads. Each listing is read from a single direct
+ * buffer, and carries what {@link ModernMediaScanner} needs of the attributes of each entry.
+ */
+final class DirWalker implements AutoCloseable {
+    // See DirWalker.h for the layout of listings
+    private static final int RECORD_HEADER_SIZE = 20;
+    private static final int DT_DIR = 4;
+    private static final int DT_REG = 8;
+    private static final int DT_LNK = 10;
+
+    private long mPtr;
+
+    /**
+     * An entry of a directory.
+     */
+    static final class Entry {
+        final String name;
+        final BasicFileAttributes attrs;
+
+        Entry(String name, BasicFileAttributes attrs) {
+            this.name = name;
+            this.attrs = attrs;
+        }
+    }
+
+    /**
+     * @param threads number of threads listing ahead of the walk
+     * @param maxBufferedBytes size of the listings not walked yet above which no more
+     * directories are listed ahead
+     * @param skipPattern regex of the paths of directories the walk always skips, matched
+     * ignoring case, which are never listed ahead. It is matched natively with ECMAScript
+     * syntax, which Java patterns without flags or possessive quantifiers share.
+     */
+    DirWalker(int threads, int maxBufferedBytes, @NonNull String skipPattern) {
+        mPtr = native_new(threads, maxBufferedBytes, skipPattern);
+    }
+
+    /**
+     * Returns the entries of {@code dir} other than . and .., and starts listing the directories
+     * among them ahead. Each directory should be listed once.
+     */
+    @NonNull
+    List<Entry> list(@NonNull Path dir) throws IOException {
+        final ByteBuffer buf = native_list(mPtr, dir.toString()).order(ByteOrder.nativeOrder());
+        final List<Entry> entries = new ArrayList<>();
+        while (buf.remaining() >= RECORD_HEADER_SIZE) {
+            final long size = buf.getLong();
+            final long mtimeMs = buf.getLong();
+            final int nameLen = buf.getShort() & 0xffff;
+            final int type = buf.get() & 0xff;
+            buf.get();
+            final byte[] name = new byte[nameLen];
+            buf.get(name);
+            entries.add(new Entry(new String(name, StandardCharsets.UTF_8),
+                    new Attributes(type, size, mtimeMs)));
+        }
+        return entries;
+    }
+
+    /**
+     * Stops listing ahead below {@code dir}, which the walk skips.
+     */
+    void prune(@NonNull Path dir) {
+        native_prune(mPtr, dir.toString());
+    }
+
+    @Override
+    public void close() {
+        if (mPtr != 0) {
+            native_delete(mPtr);
+            mPtr = 0;
+        }
+    }
+
+    /**
+     * Attributes of an entry, as listed natively. Only the type, size and last modified time are
+     * known, which the other times default to.
+     */
+    private static final class Attributes implements BasicFileAttributes {
+        private final int mType;
+        private final long mSize;
+        private final FileTime mLastModifiedTime;
+
+        Attributes(int type, long size, long lastModifiedTimeMs) {
+            mType = type;
+            mSize = size;
+            mLastModifiedTime = FileTime.from(lastModifiedTimeMs, TimeUnit.MILLISECONDS);
+        }
+
+        @Override
+        public FileTime lastModifiedTime() {
+            return mLastModifiedTime;
+        }
+
+        @Override
+        public FileTime lastAccessTime() {
+            return mLastModifiedTime;
+        }
+
+        @Override
+        public FileTime creationTime() {
+            return mLastModifiedTime;
+        }
+
+        @Override
+        public boolean isRegularFile() {
+            return mType == DT_REG;
+        }
+
+        @Override
+        public boolean isDirectory() {
+            return mType == DT_DIR;
+        }
+
+        @Override
+        public boolean isSymbolicLink() {
+            return mType == DT_LNK;
+        }
+
+        @Override
+        public boolean isOther() {
+            return !isRegularFile() && !isDirectory() && !isSymbolicLink();
+        }
+
+        @Override
+        public long size() {
+            return mSize;
+        }
+
+        @Override
+        public Object fileKey() {
+            return null;
+        }
+    }
+
+    private static native long native_new(int threads, int maxBufferedBytes,
+            String skipPattern);
+    private static native void native_delete(long ptr);
+    private static native ByteBuffer native_list(long ptr, String path) throws IOException;
+    private static native void native_prune(long ptr, String path);
+}
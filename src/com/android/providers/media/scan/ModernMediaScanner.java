@@ -69,6 +69,7 @@ import android.os.Environment;
 import android.os.OperationCanceledException;
 import android.os.RemoteException;
 import android.os.SystemClock;
+import android.os.SystemProperties;
 import android.os.Trace;
 import android.provider.MediaStore;
 import android.provider.MediaStore.Audio.AudioColumns;
@@ -104,6 +105,7 @@ import java.io.IOException;
 import java.nio.file.FileVisitResult;
 import java.nio.file.FileVisitor;
 import java.nio.file.Files;
+import java.nio.file.LinkOption;
 import java.nio.file.Path;
 import java.nio.file.attribute.BasicFileAttributes;
 import java.text.ParseException;
@@ -111,6 +113,7 @@ import java.text.SimpleDateFormat;
 import java.util.ArrayList;
 import java.util.Arrays;
 import java.util.Iterator;
+import java.util.List;
 import java.util.Locale;
 import java.util.Map;
 import java.util.Objects;
@@ -157,11 +160,25 @@ public class ModernMediaScanner implements MediaScanner {
 
     private static final int BATCH_SIZE = 32;
 
+    /**
+     * Whether directories are listed ahead of the walk on native threads, see
+     * {@link DirWalker}, how many, and how much they may list ahead.
+     */
+    private static final String PROP_NATIVE_WALK = "persist.sys.fuse.scanner_native_walk";
+    private static final int NATIVE_WALK_THREADS = 4;
+    private static final int NATIVE_WALK_MAX_BUFFERED_BYTES = 4 * 1024 * 1024;
+
     private static final Pattern PATTERN_VISIBLE = Pattern.compile(
             "(?i)^/storage/[^/]+(?:/[0-9]+)?(?:/Android/sandbox/([^/]+))?$");
-    private static final Pattern PATTERN_INVISIBLE = Pattern.compile(
-            "(?i)^/storage/[^/]+(?:/[0-9]+)?(?:/Android/sandbox/([^/]+))?/" +
-                    "(?:(?:Android/(?:data|obb)$)|(?:(?:Movies|Music|Pictures)/.thumbnails$))");
+    /**
+     * Directories that are never scanned, whatever their .nomedia, matched ignoring case. Also
+     * given to {@link DirWalker}, which doesn't list them ahead.
+     */
+    private static final String REGEX_INVISIBLE =
+            "^/storage/[^/]+(?:/[0-9]+)?(?:/Android/sandbox/([^/]+))?/" +
+                    "(?:(?:Android/(?:data|obb)$)|(?:(?:Movies|Music|Pictures)/.thumbnails$))";
+    private static final Pattern PATTERN_INVISIBLE = Pattern.compile(REGEX_INVISIBLE,
+            Pattern.CASE_INSENSITIVE);
 
     private static final Pattern PATTERN_YEAR = Pattern.compile("([1-9][0-9][0-9][0-9])");
 
@@ -363,7 +380,11 @@ public class ModernMediaScanner implements MediaScanner {
                     acquireDirectoryLock(mRoot.getParentFile().toPath());
                 }
                 try {
-                    Files.walkFileTree(mRoot.toPath(), this);
+                    if (!mSingleFile && SystemProperties.getBoolean(PROP_NATIVE_WALK, false)) {
+                        walkFileTreeNatively();
+                    } else {
+                        Files.walkFileTree(mRoot.toPath(), this);
+                    }
                     applyPending();
                 } catch (IOException e) {
                     // This should never happen, so yell loudly
@@ -377,6 +398,56 @@ public class ModernMediaScanner implements MediaScanner {
             }
         }
 
+        /**
+         * Walks the tree like {@link Files#walkFileTree(Path, FileVisitor)} does, depth first
+         * without following links, but with directories listed ahead by a {@link DirWalker}.
+         */
+        private void walkFileTreeNatively() throws IOException {
+            final Path root = mRoot.toPath();
+            final BasicFileAttributes attrs;
+            try {
+                attrs = Files.readAttributes(root, BasicFileAttributes.class,
+                        LinkOption.NOFOLLOW_LINKS);
+            } catch (IOException e) {
+                visitFileFailed(root, e);
+                return;
+            }
+            if (!attrs.isDirectory()) {
+                visitFile(root, attrs);
+                return;
+            }
+
+            try (DirWalker walker = new DirWalker(NATIVE_WALK_THREADS,
+                    NATIVE_WALK_MAX_BUFFERED_BYTES, REGEX_INVISIBLE)) {
+                walkDirectory(walker, root, attrs);
+            }
+        }
+
+        private void walkDirectory(DirWalker walker, Path dir, BasicFileAttributes attrs)
+                throws IOException {
+            if (preVisitDirectory(dir, attrs) == FileVisitResult.SKIP_SUBTREE) {
+                walker.prune(dir);
+                return;
+            }
+
+            final List<DirWalker.Entry> entries;
+            try {
+                entries = walker.list(dir);
+            } catch (IOException e) {
+                postVisitDirectory(dir, e);
+                return;
+            }
+            for (DirWalker.Entry entry : entries) {
+                final Path child = dir.resolve(entry.name);
+                if (entry.attrs.isDirectory()) {
+                    walkDirectory(walker, child, entry.attrs);
+                } else {
+                    visitFile(child, entry.attrs);
+                }
+            }
+            postVisitDirectory(dir, null);
+        }
+
         private void reconcileAndClean() {
             final long[] scannedIds = mScannedIds.toArray();
             Arrays.sort(scannedIds);
@@ -102,6 +102,12 @@ public class MediaProviderForFuseTest {
         Truth.assertThat(sMediaProvider.getRedactionRangesForFuse(
                         file.getPath(), sTestUid, 0)).isEqualTo(new long[0]);
 
+        // Both at once: open allowed, redaction ranges calculated and empty
+        Truth.assertThat(sMediaProvider.onFileOpenForFuse(
+                file.getPath(), sTestUid, 0, false, true, false)).isEqualTo(new long[] {0, 0});
+        Truth.assertThat(sMediaProvider.onFileOpenForFuse(
+                file.getPath(), sTestUid, 0, false, true, true)).isEqualTo(new long[] {0, 0});
+
         // We can rename our file
         final File renamed = new File(sTestDir, "renamed" + System.nanoTime() + ".jpg");
         Truth.assertThat(sMediaProvider.renameForFuse(
@@ -118,6 +124,20 @@ public class MediaProviderForFuseTest {
                 sTestDir.getPath(), sTestUid))).doesNotContain(renamed.getName());
     }
 
+    @Test
+    public void testFilesCreatedSkipsMissingFiles() throws Exception {
+        final File missing = new File(sTestDir, "missing" + System.nanoTime() + ".jpg");
+        final File file = new File(sTestDir, "test" + System.nanoTime() + ".jpg");
+        Truth.assertThat(file.createNewFile()).isTrue();
+        try {
+            // The missing file doesn't keep the others of the batch from being updated
+            Truth.assertThat(sMediaProvider.updateQuotaTypeForFilesInternal(new String[] {
+                    missing.getPath(), file.getPath()})).isEqualTo(1);
+        } finally {
+            file.delete();
+        }
+    }
+
     @Test
     public void testRenameDirectory() throws Exception {
         sTestDir = new File(sTestDir, "subdir" + System.nanoTime());
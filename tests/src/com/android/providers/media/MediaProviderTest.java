@@ -61,6 +61,7 @@ import androidx.test.runner.AndroidJUnit4;
 import com.android.providers.media.MediaProvider.FallbackException;
 import com.android.providers.media.MediaProvider.VolumeArgumentException;
 import com.android.providers.media.MediaProvider.VolumeNotFoundException;
+import com.android.providers.media.fuse.FuseDaemon;
 import com.android.providers.media.scan.MediaScannerTest.IsolatedContext;
 import com.android.providers.media.util.FileUtils;
 import com.android.providers.media.util.SQLiteQueryBuilder;
@@ -378,6 +379,35 @@ public class MediaProviderTest {
         assertNotNull(MediaProvider.getRedactionRanges(file));
     }
 
+    /**
+     * The FUSE daemon calculates the redaction ranges of common files itself, and leaves the
+     * others to {@link MediaProvider#getRedactionRanges}; both must agree on every file.
+     */
+    @Test
+    public void testGetRedactionRanges_MatchesNative() throws Exception {
+        System.loadLibrary("fuse_jni");
+
+        final int[] resources = new int[] {
+                R.raw.test_image, R.raw.lg_g4_iso_800_jpg, R.raw.test_video,
+                R.raw.test_video_gps, R.raw.test_video_xmp, R.raw.testvideo_meta };
+        final String[] extensions = new String[] { ".jpg", ".jpg", ".mp4", ".mp4", ".mp4", ".mp4" };
+
+        int compared = 0;
+        for (int i = 0; i < resources.length; i++) {
+            final File file = File.createTempFile("test", extensions[i]);
+            stage(resources[i], file);
+
+            final long[] nativeRanges = FuseDaemon.native_get_redaction_ranges(file.getPath());
+            if (nativeRanges != null) {
+                assertArrayEquals(file.getName(),
+                        MediaProvider.getRedactionRanges(file).redactionRanges, nativeRanges);
+                compared++;
+            }
+            file.delete();
+        }
+        assertTrue(compared > 0);
+    }
+
     @Test
     public void testComputeCommonPrefix_Single() {
         assertEquals(Uri.parse("content://authority/1/2/3"),